@@ -0,0 +1,596 @@
+#include "types.h"
+#define MINIAUDIO_IMPLEMENTATION
+#include "miniaudio.h"
+
+#define SOKOL_IMPL
+#include "sokol_time.h"
+
+#include <enet/enet.h>
+#include "minilzo.h"
+#include "opus.h"
+
+#include <inttypes.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Connects a crowd of headless players to a server to load test it. They speak the same protocol the
+// game does, flying, building, getting into seats and interacting at random, talking into their mics
+// with -voice, and decode every gamestate they're sent like the client would:
+//   flight_bots [bots] [address] [port] [seconds] [-voice]
+// seconds of 0 runs until interrupted. Stats for all of them are reported every BOTS_STATS_INTERVAL
+
+#define BOTS_MAX 1024
+#define BOTS_CONNECT_INTERVAL 0.05 // between each bot connecting, so they don't all arrive on the same tick
+#define BOTS_RECONNECT_TIME 1.0    // after being disconnected, the server might be full
+#define BOTS_STATS_INTERVAL 5.0
+#define BOT_ACTION_MIN_TIME 1.0
+#define BOT_ACTION_MAX_TIME 5.0
+#define BOT_PULSE_TICKS 30 // building, seat and interact inputs are repeated this often during an action
+
+enum BotAction
+{
+	BotFlying,
+	BotBuilding,
+	BotSeating,
+	BotInteracting,
+	BotActionLast,
+};
+
+typedef struct BotStats
+{
+	uint64_t gamestates;
+	uint64_t gamestate_bytes;
+	uint64_t decompressed_bytes;
+	size_t biggest_gamestate;
+	uint64_t failed_gamestates;
+	uint64_t late_parts; // dropped because the world had moved past them
+	uint64_t bytes_sent;
+	uint64_t disconnects;
+
+	double rtt_total;
+	uint64_t rtt_samples;
+
+	double prediction_error_total;
+	double worst_prediction_error;
+	uint64_t predictions;
+
+	uint64_t tick_gap_total;
+	uint64_t worst_tick_gap;
+	uint64_t tick_gaps;
+} BotStats;
+
+typedef struct Bot
+{
+	ENetPeer *peer;
+	bool connected;
+	double reconnect_at; // when the peer is NULL
+
+	// the world as the server last sent it
+	GameState gs;
+	Entity *entity_data;
+	SnapshotCache snapshot_cache;
+	uint64_t last_snapshot_tick;
+	uint32_t gamestate_parts_received;
+	bool has_snapshot;
+	double snapshot_received_at;
+	int my_player_index;
+
+	// how fast it was going at the last gamestate, so the next one can be checked against where that says
+	// it'd be. That's the error a client has to correct for
+	bool has_last_motion;
+	uint64_t last_motion_tick;
+	cpVect last_pos;
+	cpVect last_vel;
+
+	Queue input_queue;
+	char input_queue_data[QUEUE_SIZE_FOR_ELEMENTS(sizeof(InputFrame), LOCAL_INPUT_QUEUE_MAX)];
+	uint64_t last_input_tick;
+	double last_sent_input_time;
+
+	OpusEncoder *encoder; // NULL when it doesn't talk
+	Queue mic_packets;
+	char mic_packets_data[QUEUE_SIZE_FOR_ELEMENTS(sizeof(OpusPacket), VOIP_PACKET_BUFFER_SIZE)];
+	Queue playback_packets; // what the server sent it to hear, thrown away
+	char playback_packets_data[QUEUE_SIZE_FOR_ELEMENTS(sizeof(OpusPacket), VOIP_PACKET_BUFFER_SIZE)];
+	double voice_phase;
+	double voice_frequency;
+	double last_voice_time;
+
+	uint64_t rng;
+	enum BotAction action;
+	double action_time_left;
+	InputFrame action_input; // what it's doing this action, copied into each input frame
+	int ticks_until_pulse;
+} Bot;
+
+static volatile bool should_quit = false;
+static unsigned char decompressed[MAX_SERVER_TO_CLIENT];
+
+void term(int signum)
+{
+	should_quit = true;
+}
+
+static double bot_random(Bot *bot)
+{
+	// xorshift64, each bot has its own so what one does doesn't depend on the others
+	bot->rng ^= bot->rng << 13;
+	bot->rng ^= bot->rng >> 7;
+	bot->rng ^= bot->rng << 17;
+	return (double)(bot->rng >> 11) / (double)(1ULL << 53);
+}
+
+static Entity *bot_entity(Bot *bot)
+{
+	if (!bot->has_snapshot)
+		return NULL;
+	return get_entity(&bot->gs, bot->gs.players[bot->my_player_index].entity);
+}
+
+// the closest box it could get into or interact with, to point its hand at
+static Entity *bot_closest_box(Bot *bot, cpVect from, bool seat)
+{
+	Entity *closest = NULL;
+	double closest_dist = INFINITY;
+	ENTITIES_ITER(&bot->gs, cur)
+	{
+		if (!cur->is_box)
+			continue;
+		if (seat ? !box_enterable(cur) : !box_interactible(&bot->gs, &bot->gs.players[bot->my_player_index], cur))
+			continue;
+		double dist = cpvdist(entity_pos(cur), from);
+		if (dist < closest_dist)
+		{
+			closest = cur;
+			closest_dist = dist;
+		}
+	}
+	return closest;
+}
+
+static void bot_choose_action(Bot *bot)
+{
+	bot->action = (enum BotAction)(bot_random(bot) * BotActionLast);
+	bot->action_time_left = BOT_ACTION_MIN_TIME + bot_random(bot) * (BOT_ACTION_MAX_TIME - BOT_ACTION_MIN_TIME);
+	bot->ticks_until_pulse = 0;
+
+	double angle = bot_random(bot) * 2.0 * PI;
+	bot->action_input = (InputFrame){
+			.take_over_squad = -1,
+			.movement = cpvmult((cpVect){cos(angle), sin(angle)}, bot_random(bot)),
+			.rotation = bot_random(bot) * 2.0 - 1.0,
+	};
+
+	Entity *me = bot_entity(bot);
+	if (bot->action == BotBuilding)
+	{
+		bot->action_input.movement = (cpVect){0};
+		bot->action_input.build_type = BoxHullpiece;
+		bot->action_input.build_rotation = (enum CompassRotation)(bot_random(bot) * RotationLast);
+	}
+	else if ((bot->action == BotSeating || bot->action == BotInteracting) && me != NULL)
+	{
+		Entity *box = bot_closest_box(bot, entity_pos(me), bot->action == BotSeating);
+		if (box == NULL)
+		{
+			bot->action = BotFlying;
+		}
+		else
+		{
+			// the hand reaches it when it's close, until then fly towards it
+			cpVect to_box = cpvsub(entity_pos(box), entity_pos(me));
+			bot->action_input.hand_pos = to_box;
+			bot->action_input.movement = (cpVect){0};
+			if (cpvlength(to_box) > MAX_HAND_REACH)
+			{
+				bot->action_input.hand_pos = cpvmult(cpvnormalize(to_box), MAX_HAND_REACH);
+				bot->action_input.movement = cpvnormalize(to_box);
+			}
+		}
+	}
+}
+
+static InputFrame bot_input(Bot *bot)
+{
+	InputFrame input = bot->action_input;
+	bot->ticks_until_pulse--;
+	if (bot->ticks_until_pulse <= 0)
+	{
+		bot->ticks_until_pulse = BOT_PULSE_TICKS;
+		if (bot->action == BotBuilding)
+		{
+			double angle = bot_random(bot) * 2.0 * PI;
+			input.hand_pos = cpvmult((cpVect){cos(angle), sin(angle)}, MAX_HAND_REACH * bot_random(bot));
+			input.dobuild = true;
+		}
+		input.seat_action = bot->action == BotSeating;
+		input.interact_action = bot->action == BotInteracting;
+	}
+	return input;
+}
+
+static void bot_connect(Bot *bot, ENetHost *host, ENetAddress address, enet_uint32 data)
+{
+	bot->peer = enet_host_connect(host, &address, 2, data);
+	if (bot->peer == NULL)
+	{
+		Log("No free peers to connect a bot with\n");
+		return;
+	}
+	bot->peer->data = bot;
+	bot->connected = false;
+	bot->has_snapshot = false;
+	bot->has_last_motion = false;
+	bot->last_snapshot_tick = 0;
+	bot->gamestate_parts_received = 0;
+	bot->last_input_tick = 0;
+	queue_clear(&bot->input_queue);
+	snapshot_cache_free(&bot->snapshot_cache);
+}
+
+static void bot_receive(Bot *bot, ENetHost *host, ENetPacket *packet, BotStats *stats, double now)
+{
+	stats->gamestate_bytes += packet->dataLength;
+	if (packet->dataLength > stats->biggest_gamestate)
+		stats->biggest_gamestate = packet->dataLength;
+
+	size_t decompressed_len = MAX_SERVER_TO_CLIENT;
+	int return_value = lzo1x_decompress_safe(packet->data, packet->dataLength, decompressed, &decompressed_len, NULL);
+	if (return_value != LZO_E_OK)
+	{
+		Log("Couldn't decompress gamestate packet, error code %d from lzo\n", return_value);
+		stats->failed_gamestates++;
+		return;
+	}
+	stats->decompressed_bytes += decompressed_len;
+	bot->gamestate_parts_received++;
+
+	uint64_t tick_before = tick(&bot->gs);
+	ServerToClient msg = (ServerToClient){
+			.cur_gs = &bot->gs,
+			.audio_playback_buffer = &bot->playback_packets,
+	};
+	SerState ser = init_deserializing(&bot->gs, decompressed, decompressed_len, false);
+	ser.applying_snapshot_parts = true;
+	ser.last_snapshot_tick = bot->last_snapshot_tick;
+	ser.can_merge_snapshot = bot->has_snapshot; // never predicted forward
+	ser.snapshot_cache = &bot->snapshot_cache;
+	SerMaybeFailure maybe_fail = ser_server_to_client(&ser, &msg);
+	queue_clear(&bot->playback_packets);
+	if (maybe_fail.failed)
+	{
+		Log("Failed to deserialize game state packet line %d %s\n", maybe_fail.line, maybe_fail.expression);
+		stats->failed_gamestates++;
+		return;
+	}
+	if (ser.dropped_snapshot_part)
+	{
+		stats->late_parts++;
+		return;
+	}
+	stats->gamestates++;
+
+	uint64_t server_tick = tick(&bot->gs);
+	if (bot->has_snapshot && server_tick > tick_before)
+	{
+		uint64_t gap = server_tick - tick_before;
+		stats->tick_gap_total += gap;
+		stats->tick_gaps++;
+		if (gap > stats->worst_tick_gap)
+			stats->worst_tick_gap = gap;
+	}
+	bot->last_snapshot_tick = server_tick;
+	bot->has_snapshot = true;
+	bot->snapshot_received_at = now;
+	bot->my_player_index = msg.your_player;
+
+	Entity *me = bot_entity(bot);
+	if (me != NULL && (!bot->has_last_motion || server_tick > bot->last_motion_tick))
+	{
+		cpVect pos = entity_pos(me);
+		if (bot->has_last_motion)
+		{
+			double ticks_passed = (double)(server_tick - bot->last_motion_tick);
+			cpVect predicted = cpvadd(bot->last_pos, cpvmult(bot->last_vel, ticks_passed * TIMESTEP));
+			double error = cpvdist(predicted, pos);
+			stats->prediction_error_total += error;
+			stats->predictions++;
+			if (error > stats->worst_prediction_error)
+				stats->worst_prediction_error = error;
+		}
+		bot->has_last_motion = true;
+		bot->last_motion_tick = server_tick;
+		bot->last_pos = pos;
+		bot->last_vel = entity_vel(&bot->gs, me);
+	}
+
+	if (msg.redirect_port != 0)
+	{
+		// handed off to another shard of the world, it's waiting there for this bot
+		ENetAddress shard_address = bot->peer->address;
+		shard_address.port = (enet_uint16)msg.redirect_port;
+		bot->peer->data = NULL;
+		enet_peer_disconnect_now(bot->peer, 0);
+		bot_connect(bot, host, shard_address, msg.redirect_token);
+	}
+}
+
+// fills the input queue up to as far ahead of the server as the client would be, then sends it
+// along with whatever it's said since last time
+static void bot_send(Bot *bot, BotStats *stats, double now)
+{
+	if (bot->encoder != NULL)
+	{
+		while (now - bot->last_voice_time > VOIP_TIME_PER_PACKET)
+		{
+			bot->last_voice_time += VOIP_TIME_PER_PACKET;
+			OpusPacket *packet = queue_push_element(&bot->mic_packets);
+			if (packet == NULL)
+			{
+				queue_clear(&bot->mic_packets);
+				packet = queue_push_element(&bot->mic_packets);
+			}
+			flight_assert(packet != NULL);
+			opus_int16 pcm[VOIP_EXPECTED_FRAME_COUNT] = {0};
+			for (int i = 0; i < VOIP_EXPECTED_FRAME_COUNT; i++)
+			{
+				pcm[i] = (opus_int16)(sin(bot->voice_phase) * 8000.0);
+				bot->voice_phase += 2.0 * PI * bot->voice_frequency / (double)VOIP_SAMPLE_RATE;
+			}
+			bot->voice_phase = fmod(bot->voice_phase, 2.0 * PI);
+			packet->length = opus_encode(bot->encoder, pcm, VOIP_EXPECTED_FRAME_COUNT, packet->data, VOIP_PACKET_MAX_SIZE);
+		}
+	}
+
+	if (!bot->connected || !bot->has_snapshot)
+		return;
+
+	uint64_t server_tick = bot->last_snapshot_tick + (uint64_t)((now - bot->snapshot_received_at) / TIMESTEP);
+	uint64_t ticks_ahead = (uint64_t)ceil((((double)bot->peer->roundTripTime + (double)bot->peer->roundTripTimeVariance * CAUTIOUS_MULTIPLIER) / 1000.0) / TIMESTEP) + 6;
+	uint64_t input_to_tick = server_tick + ticks_ahead;
+	if (bot->last_input_tick + LOCAL_INPUT_QUEUE_MAX < input_to_tick)
+		bot->last_input_tick = input_to_tick - LOCAL_INPUT_QUEUE_MAX;
+	while (bot->last_input_tick < input_to_tick)
+	{
+		bot->action_time_left -= TIMESTEP;
+		if (bot->action_time_left <= 0.0)
+			bot_choose_action(bot);
+
+		InputFrame input = bot_input(bot);
+		input.tick = ++bot->last_input_tick;
+		InputFrame *to_push_to = queue_push_element(&bot->input_queue);
+		if (to_push_to == NULL)
+		{
+			queue_pop_element(&bot->input_queue);
+			to_push_to = queue_push_element(&bot->input_queue);
+			flight_assert(to_push_to != NULL);
+		}
+		*to_push_to = input;
+	}
+
+	if (now - bot->last_sent_input_time < TIME_BETWEEN_INPUT_PACKETS)
+		return;
+	bot->last_sent_input_time = now;
+
+	ClientToServer to_send = {
+			.mic_data = &bot->mic_packets,
+			.input_data = &bot->input_queue,
+			.last_gamestate_tick = bot->last_snapshot_tick,
+			.gamestate_parts_received = bot->gamestate_parts_received,
+	};
+	unsigned char serialized[MAX_CLIENT_TO_SERVER] = {0};
+	SerState ser = init_serializing(&bot->gs, serialized, MAX_CLIENT_TO_SERVER, NULL, false);
+	SerMaybeFailure maybe_fail = ser_client_to_server(&ser, &to_send);
+	if (maybe_fail.failed)
+	{
+		Log("Failed to serialize client to server: %d %s\n", maybe_fail.line, maybe_fail.expression);
+		return;
+	}
+	unsigned char compressed[MAX_CLIENT_TO_SERVER] = {0};
+	char lzo_working_mem[LZO1X_1_MEM_COMPRESS] = {0};
+	size_t compressed_len = 0;
+	lzo1x_1_compress(serialized, ser_size(&ser), compressed, &compressed_len, (void *)lzo_working_mem);
+
+	ENetPacket *packet = enet_packet_create((void *)compressed, compressed_len, ENET_PACKET_FLAG_UNRELIABLE_FRAGMENT);
+	if (enet_peer_send(bot->peer, 0, packet) < 0)
+	{
+		Log("Failed to send bot inputs\n");
+		enet_packet_destroy(packet);
+	}
+	else
+	{
+		stats->bytes_sent += compressed_len;
+	}
+}
+
+static void report(BotStats *stats, Bot *bots, int num_bots, double seconds)
+{
+	int connected = 0;
+	uint64_t newest_tick = 0;
+	for (int i = 0; i < num_bots; i++)
+	{
+		if (!bots[i].connected)
+			continue;
+		connected++;
+		stats->rtt_total += (double)bots[i].peer->roundTripTime;
+		stats->rtt_samples++;
+		if (bots[i].last_snapshot_tick > newest_tick)
+			newest_tick = bots[i].last_snapshot_tick;
+	}
+	double gamestates = (double)(stats->gamestates > 0 ? stats->gamestates : 1);
+	Log("%d/%d bots connected, %" PRIu64 " disconnects. %f gamestates a second, %f bytes on average (%f decompressed), biggest %zu, %" PRIu64 " failed, %" PRIu64 " late. %f bytes a second sent\n",
+			connected, num_bots, stats->disconnects, (double)stats->gamestates / seconds, (double)stats->gamestate_bytes / gamestates,
+			(double)stats->decompressed_bytes / gamestates, stats->biggest_gamestate, stats->failed_gamestates, stats->late_parts, (double)stats->bytes_sent / seconds);
+	Log("Rtt %f ms on average. Prediction error %f on average, worst %f. Server at tick %" PRIu64 ", %f ticks between gamestates on average, worst %" PRIu64 "\n",
+			stats->rtt_samples > 0 ? stats->rtt_total / (double)stats->rtt_samples : 0.0,
+			stats->predictions > 0 ? stats->prediction_error_total / (double)stats->predictions : 0.0, stats->worst_prediction_error,
+			newest_tick, stats->tick_gaps > 0 ? (double)stats->tick_gap_total / (double)stats->tick_gaps : 0.0, stats->worst_tick_gap);
+}
+
+int main(int argc, char **argv)
+{
+	struct sigaction action;
+	memset(&action, 0, sizeof(struct sigaction));
+	action.sa_handler = term;
+	sigaction(SIGTERM, &action, NULL);
+	sigaction(SIGINT, &action, NULL);
+
+	int num_bots = 8;
+	const char *address_string = "127.0.0.1";
+	int port = SERVER_PORT;
+	double seconds = 0.0;
+	bool voice = false;
+	int positional = 0;
+	for (int i = 1; i < argc; i++)
+	{
+		if (strcmp(argv[i], "-voice") == 0)
+		{
+			voice = true;
+			continue;
+		}
+		switch (positional++)
+		{
+		case 0:
+			num_bots = atoi(argv[i]);
+			break;
+		case 1:
+			address_string = argv[i];
+			break;
+		case 2:
+			port = atoi(argv[i]);
+			break;
+		case 3:
+			seconds = atof(argv[i]);
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [bots] [address] [port] [seconds] [-voice]\n", argv[0]);
+			return 1;
+		}
+	}
+	if (num_bots <= 0 || num_bots > BOTS_MAX)
+	{
+		fprintf(stderr, "Between 1 and %d bots\n", BOTS_MAX);
+		return 1;
+	}
+
+	stm_setup();
+	if (enet_initialize() != 0 || lzo_init() != LZO_E_OK)
+	{
+		Log("Failed to initialize networking\n");
+		return 1;
+	}
+	ENetHost *host = enet_host_create(NULL, num_bots, 2, 0, 0);
+	if (host == NULL)
+	{
+		Log("Failed to create the enet host for the bots\n");
+		return 1;
+	}
+	ENetAddress address = {0};
+	enet_address_set_host(&address, address_string);
+	address.port = (enet_uint16)port;
+
+	Bot *bots = calloc(num_bots, sizeof(*bots));
+	flight_assert(bots != NULL);
+	for (int i = 0; i < num_bots; i++)
+	{
+		Bot *bot = &bots[i];
+		bot->entity_data = entity_arena_reserve(MAX_ENTITIES);
+		initialize(&bot->gs, bot->entity_data, sizeof(Entity) * MAX_ENTITIES);
+		queue_init(&bot->input_queue, sizeof(InputFrame), bot->input_queue_data, ARRLEN(bot->input_queue_data));
+		queue_init(&bot->mic_packets, sizeof(OpusPacket), bot->mic_packets_data, ARRLEN(bot->mic_packets_data));
+		queue_init(&bot->playback_packets, sizeof(OpusPacket), bot->playback_packets_data, ARRLEN(bot->playback_packets_data));
+		bot->rng = 0x9E3779B97F4A7C15ULL * (uint64_t)(i + 1);
+		bot->voice_frequency = 200.0 + bot_random(bot) * 400.0;
+		if (voice)
+		{
+			int error = 0;
+			bot->encoder = opus_encoder_create(VOIP_SAMPLE_RATE, 1, OPUS_APPLICATION_VOIP, &error);
+			flight_assert(error == OPUS_OK);
+		}
+	}
+	Log("Connecting %d bots to %s:%d\n", num_bots, address_string, port);
+
+	BotStats stats = {0};
+	int bots_started = 0;
+	uint64_t start_time = stm_now();
+	double last_report_time = 0.0;
+	while (!should_quit)
+	{
+		double now = stm_sec(stm_since(start_time));
+		if (seconds > 0.0 && now > seconds)
+			break;
+
+		while (bots_started < num_bots && now > bots_started * BOTS_CONNECT_INTERVAL)
+		{
+			bots[bots_started].last_voice_time = now;
+			bot_connect(&bots[bots_started], host, address, 0);
+			bots_started++;
+		}
+
+		ENetEvent event;
+		int enet_status = enet_host_service(host, &event, 1);
+		while (enet_status > 0)
+		{
+			Bot *bot = event.peer->data;
+			switch (event.type)
+			{
+			case ENET_EVENT_TYPE_CONNECT:
+				if (bot != NULL)
+					bot->connected = true;
+				break;
+			case ENET_EVENT_TYPE_RECEIVE:
+				if (bot != NULL)
+					bot_receive(bot, host, event.packet, &stats, now);
+				enet_packet_destroy(event.packet);
+				break;
+			case ENET_EVENT_TYPE_DISCONNECT:
+				if (bot != NULL)
+				{
+					Log("Bot %d disconnected\n", (int)(bot - bots));
+					stats.disconnects++;
+					bot->peer = NULL;
+					bot->connected = false;
+					bot->reconnect_at = now + BOTS_RECONNECT_TIME;
+				}
+				break;
+			case ENET_EVENT_TYPE_NONE:
+				break;
+			}
+			enet_status = enet_host_service(host, &event, 0);
+		}
+		if (enet_status < 0)
+			Log("Error receiving enet events: %d\n", enet_status);
+
+		for (int i = 0; i < bots_started; i++)
+		{
+			if (bots[i].peer == NULL && now > bots[i].reconnect_at)
+				bot_connect(&bots[i], host, address, 0);
+			bot_send(&bots[i], &stats, now);
+		}
+		enet_host_flush(host);
+
+		if (now - last_report_time > BOTS_STATS_INTERVAL)
+		{
+			report(&stats, bots, num_bots, now - last_report_time);
+			stats = (BotStats){0};
+			last_report_time = now;
+		}
+	}
+
+	for (int i = 0; i < num_bots; i++)
+	{
+		Bot *bot = &bots[i];
+		if (bot->peer != NULL)
+			enet_peer_disconnect_now(bot->peer, 0);
+		if (bot->encoder != NULL)
+			opus_encoder_destroy(bot->encoder);
+		snapshot_cache_free(&bot->snapshot_cache);
+		destroy(&bot->gs);
+		entity_arena_release(bot->entity_data, MAX_ENTITIES);
+	}
+	free(bots);
+	enet_host_destroy(host);
+	enet_deinitialize();
+	return 0;
+}
@@ -1,4 +1,6 @@
 #include <chipmunk.h>
+#include <cpHastySpace.h> // threaded solver for the server
+#include <chipmunk_structs.h> // sizes of bodies, shapes and constraints, they're allocated from the gamestate's pools
 #define QUEUE_IMPL
 #include "queue.h"
 #include "stdbool.h"
@@ -11,12 +13,27 @@
 #include <stdio.h>  // flight_assert logging
 #include <string.h> // memset
 
+#ifdef _WIN32
+#include <process.h> // starting grid worker threads
+#ifndef UNICODE
+#define UNICODE // same as the assert popup
+#endif
+#include <windows.h> // reserving and committing the entity arena
+#include <intrin.h>  // finding the lowest free entity
+#else
+#include <pthread.h>
+#include <sys/mman.h> // reserving and committing the entity arena
+#include <unistd.h>   // page size
+#endif
+
 // do not use any global variables to process gamestate
 
 // super try not to depend on external libraries like enet or sokol to keep build process simple,
 // gamestate its own portable submodule. If need to link to other stuff document here:
 // - debug.c for debug drawing
 // - chipmunk
+// - pthreads on linux, for the grid workers
+// - windows.h/mman.h for the entity arena's virtual memory
 
 #ifdef ASSERT_DO_POPUP_AND_CRASH
 #ifdef _WIN32
@@ -108,10 +125,62 @@ bool is_burning(Entity *missile)
   return missile->time_burned_for < MISSILE_BURN_TIME;
 }
 
+// The entity arena is address space for MAX_ENTITIES reserved up front, so entity pointers
+// never move, but memory is only committed a page of entities at a time as the world grows
+Entity *entity_arena_reserve(size_t max_entities)
+{
+  size_t size = max_entities * sizeof(Entity);
+#ifdef _WIN32
+  void *arena = VirtualAlloc(NULL, size, MEM_RESERVE, PAGE_NOACCESS);
+  flight_assert(arena != NULL);
+#else
+  void *arena = mmap(NULL, size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  flight_assert(arena != MAP_FAILED);
+#endif
+  return (Entity *)arena;
+}
+
+void entity_arena_release(Entity *arena, size_t max_entities)
+{
+#ifdef _WIN32
+  (void)max_entities;
+  VirtualFree(arena, 0, MEM_RELEASE);
+#else
+  munmap(arena, max_entities * sizeof(Entity));
+#endif
+}
+
+// newly committed memory is zeroed by the os, which initialize expects
+static void entity_arena_commit(GameState *gs, unsigned int num_entities)
+{
+  if (num_entities <= gs->committed_entities)
+    return;
+  flight_assert(num_entities <= gs->max_entities);
+  unsigned int new_committed = ((num_entities + ENTITY_ARENA_PAGE_ENTITIES - 1) / ENTITY_ARENA_PAGE_ENTITIES) * ENTITY_ARENA_PAGE_ENTITIES;
+  if (new_committed > gs->max_entities)
+    new_committed = gs->max_entities;
+
+  // the os commits whole pages, entities can straddle them
+  char *from = (char *)(gs->entities + gs->committed_entities);
+  size_t size = (size_t)(new_committed - gs->committed_entities) * sizeof(Entity);
+#ifdef _WIN32
+  void *committed = VirtualAlloc(from, size, MEM_COMMIT, PAGE_READWRITE);
+  flight_assert(committed != NULL);
+#else
+  size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+  char *page_from = (char *)((uintptr_t)from & ~(uintptr_t)(page_size - 1));
+  int result = mprotect(page_from, (size_t)(from - page_from) + size, PROT_READ | PROT_WRITE);
+  flight_assert(result == 0);
+#endif
+  gs->committed_entities = new_committed;
+}
+
 bool was_entity_deleted(GameState *gs, EntityID id)
 {
   if (id.generation == 0)
     return false; // generation 0 means null entity ID, not a deleted entity
+  if (!(id.index < gs->committed_entities))
+    return true; // never been made, past the part of the arena that's backed by memory
   Entity *the_entity = &gs->entities[id.index];
   return (!the_entity->exists || the_entity->generation != id.generation);
 }
@@ -124,7 +193,7 @@ Entity *get_entity_even_if_dead(GameState *gs, EntityID id)
   }
   if (!(id.index < gs->cur_next_entity || gs->cur_next_entity == 0))
     return NULL;
-  if (!(id.index < gs->max_entities))
+  if (!(id.index < gs->committed_entities))
     return NULL;
   Entity *to_return = &gs->entities[id.index];
   // don't validate the generation either
@@ -214,6 +283,14 @@ static Entity *cp_body_entity(cpBody *body)
   return (Entity *)cpBodyGetUserData(body);
 }
 
+// the merged rectangles a grid actually collides with have the grid as their user data, unlike
+// every other shape which has the entity it's the shape of
+static bool is_grid_collision_shape(cpShape *shape)
+{
+  Entity *e = cp_shape_entity(shape);
+  return e != NULL && e->is_grid;
+}
+
 static GameState *cp_space_gs(cpSpace *space)
 {
   return (GameState *)cpSpaceGetUserData(space);
@@ -224,7 +301,8 @@ static GameState *entitys_gamestate(Entity *e)
   flight_assert(e->body != NULL || e->shape != NULL);
   if (e->shape != NULL)
   {
-    return cp_space_gs(cpShapeGetSpace(e->shape));
+    // box shapes aren't in the space, their grid's body is
+    return cp_space_gs(cpBodyGetSpace(cpShapeGetBody(e->shape)));
   }
   if (e->body != NULL)
   {
@@ -281,6 +359,138 @@ cpVect entity_vel(GameState *gs, Entity *e)
   return (cpVect){0};
 }
 
+// IMPORTANT: all shapes must exist in one of these categories, as by default chipmunk assigns an object
+// to be in every category. Which is bad because that doesn't make sense for entities
+// Box shapes aren't in the space at all, grids collide with the merged rectangles from
+// grid_rebuild_collision_shapes. Queries find those rectangles and then the boxes in them, see grid_box_at_local
+enum
+{
+  DEFAULT = 1 << 0,
+  QUERIES = 1 << 1,
+  GRID_COLLISION = 1 << 2,
+};
+static const cpShapeFilter FILTER_ONLY_GRID_COLLISION = {CP_NO_GROUP, QUERIES, GRID_COLLISION};
+static const cpShapeFilter FILTER_GRID_COLLISION = {CP_NO_GROUP, DEFAULT | GRID_COLLISION, CP_ALL_CATEGORIES};
+static const cpShapeFilter FILTER_QUERY = {CP_NO_GROUP, QUERIES, CP_ALL_CATEGORIES};
+static const cpShapeFilter FILTER_DEFAULT = {CP_NO_GROUP, DEFAULT, CP_ALL_CATEGORIES};
+#define PLAYER_FILTER FILTER_DEFAULT
+
+typedef struct GridCell
+{
+  int x, y;
+  bool used;
+  Entity *box;
+  int parent; // union find, see grid_correct_for_holes
+  Entity *new_grid;
+} GridCell;
+
+static int grid_cell_compare(const void *a, const void *b)
+{
+  const GridCell *a_cell = (const GridCell *)a;
+  const GridCell *b_cell = (const GridCell *)b;
+  if (a_cell->y != b_cell->y)
+    return a_cell->y < b_cell->y ? -1 : 1;
+  if (a_cell->x != b_cell->x)
+    return a_cell->x < b_cell->x ? -1 : 1;
+  return 0;
+}
+
+static int grid_cell_at(GridCell *cells, int num_cells, int x, int y)
+{
+  GridCell key = {.x = x, .y = y};
+  GridCell *found = bsearch(&key, cells, num_cells, sizeof(*cells), grid_cell_compare);
+  return found == NULL ? -1 : (int)(found - cells);
+}
+
+// index of the first cell at or after x, y
+static int grid_cell_lower_bound(GridCell *cells, int num_cells, int x, int y)
+{
+  GridCell key = {.x = x, .y = y};
+  int low = 0;
+  int high = num_cells;
+  while (low < high)
+  {
+    int mid = low + (high - low) / 2;
+    if (grid_cell_compare(&cells[mid], &key) < 0)
+      low = mid + 1;
+    else
+      high = mid;
+  }
+  return low;
+}
+
+// the rectangles are made with their vertices in the body's local space
+static cpBB grid_collision_shape_local_bb(cpShape *shape)
+{
+  cpVect first = cpPolyShapeGetVert(shape, 0);
+  cpBB bb = cpBBNew(first.x, first.y, first.x, first.y);
+  for (int i = 1; i < cpPolyShapeGetCount(shape); i++)
+    bb = cpBBExpand(bb, cpPolyShapeGetVert(shape, i));
+  return bb;
+}
+
+// the box whose cell a point in the grid's local space is in. Grids with boxes added or removed
+// since their collision shapes were rebuilt don't have up to date cells, those are searched box by box
+static Entity *grid_box_at_local(GameState *gs, Entity *grid, cpVect local)
+{
+  if (!grid->collision_shapes_dirty && grid->box_cells != NULL)
+  {
+    cpVect lattice = cpvmult(cpvsub(local, grid->box_cells_origin), 1.0 / BOX_SIZE);
+    int i = grid_cell_at(grid->box_cells, grid->num_box_cells, (int)round(lattice.x), (int)round(lattice.y));
+    if (i != -1)
+      return grid->box_cells[i].box;
+    if (!grid->box_cells_incomplete)
+      return NULL;
+  }
+  double halfbox = BOX_SIZE / 2.0;
+  BOXES_ITER(gs, cur, grid)
+  {
+    cpVect to = cpvsub(local, entity_shape_pos(cur));
+    if (fabs(to.x) <= halfbox && fabs(to.y) <= halfbox)
+      return cur;
+  }
+  return NULL;
+}
+
+// finds the box at a world point on or in one of a grid's merged collision rectangles. The point is moved
+// a little into the rectangle, points on its edge could otherwise round to the cell next to it
+static Entity *grid_collision_shape_box(GameState *gs, cpShape *shape, cpVect world_point)
+{
+  flight_assert(is_grid_collision_shape(shape));
+  cpBB bb = grid_collision_shape_local_bb(shape);
+  cpVect local = cpBodyWorldToLocal(cpShapeGetBody(shape), world_point);
+  double inset = BOX_SIZE / 4.0;
+  local.x = cpfclamp(local.x, bb.l + inset, bb.r - inset);
+  local.y = cpfclamp(local.y, bb.b + inset, bb.t - inset);
+  return grid_box_at_local(gs, cp_shape_entity(shape), local);
+}
+
+// queries need every grid's merged rectangles and cells to be up to date, boxes added or
+// removed since the last rebuild aren't in them. Can't be called during the physics step
+static void rebuild_dirty_grid_collision_shapes(GameState *gs)
+{
+  if (!gs->grid_collision_shapes_dirty)
+    return;
+  gs->grid_collision_shapes_dirty = false;
+  ENTITIES_ITER(gs, e)
+  {
+    if (e->is_grid && e->collision_shapes_dirty)
+      grid_rebuild_collision_shapes(gs, e);
+  }
+}
+
+// the box at, or within radius of, a world point
+static Entity *box_at_point(GameState *gs, cpVect point, double radius)
+{
+  rebuild_dirty_grid_collision_shapes(gs);
+  cpPointQueryInfo info = {0};
+  cpShape *found = cpSpacePointQueryNearest(gs->space, point, radius, FILTER_ONLY_GRID_COLLISION, &info);
+  if (found == NULL)
+    return NULL;
+  // inside of the rectangle the nearest point is on its edge, not where the box is
+  return grid_collision_shape_box(gs, found, info.distance < 0.0 ? point : info.point);
+}
+
 typedef struct QueryResult
 {
   cpShape *shape;
@@ -291,7 +501,7 @@ static THREADLOCAL char query_result_data[QUEUE_SIZE_FOR_ELEMENTS(sizeof(QueryRe
 // the data starts off NULL, on the first call sets it to result data
 static THREADLOCAL Queue query_result = {0};
 
-static void shape_query_callback(cpShape *shape, cpContactPointSet *points, void *data)
+static void query_result_push(cpShape *shape, cpContactPointSet *points)
 {
   flight_assert(points->count >= 1); // bad, not exactly sure what the points look like. Just taking the first one for now. @Robust good debug drawing for this and figure it out. Make debug rects fade away instead of only drawn for one frame, makes one off things visible
   QueryResult *new = queue_push_element(&query_result);
@@ -305,45 +515,121 @@ static void shape_query_callback(cpShape *shape, cpContactPointSet *points, void
   new->pointB = points->points[0].pointB;
 }
 
-// shapes are pushed to query result
+static void query_result_push_box(cpShape *query_shape, Entity *box)
+{
+  cpShapeCacheBB(box->shape); // not in the space, so chipmunk doesn't keep where it is up to date
+  cpContactPointSet points = cpShapesCollide(query_shape, box->shape);
+  if (points.count > 0)
+    query_result_push(box->shape, &points);
+}
+
+// the query hit one of a grid's merged rectangles, only the cells in both that rectangle and the query's
+// bounding box are tested. The rectangles don't overlap so no box is found twice
+static void shape_query_grid(cpShape *query_shape, cpShape *grid_shape)
+{
+  GameState *gs = cp_space_gs(cpShapeGetSpace(grid_shape));
+  Entity *grid = cp_shape_entity(grid_shape);
+  cpBB rect = grid_collision_shape_local_bb(grid_shape);
+
+  if (grid->collision_shapes_dirty || grid->box_cells == NULL || grid->box_cells_incomplete)
+  {
+    BOXES_ITER(gs, cur, grid)
+    {
+      if (cpBBContainsVect(rect, entity_shape_pos(cur)))
+        query_result_push_box(query_shape, cur);
+    }
+    return;
+  }
+
+  cpBB world_bb = cpShapeGetBB(query_shape);
+  cpVect first = cpBodyWorldToLocal(grid->body, cpv(world_bb.l, world_bb.b));
+  cpBB query = cpBBNew(first.x, first.y, first.x, first.y);
+  query = cpBBExpand(query, cpBodyWorldToLocal(grid->body, cpv(world_bb.r, world_bb.b)));
+  query = cpBBExpand(query, cpBodyWorldToLocal(grid->body, cpv(world_bb.r, world_bb.t)));
+  query = cpBBExpand(query, cpBodyWorldToLocal(grid->body, cpv(world_bb.l, world_bb.t)));
+
+  // in cells relative to the lattice origin, clamped to the rectangle before becoming ints so far away queries don't overflow
+  cpVect origin = grid->box_cells_origin;
+  double rect_x0 = round((rect.l - origin.x) / BOX_SIZE + 0.5);
+  double rect_x1 = round((rect.r - origin.x) / BOX_SIZE - 0.5);
+  double rect_y0 = round((rect.b - origin.y) / BOX_SIZE + 0.5);
+  double rect_y1 = round((rect.t - origin.y) / BOX_SIZE - 0.5);
+  int x0 = (int)fmax(rect_x0, floor((query.l - origin.x) / BOX_SIZE - 0.5));
+  int x1 = (int)fmin(rect_x1, ceil((query.r - origin.x) / BOX_SIZE + 0.5));
+  int y0 = (int)fmax(rect_y0, floor((query.b - origin.y) / BOX_SIZE - 0.5));
+  int y1 = (int)fmin(rect_y1, ceil((query.t - origin.y) / BOX_SIZE + 0.5));
+
+  for (int y = y0; y <= y1; y++)
+  {
+    for (int i = grid_cell_lower_bound(grid->box_cells, grid->num_box_cells, x0, y); i < grid->num_box_cells; i++)
+    {
+      GridCell *cell = &grid->box_cells[i];
+      if (cell->y != y || cell->x > x1)
+        break;
+      query_result_push_box(query_shape, cell->box);
+    }
+  }
+}
+
+static void shape_query_callback(cpShape *shape, cpContactPointSet *points, void *data)
+{
+  if (is_grid_collision_shape(shape))
+    shape_query_grid((cpShape *)data, shape);
+  else
+    query_result_push(shape, points);
+}
+
+// shapes are pushed to query result, for grids the shapes of the boxes that were hit
 static void shape_query(cpSpace *space, cpShape *shape)
 {
+  rebuild_dirty_grid_collision_shapes(cp_space_gs(space));
   queue_init(&query_result, sizeof(QueryResult), query_result_data, ARRLEN(query_result_data));
   queue_clear(&query_result);
-  cpSpaceShapeQuery(space, shape, shape_query_callback, NULL);
+  cpSpaceShapeQuery(space, shape, shape_query_callback, (void *)shape);
 }
 
 // shapes are pushed to query result
 static void circle_query(cpSpace *space, cpVect pos, double radius)
 {
-  cpBody *tmp_body = cpBodyNew(0, 0);
-  cpBodySetPosition(tmp_body, pos);
-  cpShape *tmp_shape = cpCircleShapeNew(tmp_body, radius, cpv(0, 0));
+  // on the stack, queries happen too often to allocate for
+  cpBody tmp_body;
+  cpCircleShape tmp_circle;
+  cpBodyInit(memset(&tmp_body, 0, sizeof(tmp_body)), 0, 0);
+  cpBodySetPosition(&tmp_body, pos);
+  cpShape *tmp_shape = (cpShape *)cpCircleShapeInit(memset(&tmp_circle, 0, sizeof(tmp_circle)), &tmp_body, radius, cpv(0, 0));
+  cpShapeSetFilter(tmp_shape, FILTER_QUERY);
   shape_query(space, tmp_shape);
-  cpBodyFree(tmp_body);
-  cpShapeFree(tmp_shape);
+  cpShapeDestroy(tmp_shape);
+  cpBodyDestroy(&tmp_body);
 }
 
 static void rect_query(cpSpace *space, BoxCentered box)
 {
-  cpBody *tmp_body = cpBodyNew(0, 0);
-  cpBodySetPosition(tmp_body, box.pos);
-  cpBodySetAngle(tmp_body, box.rotation);
-  cpShape *tmp_shape = cpBoxShapeNew(tmp_body, box.size.x * 2.0, box.size.y * 2.0, 0.0);
+  cpBody tmp_body;
+  cpPolyShape tmp_poly;
+  cpBodyInit(memset(&tmp_body, 0, sizeof(tmp_body)), 0, 0);
+  cpBodySetPosition(&tmp_body, box.pos);
+  cpBodySetAngle(&tmp_body, box.rotation);
+  cpShape *tmp_shape = (cpShape *)cpBoxShapeInit(memset(&tmp_poly, 0, sizeof(tmp_poly)), &tmp_body, box.size.x * 2.0, box.size.y * 2.0, 0.0);
+  cpShapeSetFilter(tmp_shape, FILTER_QUERY);
   shape_query(space, tmp_shape);
-  cpBodyFree(tmp_body);
-  cpShapeFree(tmp_shape);
+  cpShapeDestroy(tmp_shape);
+  cpBodyDestroy(&tmp_body);
 }
 
 static THREADLOCAL cpShape *found_merge_shape = NULL;
+// the ray hits the merged rectangles, the box it hits first in each is the one it could merge with
 static void raycast_query_callback(cpShape *shape, cpVect point, cpVect normal, cpFloat alpha, void *data)
 {
   Entity *grid_to_exclude = (Entity *)data;
   flight_assert(grid_to_exclude != NULL);
 
-  if (cp_shape_entity(shape)->is_box && cp_shape_entity(shape)->box_type == BoxMerge && box_grid(cp_shape_entity(shape)) != grid_to_exclude)
+  if (cp_shape_entity(shape) == grid_to_exclude)
+    return;
+  Entity *hit = grid_collision_shape_box(cp_space_gs(cpShapeGetSpace(shape)), shape, point);
+  if (hit != NULL && hit->box_type == BoxMerge && !hit->is_ghost)
   {
-    found_merge_shape = shape;
+    found_merge_shape = hit->shape;
   }
 }
 
@@ -407,22 +693,146 @@ LauncherTarget missile_launcher_target(GameState *gs, Entity *launcher)
   return (LauncherTarget){.target_found = target_found, .facing_angle = to_face};
 }
 
+// Chipmunk objects are all a fixed size, so instead of going through malloc for every one they're
+// handed out from slabs owned by the gamestate. On the client the whole world is remade every packet,
+// the slabs are reused instead of freed and reallocated
+#define CHIPMUNK_POOL_SLAB_OBJECTS 256
+
+typedef struct ChipmunkPoolSlab
+{
+  struct ChipmunkPoolSlab *next;
+  char *objects;
+} ChipmunkPoolSlab;
+
+static void chipmunk_pool_push_slab(ChipmunkPool *pool, ChipmunkPoolSlab *slab)
+{
+  for (int i = 0; i < CHIPMUNK_POOL_SLAB_OBJECTS; i++)
+  {
+    void *object = slab->objects + pool->object_size * i;
+    *(void **)object = pool->free_list;
+    pool->free_list = object;
+  }
+}
+
+static void *chipmunk_pool_alloc(ChipmunkPool *pool)
+{
+  flight_assert(pool->object_size >= sizeof(void *));
+  if (pool->free_list == NULL)
+  {
+    ChipmunkPoolSlab *slab = malloc(sizeof(*slab));
+    flight_assert(slab != NULL);
+    slab->objects = malloc(pool->object_size * CHIPMUNK_POOL_SLAB_OBJECTS);
+    flight_assert(slab->objects != NULL);
+    slab->next = pool->slabs;
+    pool->slabs = slab;
+    chipmunk_pool_push_slab(pool, slab);
+  }
+  void *object = pool->free_list;
+  pool->free_list = *(void **)object;
+  memset(object, 0, pool->object_size); // chipmunk's init functions expect zeroed memory like from cpcalloc
+  return object;
+}
+
+static void chipmunk_pool_free(ChipmunkPool *pool, void *object)
+{
+  *(void **)object = pool->free_list;
+  pool->free_list = object;
+}
+
+// every object is free again, the slabs are kept for the next world
+static void chipmunk_pool_reset(ChipmunkPool *pool)
+{
+  pool->free_list = NULL;
+  for (ChipmunkPoolSlab *cur = pool->slabs; cur != NULL; cur = cur->next)
+    chipmunk_pool_push_slab(pool, cur);
+}
+
+static void chipmunk_pool_release(ChipmunkPool *pool)
+{
+  ChipmunkPoolSlab *cur = pool->slabs;
+  while (cur != NULL)
+  {
+    ChipmunkPoolSlab *next = cur->next;
+    free(cur->objects);
+    free(cur);
+    cur = next;
+  }
+  pool->slabs = NULL;
+  pool->free_list = NULL;
+}
+
+static cpBody *pooled_body_new(GameState *gs)
+{
+  return cpBodyInit((cpBody *)chipmunk_pool_alloc(&gs->body_pool), 0.0, 0.0); // zeros for mass/moment of inertia means automatically calculated from its collision shapes
+}
+
+static void pooled_body_free(GameState *gs, cpBody *body)
+{
+  cpBodyDestroy(body);
+  chipmunk_pool_free(&gs->body_pool, body);
+}
+
+static cpShape *pooled_rectangle_shape_new(GameState *gs, cpBody *body, cpBB box)
+{
+  cpVect verts[4] = {
+      cpv(box.r, box.b),
+      cpv(box.r, box.t),
+      cpv(box.l, box.t),
+      cpv(box.l, box.b),
+  };
+  return (cpShape *)cpPolyShapeInitRaw((cpPolyShape *)chipmunk_pool_alloc(&gs->shape_pool), body, 4, verts, 0.0); // this cast is done in chipmunk, not sure why it works
+}
+
+static cpShape *pooled_circle_shape_new(GameState *gs, cpBody *body, double radius)
+{
+  return (cpShape *)cpCircleShapeInit((cpCircleShape *)chipmunk_pool_alloc(&gs->shape_pool), body, radius, cpv(0, 0));
+}
+
+static void pooled_shape_free(GameState *gs, cpShape *shape)
+{
+  cpShapeDestroy(shape);
+  chipmunk_pool_free(&gs->shape_pool, shape);
+}
+
+// same as cpPivotJointNew
+static cpConstraint *pooled_pivot_joint_new(GameState *gs, cpBody *a, cpBody *b, cpVect pivot)
+{
+  return (cpConstraint *)cpPivotJointInit((cpPivotJoint *)chipmunk_pool_alloc(&gs->constraint_pool), a, b, cpBodyWorldToLocal(a, pivot), cpBodyWorldToLocal(b, pivot));
+}
+
+static void pooled_constraint_free(GameState *gs, cpConstraint *constraint)
+{
+  cpConstraintDestroy(constraint);
+  chipmunk_pool_free(&gs->constraint_pool, constraint);
+}
+
 void destroy_constraints(cpBody *body, cpConstraint *constraint, void *data)
 {
+  GameState *gs = (GameState *)data;
   ((Entity *)cpConstraintGetUserData(constraint))->landed_constraint = NULL;
-  cpSpaceRemoveConstraint(cpBodyGetSpace(body), constraint);
-  cpConstraintFree(constraint);
+  cpSpaceRemoveConstraint(gs->space, constraint);
+  pooled_constraint_free(gs, constraint);
+}
+
+static void free_grid_collision_shape(cpBody *body, cpShape *shape, void *data)
+{
+  GameState *gs = (GameState *)data;
+  if (is_grid_collision_shape(shape))
+  {
+    cpSpaceRemoveShape(gs->space, shape);
+    pooled_shape_free(gs, shape);
+  }
 }
 
 void destroy_child_shape(cpBody *body, cpShape *shape, void *data)
 {
   GameState *gs = (GameState *)data;
-  if (cp_shape_entity(shape) == NULL)
+  if (cp_shape_entity(shape) == NULL || is_grid_collision_shape(shape))
   {
     // support the case where no parent entity *SPECIFICALLY* for grid_correct_for_holes,
     // where the entities that are part of the old grid are reused so entityids are preserved
     cpSpaceRemoveShape(gs->space, shape);
-    cpShapeFree(shape);
+    pooled_shape_free(gs, shape);
   }
   else
   {
@@ -430,17 +840,39 @@ void destroy_child_shape(cpBody *body, cpShape *shape, void *data)
   }
 }
 
-void entity_free_allocated(Entity *e)
+void entity_free_allocated(GameState *gs, Entity *e)
 {
 #define MAYBE_FREE(variable, free_call) \
   if (variable != NULL)                 \
   {                                     \
-    free_call(variable);                \
+    free_call(gs, variable);            \
     variable = NULL;                    \
   }
-  MAYBE_FREE(e->shape, cpShapeFree);
-  MAYBE_FREE(e->body, cpBodyFree);
-  MAYBE_FREE(e->landed_constraint, cpConstraintFree);
+  MAYBE_FREE(e->shape, pooled_shape_free);
+  MAYBE_FREE(e->body, pooled_body_free);
+  MAYBE_FREE(e->landed_constraint, pooled_constraint_free);
+  free(e->box_cells);
+  e->box_cells = NULL;
+}
+
+// goes back to chipmunk integrating the body. Its velocity was kept up to date while on rails
+static void entity_exit_rails(Entity *e)
+{
+  if (e == NULL || !e->on_rails)
+    return;
+  e->on_rails = false;
+  if (e->body != NULL)
+  {
+    cpBodySetVelocityUpdateFunc(e->body, cpBodyUpdateVelocity);
+    cpBodySetPositionUpdateFunc(e->body, cpBodyUpdatePosition);
+  }
+}
+
+// the mass of what the shape is on is about to change, which invalidates its orbit
+static void shape_body_exit_rails(cpShape *shape)
+{
+  if (shape != NULL && cpShapeGetBody(shape) != NULL)
+    entity_exit_rails(cp_body_entity(cpShapeGetBody(shape)));
 }
 
 // Destroys the entity and puts its slot back into the free list. Doesn't obey game rules
@@ -463,7 +895,14 @@ void entity_memory_free(GameState *gs, Entity *e)
   }
   if (e->shape != NULL)
   {
-    cpSpaceRemoveShape(gs->space, e->shape);
+    if (e->is_box && cpShapeGetBody(e->shape) != NULL)
+    {
+      cp_body_entity(cpShapeGetBody(e->shape))->collision_shapes_dirty = true;
+      gs->grid_collision_shapes_dirty = true;
+    }
+    shape_body_exit_rails(e->shape);
+    if (cpShapeGetSpace(e->shape) != NULL) // box shapes never are
+      cpSpaceRemoveShape(gs->space, e->shape);
   }
   if (e->landed_constraint != NULL)
   {
@@ -473,35 +912,65 @@ void entity_memory_free(GameState *gs, Entity *e)
   {
     // need to do this here because body which constraint is attached to can be destroyed
     // NOT TRUE: can't do this here because the handle to the constraint cannot be set to NULL. Constraints are freed by the entities that own them
-    cpBodyEachConstraint(e->body, destroy_constraints, NULL);
+    cpBodyEachConstraint(e->body, destroy_constraints, (void *)gs);
     cpBodyEachShape(e->body, destroy_child_shape, (void *)gs);
     cpSpaceRemoveBody(gs->space, e->body);
   }
-  entity_free_allocated(e);
-  Entity *front_of_free_list = get_entity(gs, gs->free_list);
-  if (front_of_free_list != NULL)
-    flight_assert(!front_of_free_list->exists);
+  entity_free_allocated(gs, e);
   unsigned int gen = e->generation;
   *e = (Entity){0};
   e->generation = gen;
-  e->next_free_entity = gs->free_list;
-  gs->free_list = get_id(gs, e);
+
+  unsigned int index = get_id(gs, e).index;
+  gs->free_entities[index / 64] |= 1ull << (index % 64);
+  if (index / 64 < gs->free_entities_hint)
+    gs->free_entities_hint = index / 64;
+
+  // free slots at the end of the range are given back, so ENTITIES_ITER doesn't walk over them
+  while (gs->cur_next_entity > 0)
+  {
+    unsigned int last = gs->cur_next_entity - 1;
+    uint64_t last_bit = 1ull << (last % 64);
+    if (!(gs->free_entities[last / 64] & last_bit))
+      break;
+    gs->free_entities[last / 64] &= ~last_bit;
+    gs->cur_next_entity--;
+  }
+}
+
+static unsigned int lowest_set_bit(uint64_t bits)
+{
+  flight_assert(bits != 0);
+#ifdef _WIN32
+  unsigned long index;
+  _BitScanForward64(&index, bits);
+  return (unsigned int)index;
+#else
+  return (unsigned int)__builtin_ctzll(bits);
+#endif
 }
 
+// always the lowest free index, so the live entities stay packed at the front of the arena
 Entity *new_entity(GameState *gs)
 {
   Entity *to_return = NULL;
-  Entity *possible_free_list = get_entity_even_if_dead(gs, gs->free_list);
-  if (possible_free_list != NULL)
+  unsigned int words = (gs->cur_next_entity + 63) / 64;
+  for (unsigned int i = gs->free_entities_hint; i < words; i++)
   {
-    flight_assert(possible_free_list->generation == gs->free_list.generation);
-    to_return = possible_free_list;
-    flight_assert(!to_return->exists);
-    gs->free_list = to_return->next_free_entity;
+    if (gs->free_entities[i] != 0)
+    {
+      unsigned int index = i * 64 + lowest_set_bit(gs->free_entities[i]);
+      gs->free_entities[i] &= gs->free_entities[i] - 1;
+      to_return = &gs->entities[index];
+      flight_assert(!to_return->exists);
+      break;
+    }
+    gs->free_entities_hint = i + 1;
   }
-  else
+  if (to_return == NULL)
   {
     flight_assert(gs->cur_next_entity < gs->max_entities); // too many entities if fails
+    entity_arena_commit(gs, gs->cur_next_entity + 1);
     to_return = &gs->entities[gs->cur_next_entity];
     gs->cur_next_entity++;
   }
@@ -531,13 +1000,17 @@ void create_body(GameState *gs, Entity *e)
 
   if (e->body != NULL)
   {
+    cpBodyEachShape(e->body, free_grid_collision_shape, (void *)gs);
     cpSpaceRemoveBody(gs->space, e->body);
-    cpBodyFree(e->body);
+    pooled_body_free(gs, e->body);
     e->body = NULL;
   }
 
-  cpBody *body = cpSpaceAddBody(gs->space, cpBodyNew(0.0, 0.0)); // zeros for mass/moment of inertia means automatically calculated from its collision shapes
+  cpBody *body = pooled_body_new(gs);
+  if (!gs->bulk_loading)
+    cpSpaceAddBody(gs->space, body);
   e->body = body;
+  e->on_rails = false;
   cpBodySetUserData(e->body, (void *)e);
 }
 
@@ -585,68 +1058,67 @@ void entity_set_pos(Entity *e, cpVect pos)
   cpBodySetPosition(e->body, (pos));
 }
 
-// IMPORTANT: all shapes must exist in one of these categories, as by default chipmunk assigns an object
-// to be in every category. Which is bad because that doesn't make sense for entities
-enum
-{
-  DEFAULT = 1 << 0,
-  BOXES = 1 << 1,
-  MERGE_BOXES = 1 << 2,
-};
-static const cpShapeFilter FILTER_ONLY_BOXES = {CP_NO_GROUP, BOXES, BOXES};
-static const cpShapeFilter FILTER_BOXES = {CP_NO_GROUP, DEFAULT | BOXES, CP_ALL_CATEGORIES};
-static const cpShapeFilter FILTER_MERGE_BOX = {CP_NO_GROUP, DEFAULT | BOXES | MERGE_BOXES, CP_ALL_CATEGORIES};
-static const cpShapeFilter FILTER_ONLY_MERGE_BOX = {CP_NO_GROUP, MERGE_BOXES, CP_ALL_CATEGORIES};
-static const cpShapeFilter FILTER_DEFAULT = {CP_NO_GROUP, DEFAULT, CP_ALL_CATEGORIES};
-#define PLAYER_FILTER FILTER_DEFAULT
-
 // size is (1/2 the width, 1/2 the height)
 void create_rectangle_shape(GameState *gs, Entity *e, Entity *parent, cpVect pos, cpVect size, double mass)
 {
   PROFILE_SCOPE("Create rectangle shape")
   {
+    entity_exit_rails(parent); // adding mass moves the center of gravity
+
     // @Robust remove this garbage
     if (e->shape != NULL)
     {
+      if (cp_body_entity(cpShapeGetBody(e->shape)) != NULL)
+        cp_body_entity(cpShapeGetBody(e->shape))->collision_shapes_dirty = true;
+      gs->grid_collision_shapes_dirty = true;
+      shape_body_exit_rails(e->shape);
       PROFILE_SCOPE("Freeing shape")
       {
-        cpSpaceRemoveShape(gs->space, e->shape);
-        cpShapeFree(e->shape);
+        if (cpShapeGetSpace(e->shape) != NULL)
+          cpSpaceRemoveShape(gs->space, e->shape);
+        pooled_shape_free(gs, e->shape);
         e->shape = NULL;
       }
     }
 
     cpBB box = cpBBNew(-size.x + pos.x, -size.y + pos.y, size.x + pos.x, size.y + pos.y);
-    cpVect verts[4] = {
-        cpv(box.r, box.b),
-        cpv(box.r, box.t),
-        cpv(box.l, box.t),
-        cpv(box.l, box.b),
-    };
 
     e->shape_size = size;
     e->shape_parent_entity = get_id(gs, parent);
-    e->shape = (cpShape *)cpPolyShapeInitRaw(cpPolyShapeAlloc(), parent->body, 4, verts, 0.0); // this cast is done in chipmunk, not sure why it works
+    if (parent->is_grid)
+    {
+      parent->collision_shapes_dirty = true;
+      gs->grid_collision_shapes_dirty = true;
+    }
+    e->transform_version = 0; // shape moved, cached world position is stale
+    e->shape = pooled_rectangle_shape_new(gs, parent->body, box);
     cpShapeSetUserData(e->shape, (void *)e);
-    PROFILE_SCOPE("Setting mass")
+    if (mass > 0.0) // massless shapes don't make chipmunk recompute the body's mass
     {
-      cpShapeSetMass(e->shape, mass);
+      PROFILE_SCOPE("Setting mass")
+      {
+        cpShapeSetMass(e->shape, mass);
+      }
     }
-    PROFILE_SCOPE("Adding shape")
+    if (!gs->bulk_loading && !parent->is_grid) // boxes are found through the grid's collision shapes
     {
-      cpSpaceAddShape(gs->space, e->shape);
+      PROFILE_SCOPE("Adding shape")
+      {
+        cpSpaceAddShape(gs->space, e->shape);
+      }
     }
     cpShapeSetFilter(e->shape, FILTER_DEFAULT);
   }
 }
 void create_circle_shape(GameState *gs, Entity *e, double radius)
 {
-  e->shape = cpCircleShapeNew(e->body, ORB_RADIUS, cpv(0, 0));
+  e->shape = pooled_circle_shape_new(gs, e->body, ORB_RADIUS);
   e->shape_parent_entity = get_id(gs, e);
   e->shape_radius = radius;
   cpShapeSetMass(e->shape, ORB_MASS);
   cpShapeSetUserData(e->shape, (void *)e);
-  cpSpaceAddShape(gs->space, e->shape);
+  if (!gs->bulk_loading)
+    cpSpaceAddShape(gs->space, e->shape);
   cpShapeSetFilter(e->shape, FILTER_DEFAULT);
 }
 
@@ -706,7 +1178,6 @@ void box_add_to_boxes(GameState *gs, Entity *grid, Entity *box_to_add)
 
 // box must be passed as a parameter as the box added to chipmunk uses this pointer in its
 // user data. pos is in local coordinates. Adds the box to the grid's chain of boxes
-// Must pass in a type so it knows what filter to give the collision shape
 void create_box(GameState *gs, Entity *new_box, Entity *grid, cpVect pos, enum BoxType type)
 {
   new_box->is_box = true;
@@ -715,18 +1186,9 @@ void create_box(GameState *gs, Entity *new_box, Entity *grid, cpVect pos, enum B
 
   double halfbox = BOX_SIZE / 2.0;
 
-  create_rectangle_shape(gs, new_box, grid, pos, (cpVect){halfbox, halfbox}, 1.0);
+  create_rectangle_shape(gs, new_box, grid, pos, (cpVect){halfbox, halfbox}, 0.0); // the grid's collision shapes have the mass
 
   new_box->box_type = type;
-  switch (type)
-  {
-  case BoxMerge:
-    cpShapeSetFilter(new_box->shape, FILTER_MERGE_BOX);
-    break;
-  default:
-    cpShapeSetFilter(new_box->shape, FILTER_BOXES);
-    break;
-  }
 
   box_add_to_boxes(gs, grid, new_box);
 }
@@ -760,10 +1222,15 @@ cpVect box_compass_vector(Entity *box)
 {
 
   flight_assert(box->is_box);
-  cpVect to_return = (cpVect){.x = 1.0, .y = 0.0};
-  to_return = cpvspin(to_return, rotangle(box->compass_rotation));
-
-  return to_return;
+  // same as spinning (1, 0) by rotangle, without the trig
+  static const cpVect compass_vectors[RotationLast] = {
+      [Right] = {.x = 1.0, .y = 0.0},
+      [Down] = {.x = 0.0, .y = -1.0},
+      [Left] = {.x = -1.0, .y = 0.0},
+      [Up] = {.x = 0.0, .y = 1.0},
+  };
+  flight_assert(box->compass_rotation >= 0 && box->compass_rotation < RotationLast);
+  return compass_vectors[box->compass_rotation];
 }
 #include <time.h>
 void fill_time_string(char *to_fill, size_t max_length)
@@ -861,6 +1328,36 @@ bool box_interactible(GameState *gs, Player *for_player, Entity *box)
 
 // removes boxes from grid, then ensures that the rule that grids must not have
 // holes in them is applied.
+// a box on the grid's lattice
+
+static int grid_cell_find(GridCell *cells, int i)
+{
+  while (cells[i].parent != i)
+  {
+    cells[i].parent = cells[cells[i].parent].parent;
+    i = cells[i].parent;
+  }
+  return i;
+}
+
+static bool box_faces(Entity *box, cpVect dir)
+{
+  return cpvnear(box_compass_vector(box), dir, 0.01);
+}
+
+// a merge box that wants to disconnect only separates from the box it's merged with, the one
+// in front of it facing back
+static bool boxes_connected(Entity *from, Entity *to, cpVect dir)
+{
+  bool from_disconnecting = from->box_type == BoxMerge && from->wants_disconnect && box_faces(from, dir);
+  bool to_disconnecting = to->box_type == BoxMerge && to->wants_disconnect && box_faces(to, cpvmult(dir, -1.0));
+  bool merged = box_faces(from, dir) && box_faces(to, cpvmult(dir, -1.0));
+  return !((from_disconnecting || to_disconnecting) && merged);
+}
+
+// Ensures the rule that grids must not have holes in them, any boxes no longer connected
+// horizontally or vertically to the biggest piece are split off into their own grids. One union find
+// pass over the boxes, so call it once after removing however many boxes
 static void grid_correct_for_holes(GameState *gs, struct Entity *grid)
 {
   int num_boxes = grid_num_boxes(gs, grid);
@@ -872,139 +1369,103 @@ static void grid_correct_for_holes(GameState *gs, struct Entity *grid)
   if (num_boxes == 1)
     return;
 
-    // could be a gap between boxes in the grid, separate into multiple grids
-
-    // goal: create list of "real grids" from this grid that have boxes which are
-    // ONLY connected horizontally and vertically.
+  GridCell *cells = malloc(sizeof(*cells) * num_boxes);
+  flight_assert(cells != NULL);
+  int num_cells = 0;
+  cpVect origin = entity_shape_pos(get_entity(gs, grid->boxes));
+  BOXES_ITER(gs, cur, grid)
+  {
+    cpVect lattice = cpvmult(cpvsub(entity_shape_pos(cur), origin), 1.0 / BOX_SIZE);
+    cells[num_cells] = (GridCell){.x = (int)round(lattice.x), .y = (int)round(lattice.y), .box = cur};
+    num_cells++;
+  }
+  qsort(cells, num_cells, sizeof(*cells), grid_cell_compare);
+  for (int i = 0; i < num_cells; i++)
+    cells[i].parent = i;
 
-#define MAX_SEPARATE_GRIDS 8
-  EntityID separate_grids[MAX_SEPARATE_GRIDS] = {0};
-  int cur_separate_grid_index = 0;
-  int processed_boxes = 0;
+  // only need to look right and up, the left and down neighbors look at this one
+  for (int i = 0; i < num_cells; i++)
+  {
+    int neighbors[2] = {
+        grid_cell_at(cells, num_cells, cells[i].x + 1, cells[i].y),
+        grid_cell_at(cells, num_cells, cells[i].x, cells[i].y + 1),
+    };
+    const cpVect dirs[2] = {{.x = 1.0, .y = 0.0}, {.x = 0.0, .y = 1.0}};
+    for (int ii = 0; ii < ARRLEN(neighbors); ii++)
+    {
+      if (neighbors[ii] == -1 || !boxes_connected(cells[i].box, cells[neighbors[ii]].box, dirs[ii]))
+        continue;
+      int root_a = grid_cell_find(cells, i);
+      int root_b = grid_cell_find(cells, neighbors[ii]);
+      if (root_a != root_b)
+        cells[root_b].parent = root_a;
+    }
+  }
 
-  // process all boxes into separate, but correctly connected, grids
-  while (processed_boxes < num_boxes)
+  // the biggest piece stays in this grid
+  int *piece_sizes = calloc(num_cells, sizeof(*piece_sizes));
+  flight_assert(piece_sizes != NULL);
+  int biggest_piece = 0;
+  int num_pieces = 0;
+  for (int i = 0; i < num_cells; i++)
   {
-    // grab an unprocessed box, one not in separate_grids, to start the flood fill
-    Entity *unprocessed = get_entity(gs, grid->boxes);
-    flight_assert(unprocessed != NULL);
-    flight_assert(unprocessed->is_box);
-    box_remove_from_boxes(gs, unprocessed); // no longer in the boxes list of the grid
+    int root = grid_cell_find(cells, i);
+    if (piece_sizes[root] == 0)
+      num_pieces++;
+    piece_sizes[root]++;
+    if (piece_sizes[root] > piece_sizes[biggest_piece] || (piece_sizes[root] == piece_sizes[biggest_piece] && root < biggest_piece))
+      biggest_piece = root;
+  }
+  free(piece_sizes);
 
-    uint32_t biggest_box_index = 0;
+  if (num_pieces > 1)
+  {
+    cpVect old_com = grid_com(grid);
+    cpVect old_vel = cpBodyGetVelocity(grid->body);
+    double old_angular_vel = cpBodyGetAngularVelocity(grid->body);
 
-    // flood fill from this unprocessed box, adding each result to cur_separate_grid_index,
-    // removing each block from the grid
-    // https://en.wikipedia.org/wiki/Flood_fill
+    for (int i = 0; i < num_cells; i++)
     {
-      // queue stuff @Robust use factored datastructure
-      EntityID Q = get_id(gs, unprocessed);
-      Entity *N = NULL;
-      while (true)
+      int root = grid_cell_find(cells, i);
+      if (root == biggest_piece)
+        continue;
+      if (cells[root].new_grid == NULL)
       {
-        flight_assert(!was_entity_deleted(gs, Q));
-        N = get_entity(gs, Q);
-        if (N == NULL) // must mean that the queue is empty
-          break;
-        Q = N->next_box;
-        if (true) // if node "inside", this is always true
-        {
-          N->next_box = separate_grids[cur_separate_grid_index];
-          separate_grids[cur_separate_grid_index] = get_id(gs, N);
-          processed_boxes++;
-
-          if (get_id(gs, N).index > biggest_box_index)
-          {
-            biggest_box_index = get_id(gs, N).index;
-          }
-
-          cpVect cur_local_pos = entity_shape_pos(N);
-          const cpVect dirs[] = {
-              (cpVect){
-                  .x = -1.0, .y = 0.0},
-              (cpVect){
-                  .x = 1.0, .y = 0.0},
-              (cpVect){
-                  .x = 0.0, .y = 1.0},
-              (cpVect){
-                  .x = 0.0, .y = -1.0},
-          };
-          int num_dirs = sizeof(dirs) / sizeof(*dirs);
-
-          for (int ii = 0; ii < num_dirs; ii++)
-          {
-            cpVect dir = dirs[ii];
-            EntityID box_in_direction = (EntityID){0};
-            // @Robust @Speed faster method, not O(N^2), of getting the box
-            // in the direction currently needed
-            cpVect compass_vect = box_compass_vector(N);
-            if (N->box_type == BoxMerge && N->wants_disconnect && cpvnear(compass_vect, dir, 0.01) && merge_box_is_merged(gs, N))
-            {
-            }
-            else
-            {
-              cpVect wanted_local_pos = cpvadd(cur_local_pos, cpvmult(dir, BOX_SIZE));
-              box_in_direction = get_id(gs, grid_box_at_local_pos(gs, grid, wanted_local_pos));
-            }
-
-            Entity *newbox = get_entity(gs, box_in_direction);
-
-            if (newbox != NULL && newbox->box_type == BoxMerge && newbox->wants_disconnect && cpvnear(cpvmult(box_compass_vector(newbox), -1.0), dir, 0.01))
-            {
-              newbox = NULL;
-            }
-
-            if (newbox != NULL)
-            {
-              box_remove_from_boxes(gs, newbox);
-              newbox->next_box = Q;
-              Q = box_in_direction;
-            }
-          }
-        }
+        Entity *new_grid = new_entity(gs);
+        grid_create(gs, new_grid);
+        cpBodySetPosition(new_grid->body, cpBodyGetPosition(grid->body));
+        cpBodySetAngle(new_grid->body, cpBodyGetAngle(grid->body));
+        cells[root].new_grid = new_grid;
       }
+
+      // the box entity is reused so references to it stay valid
+      Entity *cur = cells[i].box;
+      cpVect new_shape_position = entity_shape_pos(cur);
+      box_remove_from_boxes(gs, cur);
+      create_box(gs, cur, cells[root].new_grid, new_shape_position, cur->box_type);
     }
 
-    cur_separate_grid_index++;
-    flight_assert(cur_separate_grid_index < MAX_SEPARATE_GRIDS);
+    // every piece keeps moving how that part of the grid was moving
+    for (int i = 0; i < num_cells; i++)
+    {
+      Entity *piece = i == biggest_piece ? grid : cells[i].new_grid;
+      if (piece == NULL)
+        continue;
+      grid_rebuild_collision_shapes(gs, piece);
+      cpBodySetVelocity(piece->body, cpvadd(old_vel, cpvmult(cpvperp(cpvsub(grid_com(piece), old_com)), old_angular_vel)));
+      cpBodySetAngularVelocity(piece->body, old_angular_vel);
+    }
   }
 
-  // create new grids for all lists of boxes except for the biggest one.
-  // delete the boxes out of the current grid as I pull boxes into separate ones
-  // which are no longer connected
-  for (int sepgrid_i = 0; sepgrid_i < MAX_SEPARATE_GRIDS; sepgrid_i++)
-  {
-    EntityID cur_separate_grid = separate_grids[sepgrid_i];
-    if (get_entity(gs, cur_separate_grid) == NULL)
-      continue; // this separate grid is empty
+  free(cells);
+}
 
-    Entity *new_grid;
-    new_grid = new_entity(gs);
-    grid_create(gs, new_grid);
-    cpBodySetPosition(new_grid->body, cpBodyGetPosition(grid->body));
-    cpBodySetAngle(new_grid->body, cpBodyGetAngle(grid->body));
-
-    Entity *cur = get_entity(gs, cur_separate_grid);
-    while (cur != NULL)
-    {
-      Entity *next = get_entity(gs, cur->next_box);
-      cpVect new_shape_position = entity_shape_pos(cur);
-
-      // leaks the allocated shape for the box so center of mass calcs from the original grid are correct. Shapes are freed when grid is destroyed after construction of new replacement grids
-      // important that a new entity isn't created for the shapes so entity references to those shapes are still valid
-      cpShapeSetUserData(cur->shape, NULL);
-      cur->shape = NULL;
-
-      create_box(gs, cur, new_grid, new_shape_position, cur->box_type); // destroys next/prev fields on cur
-      cur = next;
-    }
-
-    cpBodySetVelocity(new_grid->body, cpBodyGetVelocityAtWorldPoint(grid->body, (grid_com(new_grid))));
-    cpBodySetAngularVelocity(new_grid->body, cpBodyGetAngularVelocity(grid->body));
-  }
-
-  // destroys all the box shapes and the entities attached to those shapes
-  entity_memory_free(gs, grid);
+// contacts with a grid are against its merged collision rectangles, this finds the box that was actually hit
+static Entity *contact_entity(cpSpace *space, cpShape *shape, cpVect contact_point)
+{
+  if (!is_grid_collision_shape(shape))
+    return cp_shape_entity(shape);
+  return grid_collision_shape_box(cp_space_gs(space), shape, contact_point);
 }
 
 static void on_damage(cpArbiter *arb, cpSpace *space, cpDataPointer userData)
@@ -1012,6 +1473,10 @@ static void on_damage(cpArbiter *arb, cpSpace *space, cpDataPointer userData)
   cpShape *a, *b;
   cpArbiterGetShapes(arb, &a, &b);
 
+  // contact means the orbit is no longer free falling
+  shape_body_exit_rails(a);
+  shape_body_exit_rails(b);
+
   Entity *entity_a, *entity_b;
   entity_a = cp_shape_entity(a);
   entity_b = cp_shape_entity(b);
@@ -1043,15 +1508,25 @@ static void on_damage(cpArbiter *arb, cpSpace *space, cpDataPointer userData)
 
   double damage = cpvlength((cpArbiterTotalImpulse(arb))) * COLLISION_DAMAGE_SCALING;
 
-  if (entity_a->is_box && entity_a->box_type == BoxExplosive)
-    entity_a->damage += 2.0 * EXPLOSION_DAMAGE_THRESHOLD;
-  if (entity_b->is_box && entity_b->box_type == BoxExplosive)
-    entity_b->damage += 2.0 * EXPLOSION_DAMAGE_THRESHOLD;
-
-  if (damage > 0.05)
+  // one contact with a grid's merged shape can be touching a different box at each point, the damage is split between them
+  int count = cpArbiterGetCount(arb);
+  for (int i = 0; i < count; i++)
   {
-    entity_a->damage += damage;
-    entity_b->damage += damage;
+    Entity *hit_a = contact_entity(space, a, cpArbiterGetPointA(arb, i));
+    Entity *hit_b = contact_entity(space, b, cpArbiterGetPointB(arb, i));
+    if (hit_a == NULL || hit_b == NULL)
+      continue;
+
+    if (hit_a->is_box && hit_a->box_type == BoxExplosive)
+      hit_a->damage += 2.0 * EXPLOSION_DAMAGE_THRESHOLD;
+    if (hit_b->is_box && hit_b->box_type == BoxExplosive)
+      hit_b->damage += 2.0 * EXPLOSION_DAMAGE_THRESHOLD;
+
+    if (damage > 0.05)
+    {
+      hit_a->damage += damage / count;
+      hit_b->damage += damage / count;
+    }
   }
 }
 
@@ -1061,35 +1536,128 @@ void initialize(GameState *gs, void *entity_arena, size_t entity_arena_size)
   PROFILE_SCOPE("Initialize")
   {
     bool is_server_side = gs->server_side_computing;
+    struct GridWorkers *grid_workers = gs->grid_workers;
+    int physics_threads = gs->physics_threads;
+    ChipmunkPool body_pool = gs->body_pool;
+    ChipmunkPool shape_pool = gs->shape_pool;
+    ChipmunkPool constraint_pool = gs->constraint_pool;
+    unsigned int committed_entities = entity_arena == gs->entities ? gs->committed_entities : 0;
+    uint64_t *free_entities = entity_arena == gs->entities ? gs->free_entities : NULL;
+    double sector_min_x = entity_arena == gs->entities ? gs->sector_min_x : -INFINITY;
+    double sector_max_x = entity_arena == gs->entities ? gs->sector_max_x : INFINITY;
+    Player *players = entity_arena == gs->entities ? gs->players : NULL;
+    unsigned int max_players = entity_arena == gs->entities ? gs->max_players : 0;
+    int *player_next_in_bucket = entity_arena == gs->entities ? gs->player_next_in_bucket : NULL;
     *gs = (GameState){0};
+    gs->sector_min_x = sector_min_x;
+    gs->sector_max_x = sector_max_x;
+    gs->players = players; // only the slots are kept, who's in them is filled on deserialization
+    gs->max_players = max_players;
+    gs->player_next_in_bucket = player_next_in_bucket;
+    if (gs->players != NULL)
+      memset(gs->players, 0, sizeof(*gs->players) * gs->max_players);
+    players_reserve(gs, PLAYERS_INITIAL);
+    gs->grid_workers = grid_workers; // outlives reinitializing on deserialization
+    gs->physics_threads = physics_threads;
+    gs->body_pool = body_pool; // slabs are kept across deserialization
+    gs->shape_pool = shape_pool;
+    gs->constraint_pool = constraint_pool;
+    gs->body_pool.object_size = sizeof(cpBody);
+    gs->shape_pool.object_size = sizeof(cpPolyShape) > sizeof(cpCircleShape) ? sizeof(cpPolyShape) : sizeof(cpCircleShape);
+    gs->constraint_pool.object_size = sizeof(cpPivotJoint); // landing gear is the only constraint
     gs->entities = (Entity *)entity_arena;
     gs->max_entities = (unsigned int)(entity_arena_size / sizeof(Entity));
-    gs->space = cpSpaceNew();
+    gs->committed_entities = committed_entities; // stays committed when reinitializing with the same arena on deserialization
+    gs->free_entities = free_entities;
+    if (gs->free_entities == NULL)
+      gs->free_entities = calloc((gs->max_entities + 63) / 64, sizeof(*gs->free_entities));
+    flight_assert(gs->free_entities != NULL);
+    if (gs->physics_threads > 0)
+    {
+      gs->space = cpHastySpaceNew();
+      cpHastySpaceSetThreads(gs->space, (unsigned long)gs->physics_threads);
+    }
+    else
+    {
+      gs->space = cpSpaceNew();
+    }
     cpSpaceSetUserData(gs->space, (cpDataPointer)gs); // needed in the handler
     cpCollisionHandler *handler = cpSpaceAddCollisionHandler(gs->space, 0, 0);
     handler->postSolveFunc = on_damage;
     gs->server_side_computing = is_server_side;
+    if (gs->server_side_computing)
+    {
+      cpSpaceSetSleepTimeThreshold(gs->space, DORMANCY_SLEEP_TIME_THRESHOLD);
+    }
   }
 }
-void destroy(GameState *gs)
+// frees the world, but keeps the chipmunk pools' slabs around to be reused by the next world
+static void destroy_world(GameState *gs)
 {
   PROFILE_SCOPE("Destroy")
   {
     // can't zero out gs data because the entity memory arena is reused
-    // on deserialization
+    // on deserialization. Chipmunk objects don't have to be freed one by one,
+    // their pools are reset all at once
     for (size_t i = 0; i < gs->cur_next_entity; i++)
     {
       if (gs->entities[i].exists)
       {
-        entity_free_allocated(&gs->entities[i]);
+        free(gs->entities[i].box_cells);
         gs->entities[i] = (Entity){0}; // IMPORTANT expects zeroed for initialize
       }
     }
-    cpSpaceFree(gs->space);
+    if (gs->physics_threads > 0)
+      cpHastySpaceFree(gs->space);
+    else
+      cpSpaceFree(gs->space);
     gs->space = NULL;
+    memset(gs->free_entities, 0, sizeof(*gs->free_entities) * ((gs->cur_next_entity + 63) / 64));
+    gs->free_entities_hint = 0;
     gs->cur_next_entity = 0;
+    free(gs->generated_sectors);
+    gs->generated_sectors = NULL;
+    gs->num_generated_sectors = 0;
+    gs->generated_sectors_capacity = 0;
+    chipmunk_pool_reset(&gs->body_pool);
+    chipmunk_pool_reset(&gs->shape_pool);
+    chipmunk_pool_reset(&gs->constraint_pool);
   }
 }
+
+void destroy(GameState *gs)
+{
+  destroy_world(gs);
+  chipmunk_pool_release(&gs->body_pool);
+  chipmunk_pool_release(&gs->shape_pool);
+  chipmunk_pool_release(&gs->constraint_pool);
+  free(gs->free_entities);
+  gs->free_entities = NULL;
+  free(gs->players);
+  gs->players = NULL;
+  free(gs->player_next_in_bucket);
+  gs->player_next_in_bucket = NULL;
+  gs->max_players = 0;
+}
+
+// makes sure there are at least count player slots, the new ones empty. Pointers to players don't survive it
+void players_reserve(GameState *gs, unsigned int count)
+{
+  flight_assert(count <= MAX_PLAYERS);
+  if (count <= gs->max_players)
+    return;
+  unsigned int new_max = gs->max_players > 0 ? gs->max_players : PLAYERS_INITIAL;
+  while (new_max < count)
+    new_max *= 2;
+  if (new_max > MAX_PLAYERS)
+    new_max = MAX_PLAYERS;
+  gs->players = realloc(gs->players, sizeof(*gs->players) * new_max);
+  gs->player_next_in_bucket = realloc(gs->player_next_in_bucket, sizeof(*gs->player_next_in_bucket) * new_max);
+  flight_assert(gs->players != NULL && gs->player_next_in_bucket != NULL);
+  memset(gs->players + gs->max_players, 0, sizeof(*gs->players) * (new_max - gs->max_players));
+  memset(gs->player_next_in_bucket + gs->max_players, 0, sizeof(*gs->player_next_in_bucket) * (new_max - gs->max_players));
+  gs->max_players = new_max;
+}
 // center of mass, not the literal position
 cpVect grid_com(Entity *grid)
 {
@@ -1161,11 +1729,233 @@ double box_rotation(Entity *box)
   return (float)cpBodyGetAngle(cpShapeGetBody(box->shape));
 }
 
+typedef struct GridMass
+{
+  double mass;
+  cpVect weighted_pos;      // sum of mass * center
+  double moment_at_origin; // sum of each rectangle's moment, moved to the grid's local origin
+} GridMass;
+
+static void add_grid_collision_rect(GameState *gs, Entity *grid, GridMass *grid_mass, cpVect origin, int x0, int y0, int x1, int y1)
+{
+  double halfbox = BOX_SIZE / 2.0;
+  cpBB bb = cpBBNew(
+      origin.x + x0 * BOX_SIZE - halfbox,
+      origin.y + y0 * BOX_SIZE - halfbox,
+      origin.x + x1 * BOX_SIZE + halfbox,
+      origin.y + y1 * BOX_SIZE + halfbox);
+  // massless, otherwise chipmunk recomputes the body's mass for every shape added. The mass of
+  // the whole grid is set once after all the rectangles are added
+  cpShape *shape = pooled_rectangle_shape_new(gs, grid->body, bb);
+  cpShapeSetUserData(shape, (void *)grid);
+  cpShapeSetFilter(shape, FILTER_GRID_COLLISION);
+  cpSpaceAddShape(gs->space, shape);
+
+  // uniform density, so same mass and inertia as the boxes separately
+  double width = bb.r - bb.l;
+  double height = bb.t - bb.b;
+  double mass = BOX_MASS * (double)((x1 - x0 + 1) * (y1 - y0 + 1));
+  cpVect center = cpBBCenter(bb);
+  grid_mass->mass += mass;
+  grid_mass->weighted_pos = cpvadd(grid_mass->weighted_pos, cpvmult(center, mass));
+  grid_mass->moment_at_origin += mass * (width * width + height * height) / 12.0 + mass * cpvlengthsq(center);
+}
+
+// Grids don't collide with a shape per box, contiguous boxes are greedily merged into as few
+// rectangles as possible: runs of boxes along each row, then runs with the same extent in
+// consecutive rows are merged into one rectangle. The box shapes aren't in the space, queries and
+// on_damage look up the boxes in the rectangles they hit by their cell
+void grid_rebuild_collision_shapes(GameState *gs, Entity *grid)
+{
+  flight_assert(grid->is_grid);
+  cpBodyEachShape(grid->body, free_grid_collision_shape, (void *)gs);
+  grid->collision_shapes_dirty = false;
+  free(grid->box_cells);
+  grid->box_cells = NULL;
+  grid->num_box_cells = 0;
+  grid->box_cells_incomplete = false;
+
+  int num_boxes = grid_num_boxes(gs, grid);
+  if (num_boxes == 0)
+    return;
+  GridMass grid_mass = {0};
+  GridCell *cells = malloc(sizeof(*cells) * num_boxes);
+  flight_assert(cells != NULL);
+  int num_cells = 0;
+
+  // boxes are on a lattice in the grid's local space, it's just not necessarily centered on the body's origin
+  Entity *first_box = get_entity(gs, grid->boxes);
+  cpVect origin = entity_shape_pos(first_box);
+  BOXES_ITER(gs, cur, grid)
+  {
+    if (cpShapeGetMass(cur->shape) != 0.0)
+      cpShapeSetMass(cur->shape, 0.0);
+
+    cpVect lattice = cpvmult(cpvsub(entity_shape_pos(cur), origin), 1.0 / BOX_SIZE);
+    int x = (int)round(lattice.x);
+    int y = (int)round(lattice.y);
+    if (fabs(lattice.x - x) > 0.01 || fabs(lattice.y - y) > 0.01)
+    {
+      // off of the lattice, shouldn't happen but it still has to collide
+      add_grid_collision_rect(gs, grid, &grid_mass, entity_shape_pos(cur), 0, 0, 0, 0);
+      grid->box_cells_incomplete = true;
+      continue;
+    }
+    cells[num_cells] = (GridCell){.x = x, .y = y, .box = cur};
+    num_cells++;
+  }
+  qsort(cells, num_cells, sizeof(*cells), grid_cell_compare);
+
+  int row_start = 0;
+  while (row_start < num_cells)
+  {
+    int row_end = row_start;
+    while (row_end < num_cells && cells[row_end].y == cells[row_start].y)
+      row_end++;
+
+    for (int run_start = row_start; run_start < row_end;)
+    {
+      int run_end = run_start + 1;
+      while (run_end < row_end && cells[run_end].x <= cells[run_end - 1].x + 1)
+        run_end++;
+      int x0 = cells[run_start].x;
+      int x1 = cells[run_end - 1].x;
+      int y0 = cells[run_start].y;
+
+      if (!cells[run_start].used)
+      {
+        // grow the run down through the following rows while they have exactly the same run
+        int y1 = y0;
+        int search_from = row_end;
+        while (true)
+        {
+          int next_row_start = search_from;
+          if (next_row_start >= num_cells || cells[next_row_start].y != y1 + 1)
+            break;
+          int next_row_end = next_row_start;
+          while (next_row_end < num_cells && cells[next_row_end].y == y1 + 1)
+            next_row_end++;
+
+          int match = -1;
+          for (int i = next_row_start; i < next_row_end; i++)
+          {
+            if (cells[i].x == x0 && !cells[i].used)
+            {
+              match = i;
+              break;
+            }
+          }
+          bool same_run = match != -1 && match + (x1 - x0) < next_row_end && cells[match + (x1 - x0)].x == x1;
+          if (same_run && match > next_row_start && cells[match - 1].x == x0 - 1)
+            same_run = false; // the run in the next row is longer
+          if (same_run && match + (x1 - x0) + 1 < next_row_end && cells[match + (x1 - x0) + 1].x == x1 + 1)
+            same_run = false;
+          if (!same_run)
+            break;
+
+          for (int i = match; i <= match + (x1 - x0); i++)
+            cells[i].used = true;
+          y1++;
+          search_from = next_row_end;
+        }
+        add_grid_collision_rect(gs, grid, &grid_mass, origin, x0, y0, x1, y1);
+      }
+      run_start = run_end;
+    }
+    row_start = row_end;
+  }
+  grid->box_cells = cells; // the lookup from a cell to its box, see grid_box_at_local
+  grid->num_box_cells = num_cells;
+  grid->box_cells_origin = origin;
+
+  // ghosts are kinematic, chipmunk asserts if their mass is set. Their owner simulates them
+  if (cpBodyGetType(grid->body) == CP_BODY_TYPE_DYNAMIC)
+  {
+    // the center of gravity moving would move the body, keep the body's origin where it was
+    cpVect body_pos = cpBodyGetPosition(grid->body);
+    cpVect center_of_gravity = cpvmult(grid_mass.weighted_pos, 1.0 / grid_mass.mass);
+    cpBodySetMass(grid->body, grid_mass.mass);
+    cpBodySetMoment(grid->body, grid_mass.moment_at_origin - grid_mass.mass * cpvlengthsq(center_of_gravity));
+    cpBodySetCenterOfGravity(grid->body, center_of_gravity);
+    cpBodySetPosition(grid->body, body_pos);
+  }
+}
+
+// refreshes the cached rotation of the grid and the world position of all of its boxes in one pass.
+// Called for every grid right after the physics step, and lazily when a grid is found to have
+// been moved since (building, merging, teleporting, deserializing)
+void grid_update_transform_cache(GameState *gs, Entity *grid)
+{
+  flight_assert(grid->is_grid);
+  flight_assert(grid->body != NULL);
+  cpVect grid_pos = cpBodyGetPosition(grid->body);
+  double grid_angle = cpBodyGetAngle(grid->body);
+  cpVect rot = (cpVect){.x = cos(grid_angle), .y = sin(grid_angle)};
+
+  grid->transform_body_pos = grid_pos;
+  grid->transform_body_angle = grid_angle;
+  grid->transform_rot = rot;
+  grid->transform_version++;
+  if (grid->transform_version == 0)
+    grid->transform_version = 1; // 0 means never cached, on wraparound skip it
+
+  if (gs != NULL)
+  {
+    unsigned int version = grid->transform_version;
+    BOXES_ITER(gs, cur, grid)
+    {
+      cpVect local = entity_shape_pos(cur);
+      cur->transform_world_pos = (cpVect){
+          .x = grid_pos.x + local.x * rot.x - local.y * rot.y,
+          .y = grid_pos.y + local.x * rot.y + local.y * rot.x,
+      };
+      cur->transform_version = version;
+    }
+  }
+}
+
+// (cos, sin) of the grid's body angle, recomputed only when the body moved
+static cpVect grid_rotation_vector(Entity *grid)
+{
+  flight_assert(grid->is_grid);
+  if (grid->transform_version == 0 || grid->transform_body_angle != cpBodyGetAngle(grid->body) || !cpveql(grid->transform_body_pos, cpBodyGetPosition(grid->body)))
+  {
+    // boxes are refreshed on demand, don't know the gamestate here
+    grid_update_transform_cache(NULL, grid);
+  }
+  return grid->transform_rot;
+}
+
+static cpVect box_world_pos(Entity *box)
+{
+  Entity *grid = box_grid(box);
+  cpVect rot = grid_rotation_vector(grid);
+  if (box->transform_version != grid->transform_version)
+  {
+    cpVect local = entity_shape_pos(box);
+    box->transform_world_pos = (cpVect){
+        .x = grid->transform_body_pos.x + local.x * rot.x - local.y * rot.y,
+        .y = grid->transform_body_pos.y + local.x * rot.y + local.y * rot.x,
+    };
+    box->transform_version = grid->transform_version;
+  }
+  return box->transform_world_pos;
+}
+
+// dormant entities are asleep in chipmunk and skip processing, see process_dormancy.
+// Boxes are dormant when their grid is
+bool entity_dormant(Entity *e)
+{
+  if (e->is_box)
+    return entity_dormant(box_grid(e));
+  return e->body != NULL && cpBodyIsSleeping(e->body);
+}
+
 cpVect entity_pos(Entity *e)
 {
   if (e->is_box)
   {
-    return cpvadd(entity_pos(box_grid(e)), cpvspin(entity_shape_pos(e), entity_rotation(box_grid(e))));
+    return box_world_pos(e);
   }
   else if (e->is_explosion)
   {
@@ -1226,8 +2016,149 @@ const static SerMaybeFailure ser_ok = {0};
     if (result.failed)                      \
       return result;                        \
   }
+// Saves have the name and size of every kind of field written once, in the order they were first
+// serialized, instead of in front of every field. Loading runs the same code, so a field it reaches
+// for the first time must be the next one in the file's schema, or the save is from different code.
+// After that the field is known and decoding it is just the copy
+#define SER_SCHEMA_MAX_FIELDS 512
+#define SER_SCHEMA_SLOTS 1024 // power of two, comfortably more than the fields so probing stays short
+
+typedef struct SerSchemaField
+{
+  const char *name; // from the file's schema, a copy freed with the schema
+  int name_length;
+  int line; // where it's serialized, with the name identifies the field. Not saved
+  uint16_t size;
+} SerSchemaField;
+
+typedef struct SerSchema
+{
+  SerSchemaField seen[SER_SCHEMA_MAX_FIELDS]; // in the order they were first serialized
+  int num_seen;
+  uint16_t slots[SER_SCHEMA_SLOTS]; // index + 1 into seen of the field hashed there, 0 if empty
+  SerSchemaField in_file[SER_SCHEMA_MAX_FIELDS];
+  int num_in_file;
+} SerSchema;
+
+#define SER_FAIL(why) return (SerMaybeFailure){.failed = true, .line = __LINE__, .expression = why}
+
+static SerMaybeFailure ser_schema_field(SerState *ser, const char *name, int line, size_t data_len)
+{
+  SerSchema *schema = ser->schema;
+  size_t slot = (((size_t)name >> 3) ^ ((size_t)line * 2654435761u)) & (SER_SCHEMA_SLOTS - 1);
+  while (schema->slots[slot] != 0)
+  {
+    SerSchemaField *field = &schema->seen[schema->slots[slot] - 1];
+    if (field->name == name && field->line == line)
+      return ser_ok;
+    slot = (slot + 1) & (SER_SCHEMA_SLOTS - 1);
+  }
+
+  // first time this field is serialized
+  if (schema->num_seen >= SER_SCHEMA_MAX_FIELDS)
+    SER_FAIL("More kinds of fields than the schema has room for");
+  if (data_len >= 65535)
+    SER_FAIL("Field too big for the schema");
+  int name_length = (int)strlen(name);
+  if (name_length > 255)
+    SER_FAIL("Field name too long for the schema");
+  if (!ser->serializing)
+  {
+    if (schema->num_seen >= schema->num_in_file)
+      SER_FAIL("Save has fewer fields than this build serializes");
+    SerSchemaField *expected = &schema->in_file[schema->num_seen];
+    if (expected->name_length != name_length || memcmp(expected->name, name, name_length) != 0)
+    {
+      Log("Save's field %.*s doesn't match %s serialized on line %d\n", expected->name_length, expected->name, name, line);
+      SER_FAIL("Save's schema doesn't match this build");
+    }
+    if (expected->size != data_len)
+      SER_FAIL("Save's field is a different size in this build");
+  }
+  schema->seen[schema->num_seen] = (SerSchemaField){
+      .name = name,
+      .name_length = name_length,
+      .line = line,
+      .size = (uint16_t)data_len,
+  };
+  schema->num_seen++;
+  schema->slots[slot] = (uint16_t)schema->num_seen;
+  return ser_ok;
+}
+
+static uint32_t block_crc32(const unsigned char *bytes, size_t length)
+{
+  static uint32_t table[256] = {0};
+  if (table[1] == 0)
+  {
+    for (uint32_t i = 0; i < 256; i++)
+    {
+      uint32_t c = i;
+      for (int bit = 0; bit < 8; bit++)
+        c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+      table[i] = c;
+    }
+  }
+  uint32_t crc = 0xFFFFFFFFu;
+  for (size_t i = 0; i < length; i++)
+    crc = table[(crc ^ bytes[i]) & 0xFF] ^ (crc >> 8);
+  return crc ^ 0xFFFFFFFFu;
+}
+
+// each block in the file is its length, the crc32 of its bytes, then its bytes
+static SerMaybeFailure ser_stream_flush(SerState *ser)
+{
+  if (ser->cursor == 0)
+    return ser_ok;
+  uint32_t block_header[2] = {(uint32_t)ser->cursor, block_crc32(ser->bytes, ser->cursor)};
+  if (fwrite(block_header, sizeof(block_header), 1, ser->stream->file) != 1 || fwrite(ser->bytes, ser->cursor, 1, ser->stream->file) != 1)
+    SER_FAIL("Couldn't write a block of the save");
+  ser->cursor = 0;
+  return ser_ok;
+}
+
+static SerMaybeFailure ser_stream_refill(SerState *ser)
+{
+  uint32_t block_header[2] = {0};
+  if (fread(block_header, sizeof(block_header), 1, ser->stream->file) != 1)
+    SER_FAIL("Save ends partway through");
+  if (block_header[0] == 0 || block_header[0] > SAVE_BLOCK_SIZE)
+    SER_FAIL("Save block has an impossible length");
+  if (fread(ser->bytes, block_header[0], 1, ser->stream->file) != 1)
+    SER_FAIL("Save ends partway through a block");
+  if (block_crc32(ser->bytes, block_header[0]) != block_header[1])
+    SER_FAIL("Save block is corrupted");
+  ser->cursor = 0;
+  ser->max_size = block_header[0];
+  return ser_ok;
+}
+
+static SerMaybeFailure ser_stream_data(SerState *ser, char *data, size_t data_len)
+{
+  while (data_len > 0)
+  {
+    if (ser->cursor >= ser->max_size)
+      SER_MAYBE_RETURN(ser->serializing ? ser_stream_flush(ser) : ser_stream_refill(ser));
+    size_t length = ser->max_size - ser->cursor;
+    if (length > data_len)
+      length = data_len;
+    if (ser->serializing)
+      memcpy(ser->bytes + ser->cursor, data, length);
+    else
+      memcpy(data, ser->bytes + ser->cursor, length);
+    ser->cursor += length;
+    data += length;
+    data_len -= length;
+  }
+  return ser_ok;
+}
+
 SerMaybeFailure ser_data(SerState *ser, char *data, size_t data_len, const char *name, const char *file, int line)
 {
+  if (ser->schema != NULL)
+    SER_MAYBE_RETURN(ser_schema_field(ser, name, line, data_len));
+  if (ser->stream != NULL)
+    return ser_stream_data(ser, data, data_len);
   char var_name[512] = {0};
   size_t var_name_len = 0;
   if (ser->write_varnames)
@@ -1332,6 +2263,8 @@ enum GameVersion
   VInitial,
   VNoGold,
   VSafeSun,
+  VSectors,
+  VPlayersNearby,
   VMax, // this minus one will be the version used
 };
 
@@ -1397,10 +2330,35 @@ SerMaybeFailure ser_bodydata(SerState *ser, struct BodyData *data)
   return ser_ok;
 }
 
+// disk saves renumber the entities densely, see ser_server_to_client
+static unsigned int ser_compacted_index(SerState *ser, unsigned int index)
+{
+  if (ser->compacted_indices == NULL)
+    return index;
+  flight_assert(ser->compacted_indices[index] != 0);
+  return ser->compacted_indices[index] - 1;
+}
+
 SerMaybeFailure ser_entityid(SerState *ser, EntityID *id)
 {
+  if (ser->serializing && ser->compacted_indices != NULL && id->generation > 0)
+  {
+    // references to entities not being saved are saved as null
+    EntityID compacted = {0};
+    if (id->index < ser->max_entity_index && ser->compacted_indices[id->index] != 0)
+      compacted = (EntityID){.generation = id->generation, .index = ser_compacted_index(ser, id->index)};
+    SER_VAR(&compacted.generation);
+    SER_VAR(&compacted.index);
+    return ser_ok;
+  }
   SER_VAR(&id->generation);
   SER_VAR(&id->index);
+  if (!ser->serializing && ser->group_ids != NULL && id->generation > 0)
+  {
+    // entity groups are numbered from 0 in the order they're in, see ser_entity_group
+    SER_ASSERT(id->index < ser->num_group_ids);
+    *id = ser->group_ids[id->index];
+  }
   if (id->generation > 0)
     SER_ASSERT(id->index < ser->max_entity_index);
   return ser_ok;
@@ -1431,14 +2389,6 @@ SerMaybeFailure ser_inputframe(SerState *ser, InputFrame *i)
   return ser_ok;
 }
 
-SerMaybeFailure ser_no_player(SerState *ser)
-{
-  bool connected = false;
-  SER_VAR_NAME(&connected, "&p->connected");
-
-  return ser_ok;
-}
-
 SerMaybeFailure ser_player(SerState *ser, Player *p)
 {
   SER_VAR(&p->connected);
@@ -1455,13 +2405,87 @@ SerMaybeFailure ser_player(SerState *ser, Player *p)
   return ser_ok;
 }
 
+// Over the network only the player the gamestate is for and the players near them are sent, the rest
+// are too far away to see. Session keyframes aren't for any player and have all of them
+static SerMaybeFailure ser_players(SerState *ser, GameState *gs, int your_player)
+{
+  if (ser->version < VPlayersNearby)
+  {
+    players_reserve(gs, 16);
+    for (int i = 0; i < 16; i++) // every slot there used to be
+      SER_MAYBE_RETURN(ser_player(ser, &gs->players[i]));
+    return ser_ok;
+  }
+
+  if (ser->serializing)
+  {
+    Player *sending[MAX_PLAYERS] = {0};
+    int num_sending = 0;
+    if (ser->server_state)
+    {
+      // session keyframes have everybody
+      PLAYERS_ITER(gs, cur)
+      {
+        sending[num_sending++] = cur;
+      }
+    }
+    else if (ser->for_player == NULL)
+    {
+      // a client that isn't anywhere in the world, like one being redirected, only gets its own
+      if (your_player >= 0 && your_player < (int)gs->max_players)
+        sending[num_sending++] = &gs->players[your_player];
+    }
+    else
+    {
+      flight_assert(your_player >= 0 && your_player < (int)gs->max_players);
+      sending[num_sending++] = &gs->players[your_player];
+      Player *near[MAX_PLAYERS] = {0};
+      int num_near = players_near(gs, entity_pos(ser->for_player), VISION_RADIUS, near, MAX_PLAYERS);
+      for (int i = 0; i < num_near; i++)
+      {
+        if (near[i] != &gs->players[your_player] && !is_cloaked(gs, get_entity(gs, near[i]->entity), ser->for_player))
+          sending[num_sending++] = near[i];
+      }
+    }
+    for (int i = 0; i < num_sending; i++)
+    {
+      bool more_players = true;
+      SER_VAR(&more_players);
+      uint8_t slot = (uint8_t)(sending[i] - gs->players);
+      SER_VAR(&slot);
+      SER_MAYBE_RETURN(ser_player(ser, sending[i]));
+    }
+    bool more_players = false;
+    SER_VAR(&more_players);
+  }
+  else
+  {
+    while (true)
+    {
+      bool more_players = false;
+      SER_VAR(&more_players);
+      if (!more_players)
+        break;
+      uint8_t slot = 0;
+      SER_VAR(&slot);
+      SER_ASSERT(slot < MAX_PLAYERS);
+      players_reserve(gs, slot + 1);
+      SER_MAYBE_RETURN(ser_player(ser, &gs->players[slot]));
+    }
+  }
+  return ser_ok;
+}
+
 SerMaybeFailure ser_entity(SerState *ser, GameState *gs, Entity *e)
 {
   PROFILE_SCOPE("Ser entity")
   {
     SER_VAR(&e->no_save_to_disk);
     SER_VAR(&e->always_visible);
-    SER_VAR(&e->generation);
+    unsigned int generation = e->generation;
+    SER_VAR_NAME(&generation, "&e->generation");
+    if (ser->group_ids == NULL) // entities of a group keep the generation of the slot they're loaded into
+      e->generation = generation;
     SER_MAYBE_RETURN(ser_f(ser, &e->damage));
 
     bool has_body = ser->serializing && e->body != NULL;
@@ -1508,6 +2532,8 @@ SerMaybeFailure ser_entity(SerState *ser, GameState *gs, Entity *e)
         shape_mass = entity_shape_mass(e);
       SER_VAR(&shape_mass);
       SER_ASSERT(!isnan(shape_mass));
+      if (parent->is_grid)
+        shape_mass = 0.0; // saves from before grids had merged collision shapes gave each box mass
 
       cpShapeFilter filter;
       if (ser->serializing)
@@ -1707,86 +2733,574 @@ SerMaybeFailure ser_opus_packets(SerState *ser, Queue *mic_or_speaker_data)
   return ser_ok;
 }
 
-SerMaybeFailure ser_server_to_client(SerState *ser, ServerToClient *s)
+// Deserializing makes every body and shape in the world, they're added to the space after everything
+// is loaded. When a snapshot part is merged into the world, only what it added goes in
+static void finish_bulk_load(GameState *gs)
 {
-  SER_VAR(&ser->version);
-  SER_ASSERT(ser->version >= 0);
-  SER_ASSERT(ser->version < VMax);
-  SER_VAR(&ser->git_release_tag);
+  flight_assert(gs->bulk_loading);
+  gs->bulk_loading = false;
 
-  if (ser->git_release_tag > GIT_RELEASE_TAG)
+  PROFILE_SCOPE("Add bodies")
   {
-    char msg[2048] = {0};
-    snprintf(msg, 2048, "Current game build %d is old, download the server's build %d! The most recent one in discord!\n", GIT_RELEASE_TAG, ser->git_release_tag);
-    quit_with_popup(msg, "Old Game Build");
-    SER_ASSERT(ser->git_release_tag <= GIT_RELEASE_TAG);
+    ENTITIES_ITER(gs, e)
+    {
+      if (e->body != NULL && cpBodyGetSpace(e->body) == NULL)
+        cpSpaceAddBody(gs->space, e->body);
+    }
   }
-
-  if (!ser->save_or_load_from_disk)
-    SER_MAYBE_RETURN(ser_opus_packets(ser, s->audio_playback_buffer));
-
-  GameState *gs = s->cur_gs;
-
-  // completely reset and destroy all gamestate data
-  if (!ser->serializing)
+  PROFILE_SCOPE("Add shapes")
   {
-    PROFILE_SCOPE("Destroy old gamestate")
+    ENTITIES_ITER(gs, e)
     {
-      // avoid a memset here very expensive. que rico!
-      destroy(gs);
-      initialize(gs, gs->entities, gs->max_entities * sizeof(*gs->entities));
-      gs->cur_next_entity = 0; // updated on deserialization
+      if (e->shape != NULL && !e->is_box && cpShapeGetSpace(e->shape) == NULL)
+        cpSpaceAddShape(gs->space, e->shape);
     }
   }
 
-  int cur_next_entity = 0;
-  if (ser->serializing)
-    cur_next_entity = gs->cur_next_entity;
-  SER_VAR(&cur_next_entity);
-  SER_ASSERT(cur_next_entity <= ser->max_entity_index);
+  // once per grid, so its mass is right before the first process()
+  PROFILE_SCOPE("Build grid collision shapes")
+  {
+    rebuild_dirty_grid_collision_shapes(gs);
+  }
+}
 
-  SER_VAR(&s->your_player);
+static SnapshotCacheRecord *snapshot_cache_record_begin(SnapshotCache *cache, EntityID id, uint64_t tick, size_t start_cursor)
+{
+  if (id.index >= cache->capacity)
+  {
+    unsigned int new_capacity = id.index + 1 > cache->capacity * 2 ? id.index + 1 : cache->capacity * 2;
+    cache->records = realloc(cache->records, sizeof(*cache->records) * new_capacity);
+    flight_assert(cache->records != NULL);
+    memset(cache->records + cache->capacity, 0, sizeof(*cache->records) * (new_capacity - cache->capacity));
+    cache->capacity = new_capacity;
+  }
+  SnapshotCacheRecord *record = &cache->records[id.index];
+  record->id = id;
+  record->tick = tick;
+  record->start_cursor = start_cursor;
+  record->num_indices = 0;
+  return record;
+}
 
-  SER_VAR(&gs->tick);
-  SER_VAR(&gs->subframe_time);
+static void snapshot_cache_record_add_index(SnapshotCacheRecord *record, unsigned int index)
+{
+  if (record->num_indices >= record->indices_capacity)
+  {
+    record->indices_capacity = record->indices_capacity * 2 + 8;
+    record->indices = realloc(record->indices, sizeof(*record->indices) * record->indices_capacity);
+    flight_assert(record->indices != NULL);
+  }
+  record->indices[record->num_indices++] = index;
+}
 
-  if (!ser->save_or_load_from_disk) // don't save player info to disk, this is filled on connection/disconnection
+static void snapshot_cache_record_finish(SnapshotCacheRecord *record, unsigned char *bytes, size_t end_cursor)
+{
+  size_t length = end_cursor - record->start_cursor;
+  if (length > record->bytes_capacity)
   {
-    for (size_t i = 0; i < MAX_PLAYERS; i++)
-    {
-      if (get_entity(gs, gs->players[i].entity) != NULL && is_cloaked(gs, get_entity(gs, gs->players[i].entity), ser->for_player))
-      {
-        SER_MAYBE_RETURN(ser_no_player(ser));
-      }
-      else
-      {
-        SER_MAYBE_RETURN(ser_player(ser, &gs->players[i]));
-      }
-    }
+    record->bytes = realloc(record->bytes, length);
+    flight_assert(record->bytes != NULL);
+    record->bytes_capacity = length;
   }
+  memcpy(record->bytes, bytes + record->start_cursor, length);
+  record->length = length;
+}
 
-  for (int i = 0; i < MAX_SUNS; i++)
+// a grid split between parts, its later boxes are added to the end of the record
+static void snapshot_cache_record_append(SnapshotCacheRecord *record, unsigned char *bytes, size_t length)
+{
+  if (record->length + length > record->bytes_capacity)
   {
-    bool suns_done = get_entity(gs, gs->suns[i]) == NULL;
-    SER_VAR(&suns_done);
-    if (suns_done)
-      break;
-    SER_MAYBE_RETURN(ser_entityid(ser, &gs->suns[i]));
+    record->bytes = realloc(record->bytes, record->length + length);
+    flight_assert(record->bytes != NULL);
+    record->bytes_capacity = record->length + length;
   }
+  memcpy(record->bytes + record->length, bytes, length);
+  record->length += length;
+}
 
-  if (ser->serializing)
+void snapshot_cache_free(SnapshotCache *cache)
+{
+  for (unsigned int i = 0; i < cache->capacity; i++)
   {
-    PROFILE_SCOPE("Serialize entities")
+    free(cache->records[i].bytes);
+    free(cache->records[i].indices);
+  }
+  free(cache->records);
+  free(cache->roster);
+  *cache = (SnapshotCache){0};
+}
+
+static void snapshot_priorities_reserve(SnapshotPriorities *p, unsigned int num_entities)
+{
+  if (num_entities <= p->capacity)
+    return;
+  unsigned int new_capacity = num_entities > p->capacity * 2 ? num_entities : p->capacity * 2;
+#define GROW(array)                                                                               \
+  p->array = realloc(p->array, sizeof(*p->array) * new_capacity);                                 \
+  flight_assert(p->array != NULL);                                                                \
+  memset(p->array + p->capacity, 0, sizeof(*p->array) * (new_capacity - p->capacity))
+  GROW(ids);
+  GROW(accumulated);
+  GROW(record_size);
+  GROW(sent_boxes);
+  GROW(send);
+  GROW(roster);
+  GROW(candidates);
+#undef GROW
+  p->capacity = new_capacity;
+}
+
+void snapshot_priorities_free(SnapshotPriorities *p)
+{
+  free(p->ids);
+  free(p->accumulated);
+  free(p->record_size);
+  free(p->sent_boxes);
+  free(p->send);
+  free(p->roster);
+  free(p->candidates);
+  *p = (SnapshotPriorities){0};
+}
+
+static int snapshot_candidate_compare(const void *a, const void *b)
+{
+  const SnapshotCandidate *a_candidate = (const SnapshotCandidate *)a;
+  const SnapshotCandidate *b_candidate = (const SnapshotCandidate *)b;
+  if (a_candidate->priority != b_candidate->priority)
+    return a_candidate->priority > b_candidate->priority ? -1 : 1;
+  return a_candidate->index < b_candidate->index ? -1 : 1;
+}
+
+// The server can't send everything the player can see every gamestate, so each entity builds up
+// priority every gamestate it isn't sent, faster the more it matters to the player. The highest
+// priorities that fit in the budget are sent, and start building up again from zero
+void snapshot_prioritize(GameState *gs, Entity *for_player, SnapshotPriorities *p, size_t budget)
+{
+  snapshot_priorities_reserve(p, gs->cur_next_entity);
+  memset(p->send, 0, sizeof(*p->send) * p->capacity);
+  p->roster_length = 0;
+
+  Entity *own_grid = NULL;
+  Entity *seat = get_entity(gs, for_player->currently_inside_of_box);
+  if (seat != NULL && seat->is_box)
+    own_grid = box_grid(seat);
+
+  int num_candidates = 0;
+  size_t budget_left = budget;
+  ENTITIES_ITER(gs, e)
+  {
+    if (e->is_box || is_cloaked(gs, e, for_player))
+      continue;
+
+    // same as what's in range when serializing
+    bool in_range = e->always_visible;
+    if (e->is_grid)
     {
-      bool entities_done = false;
-      for (size_t i = 0; i < gs->cur_next_entity; i++)
+      BOXES_ITER(gs, cur_box, e)
       {
+        in_range |= cur_box->always_visible || cpvdistsq(entity_pos(for_player), entity_pos(cur_box)) < VISION_RADIUS * VISION_RADIUS;
+        if (in_range)
+          break;
+      }
+    }
+    else
+    {
+      in_range |= cpvdistsq(entity_pos(for_player), entity_pos(e)) < VISION_RADIUS * VISION_RADIUS;
+    }
+    if (!in_range)
+      continue;
+
+    unsigned int index = get_id(gs, e).index;
+    p->roster[p->roster_length++] = get_id(gs, e);
+    if (!entityids_same(p->ids[index], get_id(gs, e)))
+    {
+      // what was sent of the entity that was here before says nothing about this one
+      p->ids[index] = get_id(gs, e);
+      p->accumulated[index] = 0.0f;
+      p->record_size[index] = 0;
+      p->sent_boxes[index] = 0;
+    }
+
+    size_t estimated_size = p->record_size[index];
+    if (estimated_size == 0)
+      estimated_size = SNAPSHOT_RECORD_SIZE_GUESS * (1 + (e->is_grid ? grid_num_boxes(gs, e) : 0));
+
+    // the player and what they're flying are always sent, otherwise prediction falls apart
+    if (e == for_player || e == own_grid || e->always_visible)
+    {
+      p->send[index] = true;
+      p->accumulated[index] = 0.0f;
+      budget_left = estimated_size > budget_left ? 0 : budget_left - estimated_size;
+      continue;
+    }
+
+    double dist = cpvdist(entity_pos(for_player), entity_pos(e));
+    double priority = 1.0 + 4.0 * (1.0 - clamp01(dist / VISION_RADIUS));
+    priority += 0.5 * fmin(cpvlength(cpvsub(entity_vel(gs, e), entity_vel(gs, for_player))), 10.0);
+    if (p->record_size[index] == 0)
+      priority += 8.0; // never sent
+    else if (e->is_grid && p->sent_boxes[index] != (unsigned int)grid_num_boxes(gs, e))
+      priority += 4.0; // built on or blown up since it was sent
+    p->accumulated[index] += (float)priority;
+
+    p->candidates[num_candidates++] = (SnapshotCandidate){.index = index, .priority = p->accumulated[index], .estimated_size = (unsigned int)estimated_size};
+  }
+
+  qsort(p->candidates, num_candidates, sizeof(*p->candidates), snapshot_candidate_compare);
+  for (int i = 0; i < num_candidates; i++)
+  {
+    SnapshotCandidate *cur = &p->candidates[i];
+    if (cur->estimated_size > budget_left)
+      continue; // something smaller might still fit
+    budget_left -= cur->estimated_size;
+    p->send[cur->index] = true;
+    p->accumulated[cur->index] = 0.0f;
+  }
+}
+
+// More boxes of a grid whose body and first boxes were in an earlier part of the snapshot. If that part
+// never came the grid isn't here to add them to, and they're skipped
+static SerMaybeFailure deser_continued_grid(SerState *ser, GameState *gs, size_t grid_index, SnapshotCache *capture, uint64_t snapshot_tick)
+{
+  unsigned int generation = 0;
+  SER_VAR(&generation);
+  size_t run_length = 0;
+  SER_VAR(&run_length);
+  SER_ASSERT(run_length <= ser->max_size - ser->cursor);
+  size_t run_start = ser->cursor;
+  SER_ASSERT(grid_index < gs->max_entities);
+
+  Entity *grid = grid_index < gs->committed_entities ? &gs->entities[grid_index] : NULL;
+  if (grid == NULL || !grid->exists || !grid->is_grid || grid->generation != generation)
+  {
+    ser->cursor = run_start + run_length;
+    return ser_ok;
+  }
+
+  // the grid's record from the earlier part gets these boxes too, if it was captured this snapshot
+  SnapshotCacheRecord *record = NULL;
+  if (capture != NULL && grid_index < capture->capacity)
+  {
+    record = &capture->records[grid_index];
+    if (!entityids_same(record->id, get_id(gs, grid)) || record->tick != snapshot_tick)
+      record = NULL;
+  }
+
+  while (ser->cursor < run_start + run_length)
+  {
+    bool entities_done = false;
+    SER_VAR(&entities_done);
+    SER_ASSERT(!entities_done);
+    size_t box_index;
+    SER_VAR_NAME(&box_index, "&i");
+    SER_ASSERT(box_index < gs->max_entities);
+    entity_arena_commit(gs, (unsigned int)box_index + 1);
+    Entity *box = &gs->entities[box_index];
+    if (box->exists)
+    {
+      // filled in from the snapshot cache, unlike a whole record only what's at this index is replaced
+      entity_memory_free(gs, box);
+    }
+    box->exists = true;
+    if (gs->cur_next_entity < (unsigned int)box_index + 1)
+      gs->cur_next_entity = (unsigned int)box_index + 1;
+    SER_MAYBE_RETURN(ser_entity(ser, gs, box));
+    SER_ASSERT(box->is_box);
+    SER_ASSERT(get_entity(gs, box->shape_parent_entity) == grid);
+    box->prev_box = (EntityID){0};
+    box->next_box = (EntityID){0};
+    box_add_to_boxes(gs, grid, box);
+    if (record != NULL)
+      snapshot_cache_record_add_index(record, (unsigned int)box_index);
+  }
+  SER_ASSERT(ser->cursor == run_start + run_length);
+  if (record != NULL)
+    snapshot_cache_record_append(record, ser->bytes + run_start, run_length);
+  return ser_ok;
+}
+
+// Loads entity records until the entities are done, or until end_cursor if it's not 0. When capturing,
+// each record, an entity and the boxes after it, is kept in the snapshot cache so it can
+// stand in for the entity in later gamestates that don't send it
+static SerMaybeFailure deser_entities(SerState *ser, GameState *gs, size_t end_cursor, SnapshotCache *capture, uint64_t snapshot_tick)
+{
+  Entity *last_grid = NULL;
+  SnapshotCacheRecord *capturing = NULL;
+  while (true)
+  {
+    size_t record_cursor = ser->cursor;
+    bool entities_done = false;
+    if (end_cursor != 0)
+      entities_done = ser->cursor >= end_cursor;
+    else
+      SER_VAR(&entities_done);
+    if (entities_done)
+    {
+      if (capturing != NULL)
+        snapshot_cache_record_finish(capturing, ser->bytes, record_cursor);
+      break;
+    }
+    size_t next_index;
+    SER_VAR_NAME(&next_index, "&i");
+    if (next_index & SNAPSHOT_CONTINUED_GRID)
+    {
+      SER_MAYBE_RETURN(deser_continued_grid(ser, gs, next_index & ~(size_t)SNAPSHOT_CONTINUED_GRID, capture, snapshot_tick));
+      if (capturing != NULL)
+        snapshot_cache_record_finish(capturing, ser->bytes, record_cursor);
+      capturing = NULL;
+      last_grid = NULL;
+      continue;
+    }
+    SER_ASSERT(next_index < gs->max_entities);
+    SER_ASSERT(next_index >= 0);
+    entity_arena_commit(gs, (unsigned int)next_index + 1);
+    Entity *e = &gs->entities[next_index];
+    if (e->exists)
+    {
+      // only happens when an earlier part of the snapshot filled in this entity from the
+      // snapshot cache, the fresh one replaces it
+      entity_memory_free(gs, e->is_box ? box_grid(e) : e);
+    }
+    e->exists = true;
+    // unsigned int possible_next_index = (unsigned int)(next_index + 2); // plus two because player entity refers to itself on deserialization
+    unsigned int possible_next_index = (unsigned int)(next_index + 1);
+    gs->cur_next_entity = gs->cur_next_entity < possible_next_index ? possible_next_index : gs->cur_next_entity;
+    SER_MAYBE_RETURN(ser_entity(ser, gs, e));
+
+    if (e->is_box)
+    {
+      SER_ASSERT(last_grid != NULL);
+      SER_ASSERT(get_entity(gs, e->shape_parent_entity) != NULL);
+      SER_ASSERT(last_grid == get_entity(gs, e->shape_parent_entity));
+      e->prev_box = (EntityID){0};
+      e->next_box = (EntityID){0};
+      box_add_to_boxes(gs, last_grid, e);
+    }
+
+    if (e->is_grid)
+    {
+      e->boxes = (EntityID){0};
+      last_grid = e;
+    }
+
+    if (capture != NULL)
+    {
+      if (!e->is_box)
+      {
+        if (capturing != NULL)
+          snapshot_cache_record_finish(capturing, ser->bytes, record_cursor);
+        capturing = snapshot_cache_record_begin(capture, get_id(gs, e), snapshot_tick, record_cursor);
+      }
+      if (capturing != NULL)
+        snapshot_cache_record_add_index(capturing, (unsigned int)next_index);
+    }
+  }
+  return ser_ok;
+}
+
+// entities the player can still see, but that weren't in this gamestate, are loaded from the last
+// time they were sent and moved forward to where they'd be now
+static SerMaybeFailure snapshot_cache_fill(SerState *ser, GameState *gs, uint64_t snapshot_tick)
+{
+  SnapshotCache *cache = ser->snapshot_cache;
+  for (int i = 0; i < cache->roster_length; i++)
+  {
+    EntityID id = cache->roster[i];
+    if (id.index >= cache->capacity)
+      continue;
+    SnapshotCacheRecord *record = &cache->records[id.index];
+    if (!entityids_same(record->id, id) || record->tick >= snapshot_tick)
+      continue;
+
+    bool already_loaded = false;
+    for (int ii = 0; ii < record->num_indices; ii++)
+    {
+      if (record->indices[ii] < gs->committed_entities && gs->entities[record->indices[ii]].exists)
+        already_loaded = true;
+    }
+    if (already_loaded)
+      continue;
+
+    SerState record_ser = *ser;
+    record_ser.bytes = record->bytes;
+    record_ser.cursor = 0;
+    record_ser.max_size = record->length;
+    SER_MAYBE_RETURN(deser_entities(&record_ser, gs, record->length, NULL, snapshot_tick));
+
+    Entity *e = get_entity(gs, id);
+    if (e != NULL && e->body != NULL)
+    {
+      double dt = (double)(snapshot_tick - record->tick) * TIMESTEP;
+      cpBodySetPosition(e->body, cpvadd(cpBodyGetPosition(e->body), cpvmult(cpBodyGetVelocity(e->body), dt)));
+      cpBodySetAngle(e->body, cpBodyGetAngle(e->body) + cpBodyGetAngularVelocity(e->body) * dt);
+    }
+  }
+  return ser_ok;
+}
+
+static SerMaybeFailure ser_world(SerState *ser, ServerToClient *s)
+{
+  SER_VAR(&ser->version);
+  SER_ASSERT(ser->version >= 0);
+  SER_ASSERT(ser->version < VMax);
+  SER_VAR(&ser->git_release_tag);
+
+  if (ser->git_release_tag > GIT_RELEASE_TAG)
+  {
+    char msg[2048] = {0};
+    snprintf(msg, 2048, "Current game build %d is old, download the server's build %d! The most recent one in discord!\n", GIT_RELEASE_TAG, ser->git_release_tag);
+    quit_with_popup(msg, "Old Game Build");
+    SER_ASSERT(ser->git_release_tag <= GIT_RELEASE_TAG);
+  }
+
+  GameState *gs = s->cur_gs;
+
+  // Over the network gamestates are split into parts that can each be applied on their own, so a
+  // lost packet only loses the entities in it. Parts of the same tick merge into the same world
+  bool merge_snapshot_part = false;
+  uint64_t snapshot_tick = gs->tick;
+  if (!ser->save_or_load_from_disk)
+  {
+    SER_VAR(&snapshot_tick);
+    SER_VAR(&ser->part_index);
+    SER_ASSERT(ser->part_index >= 0);
+
+    if (ser->part_index == 0)
+    {
+      SER_MAYBE_RETURN(ser_opus_packets(ser, s->audio_playback_buffer));
+      SER_VAR(&s->redirect_port);
+      SER_VAR(&s->redirect_token);
+    }
+
+    // parts are unreliable and come out of order. One older than the world, or of the world's tick
+    // after it was predicted forward, is just late and is dropped without touching the world
+    if (!ser->serializing && ser->applying_snapshot_parts)
+    {
+      merge_snapshot_part = snapshot_tick == ser->last_snapshot_tick;
+      if (snapshot_tick < ser->last_snapshot_tick || (merge_snapshot_part && !ser->can_merge_snapshot))
+      {
+        ser->dropped_snapshot_part = true;
+        return ser_ok;
+      }
+    }
+  }
+
+  if (merge_snapshot_part)
+  {
+    gs->bulk_loading = true;
+  }
+  // completely reset and destroy all gamestate data
+  else if (!ser->serializing)
+  {
+    PROFILE_SCOPE("Destroy old gamestate")
+    {
+      // avoid a memset here very expensive. que rico!
+      destroy_world(gs);
+      initialize(gs, gs->entities, gs->max_entities * sizeof(*gs->entities));
+      gs->cur_next_entity = 0; // updated on deserialization
+      gs->bulk_loading = true; // bodies and shapes are added to the space all at once in finish_bulk_load
+    }
+  }
+
+  int cur_next_entity = 0;
+  if (ser->serializing)
+    cur_next_entity = ser->compacted_indices != NULL ? (int)ser->num_compacted : gs->cur_next_entity;
+  SER_VAR(&cur_next_entity);
+  SER_ASSERT(cur_next_entity <= ser->max_entity_index);
+
+  SER_VAR(&s->your_player);
+
+  SER_VAR(&gs->tick);
+  SER_VAR(&gs->subframe_time);
+
+  if (!ser->save_or_load_from_disk) // don't save player info to disk, this is filled on connection/disconnection
+  {
+    if (ser->version >= VPlayersNearby)
+      SER_VAR(&gs->squads_taken);
+    SER_MAYBE_RETURN(ser_players(ser, gs, s->your_player));
+  }
+
+  for (int i = 0; i < MAX_SUNS; i++)
+  {
+    bool suns_done = get_entity(gs, gs->suns[i]) == NULL;
+    SER_VAR(&suns_done);
+    if (suns_done)
+      break;
+    SER_MAYBE_RETURN(ser_entityid(ser, &gs->suns[i]));
+  }
+
+  // the rest of the world is made from the seed, only which parts of it were already made is saved
+  if ((ser->save_or_load_from_disk || ser->server_state) && ser->version >= VSectors)
+  {
+    SER_VAR(&gs->world_seed);
+    SER_VAR(&gs->num_generated_sectors);
+    if (!ser->serializing)
+    {
+      if (gs->num_generated_sectors > (1u << 24))
+        SER_FAIL("Save has an impossible number of generated sectors");
+      gs->generated_sectors_capacity = gs->num_generated_sectors;
+      gs->generated_sectors = calloc(gs->generated_sectors_capacity + 1, sizeof(*gs->generated_sectors));
+      flight_assert(gs->generated_sectors != NULL);
+    }
+    for (unsigned int i = 0; i < gs->num_generated_sectors; i++)
+      SER_VAR(&gs->generated_sectors[i]);
+  }
+
+  // which entities the player can see, including the ones not sent this time. -1 means all of them were sent
+  if (!ser->save_or_load_from_disk && ser->part_index == 0)
+  {
+    int roster_length = -1;
+    if (ser->serializing && ser->priorities != NULL)
+      roster_length = ser->priorities->roster_length;
+    SER_VAR(&roster_length);
+    SER_ASSERT(roster_length >= -1);
+    SnapshotCache *cache = ser->serializing ? NULL : ser->snapshot_cache;
+    if (cache != NULL)
+      cache->roster_length = 0;
+    for (int i = 0; i < roster_length; i++)
+    {
+      EntityID id = {0};
+      if (ser->serializing)
+        id = ser->priorities->roster[i];
+      SER_MAYBE_RETURN(ser_entityid(ser, &id));
+      if (cache != NULL)
+      {
+        if (cache->roster_length >= cache->roster_capacity)
+        {
+          cache->roster_capacity = cache->roster_capacity * 2 + 64;
+          cache->roster = realloc(cache->roster, sizeof(*cache->roster) * cache->roster_capacity);
+          flight_assert(cache->roster != NULL);
+        }
+        cache->roster[cache->roster_length++] = id;
+      }
+    }
+  }
+
+  if (ser->serializing)
+  {
+    PROFILE_SCOPE("Serialize entities")
+    {
+      bool entities_done = false;
+      int records_in_part = 0;
+      bool split_grid = false;
+      ser->part_end_entity = gs->cur_next_entity;
+      ser->part_end_box = (EntityID){0};
+      for (size_t i = ser->part_start_entity; i < gs->cur_next_entity; i++)
+      {
+        size_t record_start = ser->cursor;
+        bool continuing_grid = i == ser->part_start_entity && ser->part_start_box.generation != 0;
         Entity *e = &gs->entities[i];
+        if (ser->priorities != NULL && !e->is_box && !(i < ser->priorities->capacity && ser->priorities->send[i]))
+          continue; // not important enough this time, see snapshot_prioritize
 #define DONT_SEND_BECAUSE_CLOAKED(entity) (!ser->save_or_load_from_disk && ser->for_player != NULL && is_cloaked(gs, entity, ser->for_player))
-#define SER_ENTITY()       \
-  SER_VAR(&entities_done); \
-  SER_VAR(&i);             \
-  SER_MAYBE_RETURN(ser_entity(ser, gs, e))
+#define SER_ENTITY()                                              \
+  {                                                               \
+    SER_VAR(&entities_done);                                      \
+    size_t the_index = ser_compacted_index(ser, (unsigned int)i); \
+    SER_VAR_NAME(&the_index, "&i");                               \
+    SER_MAYBE_RETURN(ser_entity(ser, gs, e));                     \
+  }
         if (e->exists && !(ser->save_or_load_from_disk && e->no_save_to_disk) && !DONT_SEND_BECAUSE_CLOAKED(e))
         {
           if (!e->is_box && !e->is_grid)
@@ -1807,10 +3321,19 @@ SerMaybeFailure ser_server_to_client(SerState *ser, ServerToClient *s)
           if (e->is_grid)
           {
             bool serialized_grid_yet = false;
+            bool reached_start_box = !continuing_grid;
+            size_t run_start = 0;
+            int boxes_in_part = 0;
             // serialize boxes always after bodies, so that by the time the boxes
             // are loaded in the parent body is loaded in and can be referenced.
             BOXES_ITER(gs, cur_box, e)
             {
+              if (!reached_start_box)
+              {
+                reached_start_box = entityids_same(get_id(gs, cur_box), ser->part_start_box);
+                if (!reached_start_box)
+                  continue; // sent in an earlier part
+              }
               bool this_box_in_range = ser->save_or_load_from_disk;
               this_box_in_range |= ser->for_player == NULL;
               this_box_in_range |= (ser->for_player != NULL && cpvdistsq(entity_pos(ser->for_player), entity_pos(cur_box)) < VISION_RADIUS * VISION_RADIUS); // only in vision radius
@@ -1820,24 +3343,75 @@ SerMaybeFailure ser_server_to_client(SerState *ser, ServerToClient *s)
                 this_box_in_range = true;
               if (this_box_in_range)
               {
+                // a grid too big for a part on its own is split between parts by runs of its boxes
+                if (ser->part_budget > 0 && ser->cursor > ser->part_budget && records_in_part == 0 && boxes_in_part > 0)
+                {
+                  split_grid = true;
+                  ser->part_end_entity = (unsigned int)i;
+                  ser->part_end_box = get_id(gs, cur_box);
+                  break;
+                }
                 if (!serialized_grid_yet)
                 {
                   serialized_grid_yet = true;
-                  SER_ENTITY();
+                  if (continuing_grid)
+                  {
+                    // the grid's body was in an earlier part, the client only adds these boxes to it if it has that part
+                    SER_VAR(&entities_done);
+                    size_t the_index = ser_compacted_index(ser, (unsigned int)i) | SNAPSHOT_CONTINUED_GRID;
+                    SER_VAR_NAME(&the_index, "&i");
+                    SER_VAR(&e->generation);
+                    size_t run_length = 0;
+                    SER_VAR(&run_length);
+                    run_start = ser->cursor;
+                  }
+                  else
+                  {
+                    SER_ENTITY();
+                  }
                 }
+                boxes_in_part++;
 
                 // serialize this box
                 EntityID cur_id = get_id(gs, cur_box);
                 SER_ASSERT(cur_id.index < gs->max_entities);
                 SER_VAR(&entities_done);
-                size_t the_index = (size_t)cur_id.index; // super critical. Type of &i is size_t. Checked when write varnames is true though!
+                size_t the_index = (size_t)ser_compacted_index(ser, cur_id.index); // super critical. Type of &i is size_t. Checked when write varnames is true though!
                 SER_VAR_NAME(&the_index, "&i");
                 SER_MAYBE_RETURN(ser_entity(ser, gs, cur_box));
               }
             }
+            if (run_start != 0)
+            {
+              size_t run_length = ser->cursor - run_start;
+              memcpy(ser->bytes + run_start - sizeof(run_length), &run_length, sizeof(run_length));
+            }
           }
         }
 #undef SER_ENTITY
+
+        // otherwise parts only have whole records, a grid and its boxes are one record because the boxes need its body
+        if (ser->cursor != record_start)
+        {
+          if (ser->part_budget > 0 && ser->cursor > ser->part_budget && records_in_part > 0)
+          {
+            ser->cursor = record_start;
+            ser->part_end_entity = (unsigned int)i;
+            break;
+          }
+          records_in_part++;
+          if (ser->priorities != NULL && i < ser->priorities->capacity)
+          {
+            size_t record_size = ser->cursor - record_start;
+            if (continuing_grid)
+              record_size += ser->priorities->record_size[i];
+            ser->priorities->record_size[i] = (unsigned int)record_size;
+            if (e->is_grid)
+              ser->priorities->sent_boxes[i] = (unsigned int)grid_num_boxes(gs, e);
+          }
+        }
+        if (split_grid)
+          break;
       }
       entities_done = true;
       SER_VAR(&entities_done);
@@ -1847,43 +3421,13 @@ SerMaybeFailure ser_server_to_client(SerState *ser, ServerToClient *s)
   {
     PROFILE_SCOPE("Deserialize entities")
     {
-      Entity *last_grid = NULL;
-      while (true)
-      {
-        bool entities_done = false;
-        SER_VAR(&entities_done);
-        if (entities_done)
-          break;
-        size_t next_index;
-        SER_VAR_NAME(&next_index, "&i");
-        SER_ASSERT(next_index < gs->max_entities);
-        SER_ASSERT(next_index >= 0);
-        Entity *e = &gs->entities[next_index];
-        e->exists = true;
-        // unsigned int possible_next_index = (unsigned int)(next_index + 2); // plus two because player entity refers to itself on deserialization
-        unsigned int possible_next_index = (unsigned int)(next_index + 1);
-        gs->cur_next_entity = gs->cur_next_entity < possible_next_index ? possible_next_index : gs->cur_next_entity;
-        SER_MAYBE_RETURN(ser_entity(ser, gs, e));
-
-        if (e->is_box)
-        {
-          SER_ASSERT(last_grid != NULL);
-          SER_ASSERT(get_entity(gs, e->shape_parent_entity) != NULL);
-          SER_ASSERT(last_grid == get_entity(gs, e->shape_parent_entity));
-          e->prev_box = (EntityID){0};
-          e->next_box = (EntityID){0};
-          box_add_to_boxes(gs, last_grid, e);
-        }
-
-        if (e->is_grid)
-        {
-          e->boxes = (EntityID){0};
-          last_grid = e;
-        }
-      }
+      SER_MAYBE_RETURN(deser_entities(ser, gs, 0, ser->snapshot_cache, snapshot_tick));
+      if (ser->snapshot_cache != NULL)
+        SER_MAYBE_RETURN(snapshot_cache_fill(ser, gs, snapshot_tick));
 
       PROFILE_SCOPE("Add to free list")
       {
+        memset(gs->free_entities, 0, sizeof(*gs->free_entities) * ((gs->cur_next_entity + 63) / 64)); // merged parts fill in slots that were free
         for (size_t i = 0; i < gs->cur_next_entity; i++)
         {
           Entity *e = &gs->entities[i];
@@ -1891,8 +3435,7 @@ SerMaybeFailure ser_server_to_client(SerState *ser, ServerToClient *s)
           {
             if (e->generation == 0)
               e->generation = 1; // 0 generation reference is invalid, means null
-            e->next_free_entity = gs->free_list;
-            gs->free_list = get_id(gs, e);
+            gs->free_entities[i / 64] |= 1ull << (i % 64);
           }
         }
       }
@@ -1901,55 +3444,255 @@ SerMaybeFailure ser_server_to_client(SerState *ser, ServerToClient *s)
   return ser_ok;
 }
 
-// On serialize:
-// 1. put struct's data into bytes, for a specific player or not, and to disk or not
-// 2. output the number of bytes it took to put the struct's data into bytes
+// Saving to disk is when the world is renumbered so the entities have no holes between them,
+// after a long session of missiles and explosions the free slots are scattered everywhere.
+// Every reference goes through ser_entityid, which rewrites it to the new index
+static void ser_compact_entities(SerState *ser, GameState *gs)
+{
+  ser->compacted_indices = calloc(gs->cur_next_entity + 1, sizeof(*ser->compacted_indices));
+  flight_assert(ser->compacted_indices != NULL);
+  ser->num_compacted = 0;
+  ENTITIES_ITER(gs, e)
+  {
+    bool saved = !e->no_save_to_disk;
+    if (e->is_grid)
+      saved &= get_entity(gs, e->boxes) != NULL; // grids are only saved along with their boxes
+    if (e->is_box)
+      saved = !box_grid(e)->no_save_to_disk; // and boxes along with their grid
+    if (saved)
+    {
+      ser->num_compacted++;
+      ser->compacted_indices[get_id(gs, e).index] = ser->num_compacted; // zero means not saved
+    }
+  }
+}
 
-// On deserialize:
-// 1. put bytes into a struct for a specific player, from disk or not
-// 2. perform operations on those bytes to initialize the struct
+enum SaveFormat
+{
+  // 1 is reserved, it had the schema's offset patched into the header which streaming can't do. Never loaded
+  SaveFormatBlocks = 2, // header, blocks of packed fields, blocks of the schema, then the trailer
+};
+static const char save_magic[4] = {'F', 'L', 'S', 'V'};
+static const char save_trailer_magic[4] = {'F', 'L', 'S', 'E'};
 
-// for_this_player can be null then the entire world will be sent
-bool server_to_client_serialize(struct ServerToClient *msg, unsigned char *bytes, size_t *out_len, size_t max_len, Entity *for_this_player, bool to_disk)
+typedef struct SaveHeader
 {
-  flight_assert(msg->cur_gs != NULL);
-  flight_assert(msg != NULL);
+  char magic[4];
+  uint32_t format;
+} SaveHeader;
 
-  SerState ser = (SerState){
-      .bytes = bytes,
-      .serializing = true,
-      .cursor = 0,
-      .max_size = max_len,
-      .for_player = for_this_player,
-      .max_entity_index = msg->cur_gs->cur_next_entity,
-      .version = VMax - 1,
-      .save_or_load_from_disk = to_disk,
-  };
+// last thing in the file, so a save that was cut off or has garbage after it is found without reading it all
+typedef struct SaveTrailer
+{
+  uint64_t schema_at; // file offset of the first block of the schema, where the fields' blocks end
+  char magic[4];
+} SaveTrailer;
 
-  ser.write_varnames = to_disk;
-#ifdef WRITE_VARNAMES
-  ser.write_varnames = true;
-#endif
+static SerMaybeFailure ser_schema_write(SerState *ser, SerSchema *schema)
+{
+  SER_VAR(&schema->num_seen);
+  for (int i = 0; i < schema->num_seen; i++)
+  {
+    SerSchemaField *field = &schema->seen[i];
+    uint8_t name_length = (uint8_t)field->name_length;
+    SER_VAR(&field->size);
+    SER_VAR(&name_length);
+    SER_DATA((char *)field->name, name_length);
+  }
+  return ser_ok;
+}
 
-  SerMaybeFailure result = ser_server_to_client(&ser, msg);
-  *out_len = ser.cursor + 1; // not sure why I need to add one to cursor, ser.cursor should be the length. It seems to work without the +1 but I have no way to ensure that it works completely when removing the +1...
-  if (result.failed)
+static SerMaybeFailure ser_schema_read(SerState *ser, SerSchema *schema)
+{
+  SER_VAR(&schema->num_in_file);
+  if (schema->num_in_file < 0 || schema->num_in_file > SER_SCHEMA_MAX_FIELDS)
+    SER_FAIL("Save's schema has an impossible number of fields");
+  for (int i = 0; i < schema->num_in_file; i++)
   {
-    Log("Failed to serialize on line %d because of %s\n", result.line, result.expression);
-    return false;
+    SerSchemaField *field = &schema->in_file[i];
+    uint8_t name_length = 0;
+    SER_VAR(&field->size);
+    SER_VAR(&name_length);
+    char *name = calloc(1, name_length + 1);
+    flight_assert(name != NULL);
+    field->name = name;
+    field->name_length = name_length;
+    SER_DATA(name, name_length);
+  }
+  return ser_ok;
+}
+
+static void ser_schema_free(SerSchema *schema)
+{
+  for (int i = 0; i < schema->num_in_file; i++)
+    free((char *)schema->in_file[i].name);
+  free(schema);
+}
+
+// Saves from before the header have the name of every field in front of it, and aren't in blocks.
+// Only ever loaded once, they're saved in blocks after that
+static SerMaybeFailure ser_legacy_world(SerState *ser, ServerToClient *s)
+{
+  FILE *file = ser->stream->file;
+  if (fseek(file, 0, SEEK_END) != 0)
+    SER_FAIL("Couldn't find the size of the save");
+  long file_size = ftell(file);
+  if (file_size <= 1 || fseek(file, 0, SEEK_SET) != 0)
+    SER_FAIL("Couldn't find the size of the save");
+  unsigned char *bytes = malloc((size_t)file_size);
+  flight_assert(bytes != NULL);
+  SerMaybeFailure result = ser_ok;
+  if (fread(bytes, (size_t)file_size, 1, file) != 1)
+  {
+    result = (SerMaybeFailure){.failed = true, .line = __LINE__, .expression = "Couldn't read the save"};
   }
   else
   {
-    return true;
+    Log("Loading a save from before save blocks, it's read all at once\n");
+    ser->stream = NULL;
+    ser->bytes = bytes;
+    ser->cursor = 0;
+    ser->max_size = (size_t)file_size;
+    ser->write_varnames = true;
+    result = ser_world(ser, s);
+    ser->bytes = NULL;
   }
+  free(bytes);
+  return result;
 }
 
-bool server_to_client_deserialize(struct ServerToClient *msg, unsigned char *bytes, size_t max_len, bool from_disk)
+// Saves are streamed through SAVE_BLOCK_SIZE at a time, see init_saving. After a header the fields
+// are packed in blocks, then the schema they're checked against is in blocks of its own, see
+// ser_schema_field. Loading reads the trailer and the schema first, then comes back for the fields
+static SerMaybeFailure ser_disk_world(SerState *ser, ServerToClient *s)
 {
-  flight_assert(msg->cur_gs != NULL);
-  flight_assert(msg != NULL);
-
-  SerState servar = (SerState){
+  if (ser->stream == NULL)
+    SER_FAIL("Saves are streamed to and from a file, see init_saving");
+  FILE *file = ser->stream->file;
+
+  SaveHeader header = {.format = SaveFormatBlocks};
+  memcpy(header.magic, save_magic, sizeof(header.magic));
+  SaveTrailer trailer = {0};
+  memcpy(trailer.magic, save_trailer_magic, sizeof(trailer.magic));
+  if (ser->serializing)
+  {
+    if (fwrite(&header, sizeof(header), 1, file) != 1)
+      SER_FAIL("Couldn't write the header of the save");
+  }
+  else
+  {
+    if (fread(&header, sizeof(header), 1, file) != 1 || memcmp(header.magic, save_magic, sizeof(header.magic)) != 0)
+      return ser_legacy_world(ser, s);
+    if (header.format != SaveFormatBlocks)
+      SER_FAIL("Save is in a format this build doesn't load");
+    if (fseek(file, -(long)sizeof(trailer), SEEK_END) != 0 || fread(&trailer, sizeof(trailer), 1, file) != 1)
+      SER_FAIL("Save is too short to have a trailer");
+    uint64_t trailer_at = (uint64_t)ftell(file) - sizeof(trailer);
+    if (memcmp(trailer.magic, save_trailer_magic, sizeof(trailer.magic)) != 0)
+      SER_FAIL("Save's trailer is missing, it was cut off or has something after it");
+    if (trailer.schema_at < sizeof(header) || trailer.schema_at >= trailer_at)
+      SER_FAIL("Save's schema is outside of it");
+  }
+
+  SerSchema *schema = calloc(1, sizeof(*schema));
+  flight_assert(schema != NULL);
+  SerMaybeFailure result = ser_ok;
+  if (!ser->serializing)
+  {
+    fseek(file, (long)trailer.schema_at, SEEK_SET);
+    result = ser_schema_read(ser, schema);
+    fseek(file, (long)sizeof(header), SEEK_SET);
+    ser->cursor = 0;
+    ser->max_size = 0;
+  }
+  if (!result.failed)
+  {
+    ser->schema = schema;
+    result = ser_world(ser, s);
+    ser->schema = NULL;
+  }
+  if (!result.failed)
+  {
+    if (ser->serializing)
+    {
+      result = ser_stream_flush(ser);
+      trailer.schema_at = (uint64_t)ftell(file);
+      if (!result.failed)
+        result = ser_schema_write(ser, schema);
+      if (!result.failed)
+        result = ser_stream_flush(ser);
+      if (!result.failed && fwrite(&trailer, sizeof(trailer), 1, file) != 1)
+        result = (SerMaybeFailure){.failed = true, .line = __LINE__, .expression = "Couldn't write the trailer of the save"};
+    }
+    else if (ser->cursor != ser->max_size || (uint64_t)ftell(file) != trailer.schema_at)
+    {
+      result = (SerMaybeFailure){.failed = true, .line = __LINE__, .expression = "Save has more fields than this build loads"};
+    }
+  }
+  ser_schema_free(schema);
+  return result;
+}
+
+SerMaybeFailure ser_server_to_client(SerState *ser, ServerToClient *s)
+{
+  if (ser->serializing && ser->save_or_load_from_disk)
+    ser_compact_entities(ser, s->cur_gs);
+  SerMaybeFailure result = ser->save_or_load_from_disk && !ser->write_varnames ? ser_disk_world(ser, s) : ser_world(ser, s);
+  free(ser->compacted_indices);
+  ser->compacted_indices = NULL;
+  if (s->cur_gs->bulk_loading) // even if it failed partway, whatever was loaded must be in the space to be freed
+    finish_bulk_load(s->cur_gs);
+  return result;
+}
+
+// On serialize:
+// 1. put struct's data into bytes, for a specific player or not, and to disk or not
+// 2. output the number of bytes it took to put the struct's data into bytes
+
+// On deserialize:
+// 1. put bytes into a struct for a specific player, from disk or not
+// 2. perform operations on those bytes to initialize the struct
+
+// for_this_player can be null then the entire world will be sent
+bool server_to_client_serialize(struct ServerToClient *msg, unsigned char *bytes, size_t *out_len, size_t max_len, Entity *for_this_player, bool to_disk)
+{
+  flight_assert(msg->cur_gs != NULL);
+  flight_assert(msg != NULL);
+
+  SerState ser = (SerState){
+      .bytes = bytes,
+      .serializing = true,
+      .cursor = 0,
+      .max_size = max_len,
+      .for_player = for_this_player,
+      .max_entity_index = msg->cur_gs->cur_next_entity,
+      .version = VMax - 1,
+      .save_or_load_from_disk = to_disk,
+  };
+
+#ifdef WRITE_VARNAMES
+  ser.write_varnames = true;
+#endif
+
+  SerMaybeFailure result = ser_server_to_client(&ser, msg);
+  *out_len = ser.cursor + 1; // not sure why I need to add one to cursor, ser.cursor should be the length. It seems to work without the +1 but I have no way to ensure that it works completely when removing the +1...
+  if (result.failed)
+  {
+    Log("Failed to serialize on line %d because of %s\n", result.line, result.expression);
+    return false;
+  }
+  else
+  {
+    return true;
+  }
+}
+
+bool server_to_client_deserialize(struct ServerToClient *msg, unsigned char *bytes, size_t max_len, bool from_disk)
+{
+  flight_assert(msg->cur_gs != NULL);
+  flight_assert(msg != NULL);
+
+  SerState servar = (SerState){
       .bytes = bytes,
       .serializing = false,
       .cursor = 0,
@@ -1958,9 +3701,6 @@ bool server_to_client_deserialize(struct ServerToClient *msg, unsigned char *byt
       .save_or_load_from_disk = from_disk,
   };
 
-  if (from_disk)
-    servar.write_varnames = true;
-
 #ifdef WRITE_VARNAMES
   servar.write_varnames = true;
 #endif
@@ -1978,11 +3718,362 @@ bool server_to_client_deserialize(struct ServerToClient *msg, unsigned char *byt
   }
 }
 
+// the root, the boxes of it if it's a grid, then the players sitting in those boxes. Returns how many, and fills
+// group with them if it isn't NULL
+static int entity_group(GameState *gs, Entity *root, Entity **group)
+{
+  flight_assert(!root->is_box);
+  int length = 0;
+#define GROUP_ADD(e)       \
+  {                        \
+    if (group != NULL)     \
+      group[length] = (e); \
+    length++;              \
+  }
+  GROUP_ADD(root);
+  if (root->is_grid)
+  {
+    BOXES_ITER(gs, cur, root)
+    GROUP_ADD(cur);
+    BOXES_ITER(gs, cur, root)
+    {
+      Entity *seated = get_entity(gs, cur->player_who_is_inside_of_me);
+      if (seated != NULL)
+        GROUP_ADD(seated);
+    }
+  }
+#undef GROUP_ADD
+  return length;
+}
+
+void entity_group_free(GameState *gs, Entity *root)
+{
+  if (root->is_grid)
+  {
+    BOXES_ITER(gs, cur, root)
+    {
+      Entity *seated = get_entity(gs, cur->player_who_is_inside_of_me);
+      if (seated != NULL)
+        entity_memory_free(gs, seated);
+    }
+  }
+  entity_memory_free(gs, root); // frees a grid's boxes too
+}
+
+// the players controlling player entities in root's group, the ones ser_handoff sends along with it. Fills in
+// the slot and player of each in out if it isn't NULL, returns how many
+int entity_group_players(GameState *gs, Entity *root, HandedOffPlayer *out)
+{
+  int num_entities = entity_group(gs, root, NULL);
+  Entity **group = malloc(sizeof(*group) * num_entities);
+  flight_assert(group != NULL);
+  entity_group(gs, root, group);
+  int found = 0;
+  PLAYERS_ITER(gs, cur)
+  {
+    Entity *player_entity = get_entity(gs, cur->entity);
+    if (player_entity == NULL)
+      continue;
+    for (int i = 0; i < num_entities; i++)
+    {
+      if (group[i] != player_entity)
+        continue;
+      if (out != NULL)
+        out[found] = (HandedOffPlayer){.from_slot = (int)(cur - gs->players), .player = *cur};
+      found++;
+      break;
+    }
+  }
+  free(group);
+  return found;
+}
+
+static SerMaybeFailure ser_entity_group_records(SerState *ser, GameState *gs, Entity **group, int num_entities, HandedOffPlayer **players, int *num_players, int *num_loaded)
+{
+  for (int i = 0; i < num_entities; i++)
+  {
+    Entity *e = ser->serializing ? group[i] : get_entity(gs, ser->group_ids[i]);
+    SER_MAYBE_RETURN(ser_entity(ser, gs, e));
+    if (!ser->serializing)
+    {
+      *num_loaded = i + 1;
+      if (e->is_grid)
+      {
+        SER_ASSERT(i == 0);
+        e->boxes = (EntityID){0};
+      }
+      if (e->is_box)
+      {
+        Entity *grid = get_entity(gs, ser->group_ids[0]);
+        SER_ASSERT(grid->is_grid);
+        SER_ASSERT(get_entity(gs, e->shape_parent_entity) == grid);
+        e->prev_box = (EntityID){0};
+        e->next_box = (EntityID){0};
+        box_add_to_boxes(gs, grid, e);
+      }
+    }
+  }
+
+  // the players controlling player entities in the group go along with them. Serializing, they're the
+  // caller's from entity_group_players with a token and client host each. Deserializing, they're allocated
+  // for the caller to free
+  int players_in_group = 0;
+  if (ser->serializing && players != NULL)
+    players_in_group = *num_players;
+  SER_VAR(&players_in_group);
+  SER_ASSERT(players_in_group >= 0);
+  SER_ASSERT(players_in_group <= MAX_PLAYERS);
+  SER_ASSERT(players_in_group == 0 || players != NULL);
+  if (!ser->serializing && players_in_group > 0)
+  {
+    *players = calloc(players_in_group, sizeof(**players));
+    flight_assert(*players != NULL);
+  }
+  for (int i = 0; i < players_in_group; i++)
+  {
+    HandedOffPlayer *player = &(*players)[i];
+    if (ser->serializing)
+    {
+      flight_assert(player->token != 0); // 0 is a client connecting for the first time
+      flight_assert(ser->compacted_indices[player->player.entity.index] != 0);
+    }
+    SER_VAR(&player->token);
+    SER_VAR(&player->client_host);
+    SER_MAYBE_RETURN(ser_player(ser, &player->player));
+  }
+  if (num_players != NULL)
+    *num_players = players_in_group;
+  return ser_ok;
+}
+
+// The entities in the group are numbered from 0 in the message, so it can be loaded into any free slots
+static SerMaybeFailure ser_entity_group(SerState *ser, GameState *gs, Entity **root, HandedOffPlayer **players, int *num_players)
+{
+  int num_entities = 0;
+  Entity **group = NULL;
+  if (ser->serializing)
+    num_entities = entity_group(gs, *root, NULL);
+  SER_VAR(&num_entities);
+  SER_ASSERT(num_entities > 0);
+  SER_ASSERT((size_t)num_entities <= ser->max_size - ser->cursor); // every entity is at least a byte
+
+  if (ser->serializing)
+  {
+    group = malloc(sizeof(*group) * num_entities);
+    flight_assert(group != NULL);
+    entity_group(gs, *root, group);
+    ser->compacted_indices = calloc(gs->cur_next_entity + 1, sizeof(*ser->compacted_indices));
+    flight_assert(ser->compacted_indices != NULL);
+    for (int i = 0; i < num_entities; i++)
+      ser->compacted_indices[get_id(gs, group[i]).index] = i + 1;
+    ser->num_compacted = num_entities;
+  }
+  else
+  {
+    ser->group_ids = malloc(sizeof(*ser->group_ids) * num_entities);
+    flight_assert(ser->group_ids != NULL);
+    ser->num_group_ids = num_entities;
+    for (int i = 0; i < num_entities; i++)
+      ser->group_ids[i] = get_id(gs, new_entity(gs)); // all made up front, the grid refers to boxes loaded after it
+  }
+
+  int num_loaded = 0;
+  SerMaybeFailure result = ser_entity_group_records(ser, gs, group, num_entities, players, num_players, &num_loaded);
+
+  if (ser->serializing)
+  {
+    free(group);
+    free(ser->compacted_indices);
+    ser->compacted_indices = NULL;
+  }
+  else
+  {
+    if (result.failed)
+    {
+      // backwards so boxes are unlinked from the grid before it goes
+      for (int i = num_entities - 1; i >= 0; i--)
+      {
+        Entity *e = get_entity(gs, ser->group_ids[i]);
+        if (e == NULL)
+          continue;
+        if (i >= num_loaded)
+          e->is_box = false; // never linked into the grid's boxes
+        entity_memory_free(gs, e);
+      }
+    }
+    else
+    {
+      *root = get_entity(gs, ser->group_ids[0]);
+    }
+    free(ser->group_ids);
+    ser->group_ids = NULL;
+  }
+  return result;
+}
+
+static ShardGhost *shard_ghost_find(ShardGhosts *ghosts, EntityID remote)
+{
+  for (int i = 0; i < ghosts->length; i++)
+  {
+    if (ghosts->ghosts[i].remote.index == remote.index && ghosts->ghosts[i].remote.generation == remote.generation)
+      return &ghosts->ghosts[i];
+  }
+  return NULL;
+}
+
+static void shard_ghost_remove(GameState *gs, ShardGhosts *ghosts, ShardGhost *ghost)
+{
+  Entity *local = get_entity(gs, ghost->local);
+  if (local != NULL)
+    entity_group_free(gs, local);
+  *ghost = ghosts->ghosts[ghosts->length - 1];
+  ghosts->length--;
+}
+
+void shard_ghosts_free(GameState *gs, ShardGhosts *ghosts)
+{
+  if (gs != NULL)
+  {
+    while (ghosts->length > 0)
+      shard_ghost_remove(gs, ghosts, &ghosts->ghosts[0]);
+  }
+  free(ghosts->ghosts);
+  *ghosts = (ShardGhosts){0};
+}
+
+// An entity crossing into a neighboring shard's strip is sent there, and freed by the caller once it's sent.
+// If the neighbor had a ghost of it, the real thing replaces it
+SerMaybeFailure ser_handoff(SerState *ser, GameState *gs, ShardGhosts *ghosts, Entity **root, HandedOffPlayer **players, int *num_players)
+{
+  SER_VAR(&ser->version);
+  SER_ASSERT(ser->version >= 0);
+  SER_ASSERT(ser->version < VMax);
+
+  EntityID remote = {0};
+  if (ser->serializing)
+    remote = get_id(gs, *root);
+  SER_VAR(&remote.generation);
+  SER_VAR(&remote.index);
+  if (!ser->serializing && ghosts != NULL)
+  {
+    ShardGhost *ghost = shard_ghost_find(ghosts, remote);
+    if (ghost != NULL)
+      shard_ghost_remove(gs, ghosts, ghost);
+  }
+
+  return ser_entity_group(ser, gs, root, players, num_players);
+}
+
+// Entities near a border are copied to the shard on the other side, so what's near the border there still
+// collides with them. The copies are kinematic, only moved by their velocity until the owner says where they
+// are again. When a copy has as many entities as last time only its body is moved, otherwise it's made again
+SerMaybeFailure ser_ghosts(SerState *ser, GameState *gs, ShardGhosts *ghosts, Entity **roots, int num_roots)
+{
+  SER_VAR(&ser->version);
+  SER_ASSERT(ser->version >= 0);
+  SER_ASSERT(ser->version < VMax);
+
+  if (!ser->serializing)
+  {
+    for (int i = 0; i < ghosts->length; i++)
+      ghosts->ghosts[i].seen = false;
+  }
+
+  SER_VAR(&num_roots);
+  SER_ASSERT(num_roots >= 0);
+  SER_ASSERT((size_t)num_roots <= ser->max_size - ser->cursor);
+  for (int i = 0; i < num_roots; i++)
+  {
+    EntityID remote = {0};
+    int num_entities = 0;
+    struct BodyData body_data = {0};
+    if (ser->serializing)
+    {
+      remote = get_id(gs, roots[i]);
+      num_entities = entity_group(gs, roots[i], NULL);
+      populate(roots[i]->body, &body_data);
+    }
+    SER_VAR(&remote.generation);
+    SER_VAR(&remote.index);
+    SER_VAR(&num_entities);
+    SER_MAYBE_RETURN(ser_bodydata(ser, &body_data));
+
+    // so the group can be skipped over when only the body is updated
+    size_t group_length = 0;
+    SER_VAR(&group_length);
+    size_t group_start = ser->cursor;
+
+    if (ser->serializing)
+    {
+      Entity *root = roots[i];
+      SER_MAYBE_RETURN(ser_entity_group(ser, gs, &root, NULL, NULL));
+      group_length = ser->cursor - group_start;
+      memcpy(ser->bytes + group_start - sizeof(group_length), &group_length, sizeof(group_length));
+    }
+    else
+    {
+      SER_ASSERT(group_length <= ser->max_size - group_start);
+      ShardGhost *ghost = shard_ghost_find(ghosts, remote);
+      Entity *local = ghost != NULL ? get_entity(gs, ghost->local) : NULL;
+      if (local != NULL && ghost->num_entities == num_entities)
+      {
+        update_from(local->body, &body_data);
+        ser->cursor = group_start + group_length;
+      }
+      else
+      {
+        if (ghost != NULL)
+          shard_ghost_remove(gs, ghosts, ghost);
+        Entity *root = NULL;
+        SER_MAYBE_RETURN(ser_entity_group(ser, gs, &root, NULL, NULL));
+
+        int loaded_entities = entity_group(gs, root, NULL);
+        Entity **group = malloc(sizeof(*group) * loaded_entities);
+        flight_assert(group != NULL);
+        entity_group(gs, root, group);
+        for (int entity_i = 0; entity_i < loaded_entities; entity_i++)
+        {
+          group[entity_i]->is_ghost = true;
+          group[entity_i]->no_save_to_disk = true;
+          if (group[entity_i]->body != NULL)
+            cpBodySetType(group[entity_i]->body, CP_BODY_TYPE_KINEMATIC);
+        }
+        free(group);
+
+        if (ghosts->length >= ghosts->capacity)
+        {
+          ghosts->capacity = ghosts->capacity * 2 + 16;
+          ghosts->ghosts = realloc(ghosts->ghosts, sizeof(*ghosts->ghosts) * ghosts->capacity);
+          flight_assert(ghosts->ghosts != NULL);
+        }
+        ghost = &ghosts->ghosts[ghosts->length++];
+        *ghost = (ShardGhost){.remote = remote, .local = get_id(gs, root), .num_entities = num_entities};
+        SER_ASSERT(loaded_entities == num_entities);
+        SER_ASSERT(ser->cursor == group_start + group_length);
+      }
+      ghost->seen = true;
+    }
+  }
+
+  // the owner stopped sending it, it moved away from the border or is gone
+  if (!ser->serializing)
+  {
+    for (int i = ghosts->length - 1; i >= 0; i--)
+    {
+      if (!ghosts->ghosts[i].seen)
+        shard_ghost_remove(gs, ghosts, &ghosts->ghosts[i]);
+    }
+  }
+  return ser_ok;
+}
+
 // only serializes up to the maximum inputs the server holds
 SerMaybeFailure ser_client_to_server(SerState *ser, ClientToServer *msg)
 {
   SER_VAR(&ser->version);
   SER_MAYBE_RETURN(ser_opus_packets(ser, msg->mic_data));
+  SER_VAR(&msg->last_gamestate_tick);
+  SER_VAR(&msg->gamestate_parts_received);
 
   // serialize input packets
   size_t num;
@@ -2029,7 +4120,7 @@ size_t ser_size(SerState *ser)
 
 SerState init_serializing(GameState *gs, unsigned char *bytes, size_t max_size, Entity *for_player, bool to_disk)
 {
-  bool write_varnames = to_disk;
+  bool write_varnames = false;
 #ifdef WRITE_VARNAMES
   write_varnames = true;
 #endif
@@ -2046,9 +4137,34 @@ SerState init_serializing(GameState *gs, unsigned char *bytes, size_t max_size,
   };
 }
 
+SerState init_saving(GameState *gs, SerStream *stream)
+{
+  return (SerState){
+      .bytes = stream->block,
+      .serializing = true,
+      .max_entity_index = gs->cur_next_entity,
+      .max_size = SAVE_BLOCK_SIZE,
+      .version = VMax - 1,
+      .save_or_load_from_disk = true,
+      .stream = stream,
+  };
+}
+
+SerState init_loading(GameState *gs, SerStream *stream)
+{
+  return (SerState){
+      .bytes = stream->block,
+      .serializing = false,
+      .max_entity_index = gs->max_entities,
+      .max_size = 0, // the first block is read in when the first field is
+      .save_or_load_from_disk = true,
+      .stream = stream,
+  };
+}
+
 SerState init_deserializing(GameState *gs, unsigned char *bytes, size_t max_size, bool from_disk)
 {
-  bool has_varnames = from_disk;
+  bool has_varnames = false; // unless it's an old save, see ser_disk_world
 #ifdef WRITE_VARNAMES
   has_varnames = true;
 #endif
@@ -2064,47 +4180,188 @@ SerState init_deserializing(GameState *gs, unsigned char *bytes, size_t max_size
   };
 }
 
-// filter func null means everything is ok, if it's not null and returns false, that means
-// exclude it from the selection. This returns the closest box entity!
-Entity *closest_box_to_point_in_radius(struct GameState *gs, cpVect point, double radius, bool (*filter_func)(Entity *))
-{
-  cpShape *closest_to_point_in_radius_result = NULL;
-  double closest_to_point_in_radius_result_largest_dist = 0.0;
-
-  circle_query(gs->space, point, radius);
-  QUEUE_ITER(&query_result, QueryResult, res)
-  {
-    cpShape *shape = res->shape;
-
-    Entity *e = cp_shape_entity(shape);
-    if (!e->is_box)
-      continue;
+// Sessions are what a server simulated, so it can be replayed and profiled later, see replay_main.c.
+// After the header a session is chunks, each its SessionChunk type then
+//  - keyframe: the whole world like it'd be sent to a client, players included, in save blocks then an empty block
+//  - tick: the tick, how many players had input, then each of their slots and serialized inputs. The
+//    world is processed once with them
+static const char session_magic[4] = {'F', 'L', 'S', 'S'};
+#define SESSION_FORMAT 1
 
-    if (filter_func != NULL && !filter_func(e))
-      continue;
-    double dist_sqr = cpvlengthsq((cpvsub(res->pointA, res->pointB)));
-    // double dist = -points->points[0].distance;
-    if (dist_sqr > closest_to_point_in_radius_result_largest_dist)
-    {
-      closest_to_point_in_radius_result_largest_dist = dist_sqr;
-      closest_to_point_in_radius_result = shape;
-    }
-  }
-  if (closest_to_point_in_radius_result != NULL)
-  {
-    return cp_shape_entity(closest_to_point_in_radius_result);
-  }
-  return NULL;
+bool session_write_header(FILE *file)
+{
+  uint32_t format = SESSION_FORMAT;
+  return fwrite(session_magic, sizeof(session_magic), 1, file) == 1 && fwrite(&format, sizeof(format), 1, file) == 1;
 }
 
-static THREADLOCAL BOX_UNLOCKS_TYPE scanner_has_learned = 0;
-static bool scanner_filter(Entity *e)
+bool session_read_header(FILE *file)
 {
-  if (!e->is_box)
-    return false;
-  if (learned_boxes_has_box(scanner_has_learned, e->box_type))
+  char magic[sizeof(session_magic)] = {0};
+  uint32_t format = 0;
+  if (fread(magic, sizeof(magic), 1, file) != 1 || fread(&format, sizeof(format), 1, file) != 1)
     return false;
-  return true;
+  return memcmp(magic, session_magic, sizeof(magic)) == 0 && format == SESSION_FORMAT;
+}
+
+static SerMaybeFailure ser_session_keyframe(SerState *ser, GameState *gs)
+{
+  // clients are sent audio with the world, sessions don't have any
+  char no_audio_data[QUEUE_SIZE_FOR_ELEMENTS(sizeof(OpusPacket), 1)] = {0};
+  Queue no_audio = {0};
+  queue_init(&no_audio, sizeof(OpusPacket), no_audio_data, sizeof(no_audio_data));
+  ServerToClient msg = (ServerToClient){
+      .cur_gs = gs,
+      .audio_playback_buffer = &no_audio,
+  };
+  ser->save_or_load_from_disk = false; // everything a client would be sent, players too
+  ser->server_state = true;
+  SER_MAYBE_RETURN(ser_server_to_client(ser, &msg));
+
+  // the world ends at the end of a block, then there's an empty one so it can be skipped over without loading it
+  if (ser->serializing)
+    SER_MAYBE_RETURN(ser_stream_flush(ser));
+  if (!ser->serializing && ser->cursor != ser->max_size)
+    SER_FAIL("Keyframe has more in it than this build loads");
+  uint32_t end_block[2] = {0};
+  if (ser->serializing ? fwrite(end_block, sizeof(end_block), 1, ser->stream->file) != 1 : fread(end_block, sizeof(end_block), 1, ser->stream->file) != 1)
+    SER_FAIL("Couldn't get to the end of the keyframe");
+  if (end_block[0] != 0)
+    SER_FAIL("Keyframe doesn't end with an empty block");
+  return ser_ok;
+}
+
+bool session_write_keyframe(GameState *gs, SerStream *stream)
+{
+  if (fputc(SessionChunkKeyframe, stream->file) == EOF)
+    return false;
+  SerState ser = init_saving(gs, stream);
+  SerMaybeFailure result = ser_session_keyframe(&ser, gs);
+  if (result.failed)
+    Log("Failed to write session keyframe: %d %s\n", result.line, result.expression);
+  return !result.failed;
+}
+
+bool session_read_keyframe(GameState *gs, SerStream *stream)
+{
+  SerState ser = init_loading(gs, stream);
+  SerMaybeFailure result = ser_session_keyframe(&ser, gs);
+  if (result.failed)
+    Log("Failed to read session keyframe: %d %s\n", result.line, result.expression);
+  return !result.failed;
+}
+
+bool session_skip_keyframe(FILE *file)
+{
+  while (true)
+  {
+    uint32_t block_header[2] = {0};
+    if (fread(block_header, sizeof(block_header), 1, file) != 1)
+      return false;
+    if (block_header[0] == 0)
+      return true;
+    if (block_header[0] > SAVE_BLOCK_SIZE || fseek(file, (long)block_header[0], SEEK_CUR) != 0)
+      return false;
+  }
+}
+
+bool session_write_tick(GameState *gs, FILE *file)
+{
+  uint8_t num_inputs = 0;
+  PLAYERS_ITER(gs, cur)
+  {
+    num_inputs++;
+  }
+  uint64_t cur_tick = tick(gs);
+  if (fputc(SessionChunkTick, file) == EOF || fwrite(&cur_tick, sizeof(cur_tick), 1, file) != 1 || fwrite(&num_inputs, sizeof(num_inputs), 1, file) != 1)
+    return false;
+  PLAYERS_ITER(gs, cur)
+  {
+    unsigned char serialized[sizeof(InputFrame) * 2] = {0};
+    SerState ser = init_serializing(gs, serialized, sizeof(serialized), NULL, false);
+    SerMaybeFailure result = ser_inputframe(&ser, &cur->input);
+    if (result.failed)
+    {
+      Log("Failed to serialize session input: %d %s\n", result.line, result.expression);
+      return false;
+    }
+    uint8_t slot = (uint8_t)(cur - gs->players);
+    uint16_t length = (uint16_t)ser_size(&ser);
+    if (fwrite(&slot, sizeof(slot), 1, file) != 1 || fwrite(&length, sizeof(length), 1, file) != 1 || fwrite(serialized, length, 1, file) != 1)
+      return false;
+  }
+  return true;
+}
+
+// gs NULL to skip over it
+bool session_read_tick(GameState *gs, FILE *file, uint64_t *out_tick)
+{
+  uint8_t num_inputs = 0;
+  if (fread(out_tick, sizeof(*out_tick), 1, file) != 1 || fread(&num_inputs, sizeof(num_inputs), 1, file) != 1)
+    return false;
+  for (int i = 0; i < num_inputs; i++)
+  {
+    uint8_t slot = 0;
+    uint16_t length = 0;
+    unsigned char serialized[sizeof(InputFrame) * 2] = {0};
+    if (fread(&slot, sizeof(slot), 1, file) != 1 || fread(&length, sizeof(length), 1, file) != 1)
+      return false;
+    if (slot >= MAX_PLAYERS || length > sizeof(serialized) || fread(serialized, length, 1, file) != 1)
+      return false;
+    if (gs == NULL)
+      continue;
+    players_reserve(gs, slot + 1);
+    SerState ser = init_deserializing(gs, serialized, length, false);
+    SerMaybeFailure result = ser_inputframe(&ser, &gs->players[slot].input);
+    if (result.failed)
+    {
+      Log("Failed to deserialize session input: %d %s\n", result.line, result.expression);
+      return false;
+    }
+  }
+  return true;
+}
+
+// filter func null means everything is ok, if it's not null and returns false, that means
+// exclude it from the selection. This returns the closest box entity!
+Entity *closest_box_to_point_in_radius(struct GameState *gs, cpVect point, double radius, bool (*filter_func)(Entity *))
+{
+  cpShape *closest_to_point_in_radius_result = NULL;
+  double closest_to_point_in_radius_result_largest_dist = 0.0;
+
+  circle_query(gs->space, point, radius);
+  QUEUE_ITER(&query_result, QueryResult, res)
+  {
+    cpShape *shape = res->shape;
+
+    Entity *e = cp_shape_entity(shape);
+    if (!e->is_box)
+      continue;
+
+    if (filter_func != NULL && !filter_func(e))
+      continue;
+    double dist_sqr = cpvlengthsq((cpvsub(res->pointA, res->pointB)));
+    // double dist = -points->points[0].distance;
+    if (dist_sqr > closest_to_point_in_radius_result_largest_dist)
+    {
+      closest_to_point_in_radius_result_largest_dist = dist_sqr;
+      closest_to_point_in_radius_result = shape;
+    }
+  }
+  if (closest_to_point_in_radius_result != NULL)
+  {
+    return cp_shape_entity(closest_to_point_in_radius_result);
+  }
+  return NULL;
+}
+
+static THREADLOCAL BOX_UNLOCKS_TYPE scanner_has_learned = 0;
+static bool scanner_filter(Entity *e)
+{
+  if (!e->is_box)
+    return false;
+  if (learned_boxes_has_box(scanner_has_learned, e->box_type))
+    return false;
+  return true;
 }
 
 static void do_explosion(GameState *gs, Entity *explosion, double dt)
@@ -2121,6 +4378,7 @@ static void do_explosion(GameState *gs, Entity *explosion, double dt)
     cpVect from_pos = entity_pos(cp_shape_entity(shape));
     cpVect impulse = cpvmult(cpvnormalize(cpvsub(from_pos, explosion_origin)), explosion_push_strength);
     flight_assert(parent->body != NULL);
+    entity_exit_rails(parent);
     cpBodyApplyImpulseAtWorldPoint(parent->body, (impulse), (from_pos));
   }
 }
@@ -2128,12 +4386,7 @@ static void do_explosion(GameState *gs, Entity *explosion, double dt)
 cpVect box_facing_vector(Entity *box)
 {
   flight_assert(box->is_box);
-  cpVect to_return = (cpVect){.x = 1.0, .y = 0.0};
-
-  to_return = box_compass_vector(box);
-  to_return = cpvspin(to_return, box_rotation(box));
-
-  return to_return;
+  return cpvrotate(box_compass_vector(box), grid_rotation_vector(box_grid(box)));
 }
 
 enum CompassRotation facing_vector_to_compass(Entity *grid_to_transplant_to, Entity *grid_facing_vector_from, cpVect facing_vector)
@@ -2424,6 +4677,209 @@ void create_hard_shell_station(GameState *gs, cpVect pos, enum BoxType platonic_
   entity_ensure_in_orbit(gs, grid);
   indestructible = false;
 }
+// The hand placed parts of the release world, each is made with the sector it's in
+static const struct
+{
+  cpVect pos;
+  enum BoxType platonic_type;
+} authored_stations[] = {
+    {{500.0, 300.0}, BoxExplosive}, // around the safe sun
+    {{200.0, 0.0}, BoxLandingGear},
+    {{500.0, -300.0}, BoxCloaking},
+    {{800.0, 0.0}, BoxMissileLauncher},
+    {{-7000.0, 250.0}, BoxMerge}, // the far sun
+};
+#define AUTHORED_ORB_LINE_START -10.0 // a line of orbs from the safe sun out along -x
+#define AUTHORED_ORB_LINE_END -1000.0
+#define AUTHORED_ORB_LINE_SPACING 20.0
+
+static int sector_coord(double position)
+{
+  return (int)floor(position / SECTOR_SIZE);
+}
+
+static uint64_t sector_key(int x, int y)
+{
+  return ((uint64_t)(uint32_t)x << 32) | (uint64_t)(uint32_t)y;
+}
+
+static bool in_sector(cpVect pos, int x, int y)
+{
+  return sector_coord(pos.x) == x && sector_coord(pos.y) == y;
+}
+
+// splitmix64, so the same seed makes the same sector on any machine
+static uint64_t sector_random(uint64_t *state)
+{
+  uint64_t z = (*state += 0x9E3779B97F4A7C15ULL);
+  z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+  z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+  return z ^ (z >> 31);
+}
+
+static double sector_random_01(uint64_t *state)
+{
+  return (double)(sector_random(state) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+// index it is or would be in the sorted generated sectors
+static unsigned int sector_search(GameState *gs, uint64_t key)
+{
+  unsigned int low = 0;
+  unsigned int high = gs->num_generated_sectors;
+  while (low < high)
+  {
+    unsigned int mid = low + (high - low) / 2;
+    if (gs->generated_sectors[mid] < key)
+      low = mid + 1;
+    else
+      high = mid;
+  }
+  return low;
+}
+
+static void sector_generate(GameState *gs, int x, int y)
+{
+  for (int i = 0; i < ARRLEN(authored_stations); i++)
+  {
+    if (in_sector(authored_stations[i].pos, x, y))
+      create_bomb_station(gs, authored_stations[i].pos, authored_stations[i].platonic_type);
+  }
+  for (double orb_x = AUTHORED_ORB_LINE_START; orb_x > AUTHORED_ORB_LINE_END; orb_x -= AUTHORED_ORB_LINE_SPACING)
+  {
+    if (in_sector(cpv(orb_x, 0.0), x, y))
+    {
+      Entity *orb = new_entity(gs);
+      create_orb(gs, orb);
+      entity_set_pos(orb, cpv(orb_x, 0.0));
+    }
+  }
+
+  // and the rest of the sector is up to the seed
+  uint64_t random_state = gs->world_seed ^ (sector_key(x, y) * 0xD1B54A32D192ED03ULL);
+  int num_orbs = (int)(sector_random(&random_state) % (SECTOR_MAX_ORBS + 1));
+  for (int i = 0; i < num_orbs; i++)
+  {
+    cpVect pos = cpv((x + sector_random_01(&random_state)) * SECTOR_SIZE, (y + sector_random_01(&random_state)) * SECTOR_SIZE);
+    bool in_a_sun = false;
+    SUNS_ITER(gs)
+    {
+      in_a_sun |= cpvdist(pos, entity_pos(i.sun)) < i.sun->sun_radius * 2.0;
+    }
+    if (in_a_sun)
+      continue;
+    Entity *orb = new_entity(gs);
+    create_orb(gs, orb);
+    entity_set_pos(orb, pos);
+  }
+}
+
+static int player_cell(double coord)
+{
+  return (int)floor(coord / PLAYER_BUCKET_SIZE);
+}
+
+static unsigned int player_bucket(int cell_x, int cell_y)
+{
+  return ((unsigned int)cell_x * 73856093u ^ (unsigned int)cell_y * 19349663u) % PLAYER_BUCKETS;
+}
+
+// server only. Buckets the players by where they are so players_near doesn't check all of them
+static void process_player_buckets(GameState *gs)
+{
+  memset(gs->player_buckets, 0, sizeof(gs->player_buckets));
+  PLAYERS_ITER(gs, player)
+  {
+    Entity *player_entity = get_entity(gs, player->entity);
+    if (player_entity == NULL)
+      continue;
+    cpVect pos = entity_pos(player_entity);
+    unsigned int bucket = player_bucket(player_cell(pos.x), player_cell(pos.y));
+    int slot = (int)(player - gs->players);
+    gs->player_next_in_bucket[slot] = gs->player_buckets[bucket];
+    gs->player_buckets[bucket] = slot + 1;
+  }
+}
+
+// the players whose entities are within radius of pos, from where they were bucketed at the end of the
+// last tick. Radius can't be bigger than a bucket's cell. Returns how many were put in out
+int players_near(GameState *gs, cpVect pos, double radius, Player **out, int max_out)
+{
+  flight_assert(radius <= PLAYER_BUCKET_SIZE);
+  unsigned int visited[9] = {0}; // different cells can hash to the same bucket
+  int num_visited = 0;
+  int found = 0;
+  for (int x = player_cell(pos.x - radius); x <= player_cell(pos.x + radius); x++)
+  {
+    for (int y = player_cell(pos.y - radius); y <= player_cell(pos.y + radius); y++)
+    {
+      unsigned int bucket = player_bucket(x, y);
+      bool already_visited = false;
+      for (int i = 0; i < num_visited; i++)
+        already_visited |= visited[i] == bucket;
+      if (already_visited)
+        continue;
+      visited[num_visited++] = bucket;
+      for (int slot_plus_one = gs->player_buckets[bucket]; slot_plus_one != 0; slot_plus_one = gs->player_next_in_bucket[slot_plus_one - 1])
+      {
+        flight_assert(slot_plus_one - 1 < (int)gs->max_players);
+        Player *player = &gs->players[slot_plus_one - 1];
+        Entity *player_entity = player->connected ? get_entity(gs, player->entity) : NULL;
+        if (player_entity != NULL && found < max_out && cpvdist(entity_pos(player_entity), pos) <= radius)
+          out[found++] = player;
+      }
+    }
+  }
+  return found;
+}
+
+// Generates the sectors near pos that haven't been yet. In a sharded world only the ones this shard owns,
+// the shard a player is on tells its neighbors where it is when it's close enough to need theirs
+bool generate_sectors_near(GameState *gs, cpVect pos)
+{
+  if (gs->world_seed == 0)
+    return false;
+  bool generated = false;
+  for (int x = sector_coord(pos.x - SECTOR_GENERATE_MARGIN); x <= sector_coord(pos.x + SECTOR_GENERATE_MARGIN); x++)
+  {
+    double center_x = (x + 0.5) * SECTOR_SIZE;
+    if (center_x < gs->sector_min_x || center_x >= gs->sector_max_x)
+      continue;
+    for (int y = sector_coord(pos.y - SECTOR_GENERATE_MARGIN); y <= sector_coord(pos.y + SECTOR_GENERATE_MARGIN); y++)
+    {
+      uint64_t key = sector_key(x, y);
+      unsigned int index = sector_search(gs, key);
+      if (index < gs->num_generated_sectors && gs->generated_sectors[index] == key)
+        continue;
+      if (gs->num_generated_sectors >= gs->generated_sectors_capacity)
+      {
+        gs->generated_sectors_capacity = gs->generated_sectors_capacity * 2 + 64;
+        gs->generated_sectors = realloc(gs->generated_sectors, sizeof(*gs->generated_sectors) * gs->generated_sectors_capacity);
+        flight_assert(gs->generated_sectors != NULL);
+      }
+      memmove(gs->generated_sectors + index + 1, gs->generated_sectors + index, sizeof(*gs->generated_sectors) * (gs->num_generated_sectors - index));
+      gs->generated_sectors[index] = key;
+      gs->num_generated_sectors++;
+      sector_generate(gs, x, y);
+      generated = true;
+    }
+  }
+  return generated;
+}
+
+// server only. Generates the sectors players are getting near that haven't been yet
+static void process_sectors(GameState *gs)
+{
+  if (gs->world_seed == 0 || gs->tick % SECTOR_CHECK_TICKS != 0)
+    return;
+  PLAYERS_ITER(gs, player)
+  {
+    Entity *player_entity = get_entity(gs, player->entity);
+    if (player_entity != NULL)
+      generate_sectors_near(gs, entity_pos(player_entity));
+  }
+}
+
 void create_initial_world(GameState *gs)
 {
   const double mass_multiplier = 10.0;
@@ -2440,24 +4896,7 @@ void create_initial_world(GameState *gs)
   }
 #ifndef DEBUG_WORLD
   Log("Creating release world\n");
-
-#define ORB_AT(pos)               \
-  {                               \
-    Entity *orb = new_entity(gs); \
-    create_orb(gs, orb);          \
-    entity_set_pos(orb, pos);     \
-  }
-  for (int x = -10; x > -1000; x -= 20)
-  {
-    ORB_AT(cpv(x, 0.0));
-  }
-#define SUN_POS(index) (entity_pos(get_entity(gs, suns[index])))
-  create_bomb_station(gs, cpvadd(SUN_POS(0), cpv(0.0, 300.0)), BoxExplosive);
-  create_bomb_station(gs, cpvadd(SUN_POS(0), cpv(-300.0, 0.0)), BoxLandingGear);
-  create_bomb_station(gs, cpvadd(SUN_POS(0), cpv(0.0, -300.0)), BoxCloaking);
-  create_bomb_station(gs, cpvadd(SUN_POS(0), cpv(300.0, 0.0)), BoxMissileLauncher);
-  create_bomb_station(gs, cpvadd(SUN_POS(1), cpv(0.0, 300.0)), BoxMerge);
-#undef SUN_POS
+  gs->world_seed = WORLD_SEED; // everything but the suns is made when players get near it, see process_sectors
 #else
 
 #if 1 // basic test
@@ -2476,124 +4915,828 @@ void create_initial_world(GameState *gs)
 #if 1 // present the stations
   Log("Creating debug world\n");
 
-  // pos, mass, radius
-  create_bomb_station(gs, (cpVect){-5.0, 0.0}, BoxExplosive);
-  create_bomb_station(gs, (cpVect){0.0, 5.0}, BoxGyroscope);
-  create_hard_shell_station(gs, (cpVect){-5.0, 5.0}, BoxCloaking);
-#endif
+  // pos, mass, radius
+  create_bomb_station(gs, (cpVect){-5.0, 0.0}, BoxExplosive);
+  create_bomb_station(gs, (cpVect){0.0, 5.0}, BoxGyroscope);
+  create_hard_shell_station(gs, (cpVect){-5.0, 5.0}, BoxCloaking);
+#endif
+
+#if 0 // scanner box
+  bool indestructible = false;
+  enum CompassRotation rot = Right;
+  {
+    Entity *grid = new_entity(gs);
+    grid_create(gs, grid);
+    entity_set_pos(grid, cpv(1.5, 0.0));
+    BOX_AT_TYPE(grid, cpv(0.0, 0.0), BoxExplosive);
+    BOX_AT_TYPE(grid, cpv(-BOX_SIZE, 0.0), BoxScanner);
+    BOX_AT_TYPE(grid, cpv(-BOX_SIZE * 2.0, 0.0), BoxSolarPanel);
+    BOX_AT_TYPE(grid, cpv(-BOX_SIZE * 3.0, 0.0), BoxSolarPanel);
+    entity_ensure_in_orbit(gs, grid);
+  }
+
+  {
+    Entity *grid = new_entity(gs);
+    grid_create(gs, grid);
+    entity_set_pos(grid, cpv(0.0, 10.0));
+    BOX_AT_TYPE(grid, cpv(0.0, 0.0), BoxHullpiece);
+    entity_ensure_in_orbit(gs, grid);
+  }
+
+#endif
+
+#if 1 // landing gear box
+  bool indestructible = false;
+  cpVect from = cpv(4.0 * BOX_SIZE, 0.0);
+  enum CompassRotation rot = Right;
+  {
+    Entity *grid = new_entity(gs);
+    grid_create(gs, grid);
+    entity_set_pos(grid, from);
+    BOX_AT_TYPE(grid, ((cpVect){0.0, 0.0}), BoxLandingGear);
+    // BOX_AT(grid, ((cpVect){0.0, -BOX_SIZE}));
+    // BOX_AT_TYPE(grid, ((cpVect){BOX_SIZE, 0.0}), BoxMerge);
+    entity_ensure_in_orbit(gs, grid);
+    cpBodySetVelocity(grid->body, cpv(0.1, 0.0));
+  }
+  {
+    Entity *grid = new_entity(gs);
+    grid_create(gs, grid);
+    entity_set_pos(grid, cpvadd(from, cpv(2.0 * BOX_SIZE, 0.0)));
+    BOX_AT_TYPE(grid, ((cpVect){0.0, 0.0}), BoxHullpiece);
+    entity_ensure_in_orbit(gs, grid);
+  }
+#endif
+
+#if 0  // merge box
+  bool indestructible = false;
+  double theta = deg2rad(65.0);
+  cpVect from = (cpVect){BOX_SIZE * 4.0, -1};
+  enum CompassRotation rot = Right;
+  {
+    Entity *grid = new_entity(gs);
+    grid_create(gs, grid);
+    entity_set_pos(grid, cpvadd(from, cpvspin((cpVect){.x = -BOX_SIZE * 9.0}, theta)));
+    cpBodySetAngle(grid->body, theta + PI);
+    rot = Left;
+    BOX_AT_TYPE(grid, ((cpVect){0.0, 0.0}), BoxMerge);
+    BOX_AT(grid, ((cpVect){0.0, -BOX_SIZE}));
+    BOX_AT_TYPE(grid, ((cpVect){BOX_SIZE, 0.0}), BoxMerge);
+    entity_ensure_in_orbit(gs, grid);
+  }
+
+  {
+    Entity *grid = new_entity(gs);
+    grid_create(gs, grid);
+    entity_set_pos(grid, from);
+    cpBodySetAngle(grid->body, theta);
+    rot = Left;
+    BOX_AT_TYPE(grid, ((cpVect){-BOX_SIZE, 0.0}), BoxMerge);
+    rot = Down;
+    BOX_AT_TYPE(grid, ((cpVect){0.0, 0.0}), BoxMerge);
+    rot = Up;
+    BOX_AT_TYPE(grid, ((cpVect){0.0, BOX_SIZE}), BoxMerge);
+    cpBodySetVelocity(grid->body, (cpvspin((cpVect){-0.4, 0.0}, theta)));
+    entity_ensure_in_orbit(gs, grid);
+  }
+#endif // grid tests
+
+#endif // debug world
+}
+
+// does not actually set seat in variables so can be used on respawn
+void exit_seat(GameState *gs, Entity *seat_in, Entity *p)
+{
+  cpVect pilot_seat_exit_spot = cpvadd(entity_pos(seat_in), cpvmult(box_facing_vector(seat_in), BOX_SIZE));
+  cpBodySetPosition(p->body, (pilot_seat_exit_spot));
+  // cpBodySetVelocity(p->body, (player_vel(gs, p)));
+  cpBodySetVelocity(p->body, cpBodyGetVelocity(box_grid(seat_in)->body));
+}
+
+void shape_integrity_check(cpShape *shape, void *data)
+{
+  flight_assert(cpShapeGetUserData(shape) != NULL);
+  flight_assert(cp_shape_entity(shape)->exists);
+  flight_assert(cp_shape_entity(shape)->shape == shape);
+}
+
+void body_integrity_check(cpBody *body, void *data)
+{
+  flight_assert(cpBodyGetUserData(body) != NULL);
+  flight_assert(cp_body_entity(body)->exists);
+  flight_assert(cp_body_entity(body)->body == body);
+}
+void player_get_in_seat(GameState *gs, Player *player, Entity *seat)
+{
+  Entity *p = get_entity(gs, player->entity);
+  p->currently_inside_of_box = get_id(gs, seat);
+  seat->player_who_is_inside_of_me = get_id(gs, p);
+  if (seat->box_type == BoxMedbay)
+    player->last_used_medbay = p->currently_inside_of_box;
+}
+
+// entities are gathered into fixed size batches with their positions in contiguous arrays,
+// so that the per sun loops are straight line math the compiler can vectorize
+#define SUN_BATCH_SIZE 256
+
+// everything about a sun the batched pass needs, computed once per tick
+typedef struct SunGravitySource
+{
+  cpVect pos;
+  double gm;                  // GRAVITY_CONSTANT * sun_mass
+  double no_gravity_dist_sqr; // farther than this and there's no gravity, see sun_dist_no_gravity
+  double radius;              // compared against the squared distance like in sun_gravity_accel_for_entity
+  double radius_sqr;          // entities inside of this are burned
+  bool is_safe;
+} SunGravitySource;
+
+static void sun_process_batch(GameState *gs, const SunGravitySource *suns, int num_suns, Entity **batch, int batch_len, double dt)
+{
+  flight_assert(batch_len <= SUN_BATCH_SIZE);
+  double pos_x[SUN_BATCH_SIZE];
+  double pos_y[SUN_BATCH_SIZE];
+  double accel_x[SUN_BATCH_SIZE] = {0};
+  double accel_y[SUN_BATCH_SIZE] = {0};
+  double suns_burning[SUN_BATCH_SIZE] = {0};     // number of suns the entity is inside of
+  double safe_suns_nearby[SUN_BATCH_SIZE] = {0}; // number of safe suns the entity is in the gravity of
+
+  cpBB bounds = {.l = INFINITY, .b = INFINITY, .r = -INFINITY, .t = -INFINITY};
+  for (int j = 0; j < batch_len; j++)
+  {
+    cpVect pos = entity_pos(batch[j]);
+    pos_x[j] = pos.x;
+    pos_y[j] = pos.y;
+    bounds.l = fmin(bounds.l, pos.x);
+    bounds.r = fmax(bounds.r, pos.x);
+    bounds.b = fmin(bounds.b, pos.y);
+    bounds.t = fmax(bounds.t, pos.y);
+  }
+
+  bool any_sun_in_range = false;
+  for (int sun_i = 0; sun_i < num_suns; sun_i++)
+  {
+    const SunGravitySource *sun = &suns[sun_i];
+
+    // if the closest point of the batch's bounds is out of range of this sun, so is every entity in the batch
+    double closest_x = clamp(sun->pos.x, bounds.l, bounds.r) - sun->pos.x;
+    double closest_y = clamp(sun->pos.y, bounds.b, bounds.t) - sun->pos.y;
+    double bounds_dist_sqr = closest_x * closest_x + closest_y * closest_y;
+    if (bounds_dist_sqr > sun->no_gravity_dist_sqr && bounds_dist_sqr >= sun->radius_sqr)
+      continue;
+    any_sun_in_range = true;
+
+    for (int j = 0; j < batch_len; j++)
+    {
+      double rel_x = pos_x[j] - sun->pos.x;
+      double rel_y = pos_y[j] - sun->pos.y;
+      double dist_sqr = rel_x * rel_x + rel_y * rel_y;
+
+      double in_gravity = dist_sqr <= sun->no_gravity_dist_sqr ? 1.0 : 0.0;
+      double accel_magnitude = sun->gm / dist_sqr;
+      accel_magnitude = dist_sqr <= sun->radius ? -accel_magnitude : accel_magnitude;
+      accel_magnitude = dist_sqr <= sun->radius * 0.25 ? 0.0 : accel_magnitude; // also catches dividing by zero distance
+      double towards_sun_scale = -in_gravity * accel_magnitude / (sqrt(dist_sqr) + DBL_MIN);
+      accel_x[j] += rel_x * towards_sun_scale;
+      accel_y[j] += rel_y * towards_sun_scale;
+
+      suns_burning[j] += dist_sqr < sun->radius_sqr ? 1.0 : 0.0;
+      safe_suns_nearby[j] += (sun->is_safe && dist_sqr < sun->no_gravity_dist_sqr) ? 1.0 : 0.0;
+    }
+  }
+
+  if (!any_sun_in_range)
+    return;
+
+  for (int j = 0; j < batch_len; j++)
+  {
+    Entity *e = batch[j];
+
+    bool is_entity_dangerous = e->is_missile || (e->is_box && e->box_type == BoxExplosive);
+    if (is_entity_dangerous && safe_suns_nearby[j] > 0.0)
+      e->flag_for_destruction = true;
+
+    if (!e->is_grid) // grids aren't damaged (this edge case sucks!)
+      e->damage += 10.0 * dt * suns_burning[j];
+
+#ifndef NO_GRAVITY
+    if (e->body != NULL && !e->on_rails && (accel_x[j] != 0.0 || accel_y[j] != 0.0)) // on rails the orbit already accounts for gravity
+    {
+      cpVect new_vel = entity_vel(gs, e);
+      new_vel = cpvadd(new_vel, cpvmult(cpv(accel_x[j], accel_y[j]), dt));
+      cpBodySetVelocity(e->body, new_vel);
+    }
+#endif
+  }
+}
+
+// sun gravity, burning, and destroying dangerous things that get close to the safe sun, for every entity
+static void process_suns(GameState *gs, double dt)
+{
+  SunGravitySource suns[MAX_SUNS] = {0};
+  int num_suns = 0;
+  SUNS_ITER(gs)
+  {
+    double no_gravity_dist = sun_dist_no_gravity(i.sun);
+    suns[num_suns] = (SunGravitySource){
+        .pos = entity_pos(i.sun),
+        .gm = GRAVITY_CONSTANT * i.sun->sun_mass,
+        .no_gravity_dist_sqr = no_gravity_dist * no_gravity_dist,
+        .radius = i.sun->sun_radius,
+        .radius_sqr = i.sun->sun_radius * i.sun->sun_radius,
+        .is_safe = i.sun->sun_is_safe,
+    };
+    num_suns++;
+  }
+  if (num_suns == 0)
+    return;
+
+  Entity *batch[SUN_BATCH_SIZE];
+  int batch_len = 0;
+  ENTITIES_ITER(gs, e)
+  {
+    if (e->flag_for_destruction || entity_dormant(e))
+      continue;
+    batch[batch_len] = e;
+    batch_len++;
+    if (batch_len == SUN_BATCH_SIZE)
+    {
+      sun_process_batch(gs, suns, num_suns, batch, batch_len, dt);
+      batch_len = 0;
+    }
+  }
+  if (batch_len > 0)
+    sun_process_batch(gs, suns, num_suns, batch, batch_len, dt);
+}
+
+static void count_constraints(cpBody *body, cpConstraint *constraint, void *data)
+{
+  (*(int *)data)++;
+}
+
+// things that are doing something on their own have to keep being simulated even when nobody is around
+static bool can_become_dormant(GameState *gs, Entity *e)
+{
+  int num_constraints = 0;
+  cpBodyEachConstraint(e->body, count_constraints, &num_constraints);
+  if (num_constraints > 0)
+    return false; // landed on or landed to, sleeping one side of a constraint is trouble
+
+  if (e->is_grid)
+  {
+    BOXES_ITER(gs, cur, e)
+    {
+      if ((cur->box_type == BoxThruster || cur->box_type == BoxGyroscope) && cur->thrust != 0.0)
+        return false;
+    }
+  }
+  return true;
+}
+
+// Grids and orbs with no player, missile, or explosion nearby are put to sleep in chipmunk, so
+// the physics step and the per entity processing skip them. They're woken back up when one of those
+// comes within DORMANCY_WAKE_RADIUS. Chipmunk also wakes them up on its own when something touches
+// them or pushes them, e.g explosion impulses
+static int dormancy_cell(double coord)
+{
+  return (int)floor(coord / DORMANCY_SLEEP_RADIUS);
+}
+
+static bool dormancy_waker(Entity *e)
+{
+  return e->is_player || e->is_missile || e->is_explosion;
+}
+
+static void process_dormancy(GameState *gs)
+{
+  // the wakers are bucketed by cells as big as the sleep radius, hashed like the players are, so each entity
+  // only looks at the ones in the cells around it
+  int num_wakers = 0;
+  ENTITIES_ITER(gs, e)
+  {
+    if (dormancy_waker(e))
+      num_wakers++;
+  }
+  cpVect *wakers = malloc(sizeof(*wakers) * (num_wakers + 1));
+  int *next_in_bucket = malloc(sizeof(*next_in_bucket) * (num_wakers + 1));
+  flight_assert(wakers != NULL && next_in_bucket != NULL);
+  int buckets[PLAYER_BUCKETS] = {0}; // index + 1 of the first waker in each, 0 when empty
+  int waker_index = 0;
+  ENTITIES_ITER(gs, e)
+  {
+    if (!dormancy_waker(e))
+      continue;
+    wakers[waker_index] = entity_pos(e);
+    unsigned int bucket = player_bucket(dormancy_cell(wakers[waker_index].x), dormancy_cell(wakers[waker_index].y));
+    next_in_bucket[waker_index] = buckets[bucket];
+    buckets[bucket] = waker_index + 1;
+    waker_index++;
+  }
+
+  ENTITIES_ITER(gs, e)
+  {
+    // ghosts are kinematic, chipmunk can't put them to sleep. They sleep on the shard that owns them
+    if (e->flag_for_destruction || e->body == NULL || !(e->is_grid || e->is_orb) || e->is_ghost)
+      continue;
+
+    // anything past the cells around it is farther than the sleep radius
+    cpVect pos = entity_pos(e);
+    double closest_waker_dist_sqr = INFINITY;
+    unsigned int visited[9] = {0}; // different cells can hash to the same bucket
+    int num_visited = 0;
+    for (int x = dormancy_cell(pos.x) - 1; x <= dormancy_cell(pos.x) + 1; x++)
+    {
+      for (int y = dormancy_cell(pos.y) - 1; y <= dormancy_cell(pos.y) + 1; y++)
+      {
+        unsigned int bucket = player_bucket(x, y);
+        bool already_visited = false;
+        for (int i = 0; i < num_visited; i++)
+          already_visited |= visited[i] == bucket;
+        if (already_visited)
+          continue;
+        visited[num_visited++] = bucket;
+        for (int index_plus_one = buckets[bucket]; index_plus_one != 0; index_plus_one = next_in_bucket[index_plus_one - 1])
+          closest_waker_dist_sqr = fmin(closest_waker_dist_sqr, cpvdistsq(pos, wakers[index_plus_one - 1]));
+      }
+    }
+
+    if (entity_dormant(e))
+    {
+      if (closest_waker_dist_sqr < DORMANCY_WAKE_RADIUS * DORMANCY_WAKE_RADIUS)
+        cpBodyActivate(e->body);
+    }
+    else
+    {
+      if (closest_waker_dist_sqr > DORMANCY_SLEEP_RADIUS * DORMANCY_SLEEP_RADIUS && can_become_dormant(gs, e))
+        cpBodySleep(e->body);
+    }
+  }
+  free(wakers);
+  free(next_in_bucket);
+}
+
+#define RAILS_MAX_ECCENTRICITY 0.9 // the kepler solve converges slower on very eccentric orbits, and they dive close to the sun
+
+// eccentric anomaly from mean anomaly, newton's method on E - e sin(E) = M
+static double solve_kepler(double mean_anomaly, double eccentricity)
+{
+  mean_anomaly = fmod(mean_anomaly, 2.0 * PI);
+  if (mean_anomaly > PI)
+    mean_anomaly -= 2.0 * PI;
+  if (mean_anomaly < -PI)
+    mean_anomaly += 2.0 * PI;
+
+  double eccentric_anomaly = eccentricity < 0.8 ? mean_anomaly : PI;
+  for (int i = 0; i < 16; i++)
+  {
+    double step = (eccentric_anomaly - eccentricity * sin(eccentric_anomaly) - mean_anomaly) / (1.0 - eccentricity * cos(eccentric_anomaly));
+    eccentric_anomaly -= step;
+    if (fabs(step) < 1e-12)
+      break;
+  }
+  return eccentric_anomaly;
+}
+
+// position and velocity relative to the sun, returns false if it's not a bound orbit that can go on rails
+static bool orbital_elements_from_state(cpVect rel_pos, cpVect rel_vel, double gm, OrbitalElements *out)
+{
+  double r = cpvlength(rel_pos);
+  if (r <= 0.0 || gm <= 0.0)
+    return false;
+  double vel_sqr = cpvlengthsq(rel_vel);
+  double energy = vel_sqr / 2.0 - gm / r;
+  if (energy >= 0.0)
+    return false; // escaping
+  double angular_momentum = cpvcross(rel_pos, rel_vel);
+  if (angular_momentum == 0.0)
+    return false; // falling straight in
+
+  cpVect eccentricity_vector = cpvmult(cpvsub(cpvmult(rel_pos, vel_sqr - gm / r), cpvmult(rel_vel, cpvdot(rel_pos, rel_vel))), 1.0 / gm);
+  double eccentricity = cpvlength(eccentricity_vector);
+  if (eccentricity >= RAILS_MAX_ECCENTRICITY)
+    return false;
+
+  out->semi_major_axis = -gm / (2.0 * energy);
+  out->eccentricity = eccentricity;
+  out->periapsis_angle = eccentricity > 1e-9 ? atan2(eccentricity_vector.y, eccentricity_vector.x) : 0.0;
+  out->direction = angular_momentum > 0.0 ? 1.0 : -1.0;
+  out->mean_motion = sqrt(gm / (out->semi_major_axis * out->semi_major_axis * out->semi_major_axis));
+
+  // position in the frame where the periapsis is along +x and the orbit goes counterclockwise
+  cpVect perifocal = cpvspin(rel_pos, -out->periapsis_angle);
+  perifocal.y *= out->direction;
+  double semi_minor_axis = out->semi_major_axis * sqrt(1.0 - eccentricity * eccentricity);
+  double eccentric_anomaly = atan2(perifocal.y / semi_minor_axis, perifocal.x / out->semi_major_axis + eccentricity);
+  out->mean_anomaly_at_epoch = eccentric_anomaly - eccentricity * sin(eccentric_anomaly);
+  return true;
+}
+
+static void orbital_state_at(OrbitalElements *o, double time_since_epoch, cpVect *rel_pos, cpVect *rel_vel)
+{
+  double eccentric_anomaly = solve_kepler(o->mean_anomaly_at_epoch + o->mean_motion * time_since_epoch, o->eccentricity);
+  double cos_e = cos(eccentric_anomaly);
+  double sin_e = sin(eccentric_anomaly);
+  double semi_minor_axis = o->semi_major_axis * sqrt(1.0 - o->eccentricity * o->eccentricity);
+  double anomaly_rate = o->mean_motion / (1.0 - o->eccentricity * cos_e);
+
+  cpVect pos = cpv(o->semi_major_axis * (cos_e - o->eccentricity), semi_minor_axis * sin_e * o->direction);
+  cpVect vel = cpv(-o->semi_major_axis * sin_e * anomaly_rate, semi_minor_axis * cos_e * anomaly_rate * o->direction);
+  *rel_pos = cpvspin(pos, o->periapsis_angle);
+  *rel_vel = cpvspin(vel, o->periapsis_angle);
+}
+
+// the whole orbit has to stay in the part of the sun's gravity that's plain inverse square, and out of
+// every other sun's gravity
+static bool orbit_only_around_sun(GameState *gs, OrbitalElements *o, Entity *sun)
+{
+  double periapsis = o->semi_major_axis * (1.0 - o->eccentricity);
+  double apoapsis = o->semi_major_axis * (1.0 + o->eccentricity);
+  if (periapsis <= sun->sun_radius || periapsis * periapsis <= sun->sun_radius)
+    return false;
+  if (apoapsis >= sun_dist_no_gravity(sun))
+    return false;
+  if (cpvlength(entity_pos(sun)) + apoapsis >= INSTANT_DEATH_DISTANCE_FROM_CENTER)
+    return false;
+  SUNS_ITER(gs)
+  {
+    if (i.sun != sun && cpvdist(entity_pos(i.sun), entity_pos(sun)) - apoapsis <= sun_dist_no_gravity(i.sun))
+      return false;
+  }
+  return true;
+}
+
+// replaces chipmunk's position integration for bodies on rails. The velocity update is skipped
+// entirely, the orbit is the only thing acting on it
+static void rails_velocity_func(cpBody *body, cpVect gravity, cpFloat damping, cpFloat dt)
+{
+}
+
+static void rails_position_func(cpBody *body, cpFloat dt)
+{
+  Entity *e = cp_body_entity(body);
+  GameState *gs = cp_space_gs(cpBodyGetSpace(body));
+  Entity *sun = get_entity(gs, e->rails.sun);
+  if (sun == NULL)
+  {
+    entity_exit_rails(e);
+    cpBodyUpdatePosition(body, dt);
+    return;
+  }
+
+  // the step ends this tick, so this is where the body should be at the end of it. Bodies that were
+  // dormant pick up wherever their orbit has taken them since
+  double time_since_epoch = (double)(tick(gs) - e->rails.epoch_tick) * TIMESTEP;
+  cpVect rel_pos, rel_vel;
+  orbital_state_at(&e->rails, time_since_epoch, &rel_pos, &rel_vel);
+  double angle = e->rails.angle_at_epoch + e->rails.angular_velocity * time_since_epoch;
+
+  cpBodySetAngle(body, angle);
+  cpBodySetPosition(body, cpvsub(cpvadd(entity_pos(sun), rel_pos), cpvspin(cpBodyGetCenterOfGravity(body), angle)));
+  cpBodySetVelocity(body, cpvadd(sun->sun_vel, rel_vel));
+}
+
+static void count_arbiter(cpBody *body, cpArbiter *arbiter, void *data)
+{
+  (*(int *)data)++;
+}
+
+// Grids that are free falling around a single sun have their orbit solved in closed form instead of
+// integrated every tick, so stations and debris stay on the same orbit forever instead of slowly
+// drifting. They come off of rails when something touches them, they thrust, or their mass changes,
+// and get put back on when they're free falling again
+static void process_rails(GameState *gs)
+{
+  ENTITIES_ITER(gs, e)
+  {
+    if (!e->is_grid || e->body == NULL || e->flag_for_destruction || e->is_ghost)
+      continue;
+
+    if (e->on_rails)
+    {
+      Entity *sun = get_entity(gs, e->rails.sun);
+      if (sun == NULL || !orbit_only_around_sun(gs, &e->rails, sun))
+        entity_exit_rails(e);
+      continue;
+    }
+
+    if (entity_dormant(e) || !can_become_dormant(gs, e))
+      continue;
+    int num_arbiters = 0;
+    cpBodyEachArbiter(e->body, count_arbiter, &num_arbiters);
+    if (num_arbiters > 0)
+      continue;
+
+    cpVect pos = grid_com(e);
+    Entity *in_gravity_of = NULL;
+    bool multiple_suns = false;
+    SUNS_ITER(gs)
+    {
+      if (cpvdist(pos, entity_pos(i.sun)) < sun_dist_no_gravity(i.sun))
+      {
+        multiple_suns = in_gravity_of != NULL;
+        in_gravity_of = i.sun;
+      }
+    }
+    if (in_gravity_of == NULL || multiple_suns)
+      continue;
+
+    OrbitalElements elements = {0};
+    cpVect rel_pos = cpvsub(pos, entity_pos(in_gravity_of));
+    cpVect rel_vel = cpvsub(cpBodyGetVelocity(e->body), in_gravity_of->sun_vel);
+    if (!orbital_elements_from_state(rel_pos, rel_vel, GRAVITY_CONSTANT * in_gravity_of->sun_mass, &elements))
+      continue;
+    if (!orbit_only_around_sun(gs, &elements, in_gravity_of))
+      continue;
+
+    // the body hasn't been stepped yet this tick, so its state is from the end of the last one
+    elements.sun = get_id(gs, in_gravity_of);
+    elements.epoch_tick = tick(gs) - 1;
+    elements.angle_at_epoch = cpBodyGetAngle(e->body);
+    elements.angular_velocity = cpBodyGetAngularVelocity(e->body);
+    e->rails = elements;
+    e->on_rails = true;
+    cpBodySetVelocityUpdateFunc(e->body, rails_velocity_func);
+    cpBodySetPositionUpdateFunc(e->body, rails_position_func);
+  }
+}
+
+// Everything a grid does that only reads and writes its own boxes: solar panels, charging and draining
+// the batteries, and how much energy each box got. Grids don't touch each other in here so they
+// can be processed on different threads, see GridWorkers. What the boxes then do to other entities
+// and the physics happens serially in process()
+static void grid_process_local(GameState *gs, Entity *grid, double dt)
+{
+  // calculate how much energy solar panels provide
+  double energy_to_add = 0.0;
+  BOXES_ITER(gs, cur_box, grid)
+  {
+    if (cur_box->box_type == BoxSolarPanel)
+    {
+      cur_box->sun_amount = 0.0;
+      SUNS_ITER(gs)
+      {
+        double new_sun = clamp01(fabs(cpvdot(box_facing_vector(cur_box), cpvnormalize(cpvsub(entity_pos(i.sun), entity_pos(cur_box))))));
+
+        // less sun the farther away you are!
+        new_sun *= lerp(1.0, 0.0, clamp01(cpvdist(entity_pos(cur_box), entity_pos(i.sun)) / sun_dist_no_gravity(i.sun)));
+        cur_box->sun_amount += new_sun;
+      }
+      cur_box->sun_amount = clamp01(cur_box->sun_amount);
+
+      energy_to_add += cur_box->sun_amount * SOLAR_ENERGY_PER_SECOND * dt;
+    }
+  }
+
+  // apply all of the energy to all connected batteries
+  BOXES_ITER(gs, cur, grid)
+  {
+    if (energy_to_add <= 0.0)
+      break;
+    if (cur->box_type == BoxBattery)
+    {
+      double energy_sucked_up_by_battery = cur->energy_used < energy_to_add ? cur->energy_used : energy_to_add;
+      cur->energy_used -= energy_sucked_up_by_battery;
+      energy_to_add -= energy_sucked_up_by_battery;
+    }
+    flight_assert(energy_to_add >= 0.0);
+  }
+
+  // any energy_to_add existing now can also be used to power thrusters/medbay. Kind of like a temporary separate battery
+  double non_battery_energy_left_over = energy_to_add;
+
+  // use the energy, stored in the batteries, in various boxes
+  BOXES_ITER(gs, cur_box, grid)
+  {
+    if (cur_box->box_type == BoxThruster)
+    {
+      cur_box->energy_effectiveness = batteries_use_energy(gs, grid, &non_battery_energy_left_over, cur_box->wanted_thrust * THRUSTER_ENERGY_USED_PER_SECOND * dt);
+      cur_box->thrust = cur_box->energy_effectiveness * cur_box->wanted_thrust;
+    }
+    if (cur_box->box_type == BoxGyroscope)
+    {
+      cur_box->gyrospin_velocity = lerp(cur_box->gyrospin_velocity, cur_box->thrust * 20.0, dt * 5.0);
+      cur_box->gyrospin_angle += cur_box->gyrospin_velocity * dt;
+
+      // wrap to keep the number small
+      if (cur_box->gyrospin_angle > 2.0 * PI)
+      {
+        cur_box->gyrospin_angle -= 2.0 * PI;
+      }
+      if (cur_box->gyrospin_angle < -2.0 * PI)
+      {
+        cur_box->gyrospin_angle += 2.0 * PI;
+      }
+
+      if (cur_box->wanted_thrust == 0.0)
+      {
+        cur_box->thrust = 0.0;
+      }
+      double thrust_to_want = cur_box->wanted_thrust;
+      if (cur_box->wanted_thrust == 0.0)
+        thrust_to_want = clamp(-cpBodyGetAngularVelocity(grid->body) * GYROSCOPE_PROPORTIONAL_INERTIAL_RESPONSE, -1.0, 1.0);
+      cur_box->energy_effectiveness = batteries_use_energy(gs, grid, &non_battery_energy_left_over, fabs(thrust_to_want * GYROSCOPE_ENERGY_USED_PER_SECOND * dt));
+      cur_box->thrust = cur_box->energy_effectiveness * thrust_to_want;
+    }
+    if (cur_box->box_type == BoxMedbay)
+    {
+      // only reads the player, the healing is applied later
+      Entity *potential_meatbag_to_heal = get_entity(gs, cur_box->player_who_is_inside_of_me);
+      if (potential_meatbag_to_heal != NULL)
+      {
+        double wanted_energy_to_heal = fmin(potential_meatbag_to_heal->damage, PLAYER_ENERGY_RECHARGE_PER_SECOND * dt);
+        cur_box->energy_effectiveness = batteries_use_energy(gs, grid, &non_battery_energy_left_over, wanted_energy_to_heal);
+      }
+    }
+    if (cur_box->box_type == BoxCloaking)
+    {
+      cur_box->energy_effectiveness = batteries_use_energy(gs, grid, &non_battery_energy_left_over, CLOAKING_ENERGY_USE * dt);
+      cur_box->cloaking_power = lerp(cur_box->cloaking_power, cur_box->energy_effectiveness, dt * 3.0);
+    }
+    if (cur_box->box_type == BoxMissileLauncher)
+    {
+      if (cur_box->missile_construction_charge < 1.0)
+      {
+        double want_use_energy = dt * MISSILE_CHARGE_RATE;
+        cur_box->energy_effectiveness = batteries_use_energy(gs, grid, &non_battery_energy_left_over, want_use_energy);
+
+        cur_box->missile_construction_charge += cur_box->energy_effectiveness * want_use_energy;
+      }
+    }
+    if (cur_box->box_type == BoxScanner)
+    {
+      cur_box->energy_effectiveness = batteries_use_energy(gs, grid, &non_battery_energy_left_over, SCANNER_ENERGY_USE * dt);
+    }
+  }
+}
+
+// Threads that run grid_process_local for all the grids in parallel. Grids are handed out one at a
+// time from a shared counter, so a thread that finishes its grids early picks up the ones left over
+// instead of waiting on a thread that got the big space stations
+#define MAX_GRID_WORKER_THREADS 32
+typedef struct GridWorker
+{
+  struct GridWorkers *workers;
+  ma_event start;
+  ma_event finished;
+} GridWorker;
 
-#if 0 // scanner box
-  bool indestructible = false;
-  enum CompassRotation rot = Right;
+typedef struct GridWorkers
+{
+  GridWorker threads[MAX_GRID_WORKER_THREADS];
+  int num_threads; // not counting the thread calling process, which helps out too
+  ma_mutex mutex;  // protects next_grid
+  bool quitting;
+
+  // the current job, only written while the workers are waiting on start
+  GameState *gs;
+  double dt;
+  Entity **grids;
+  int grids_capacity;
+  int num_grids;
+  int next_grid;
+} GridWorkers;
+
+static void grid_workers_help(GridWorkers *workers)
+{
+  while (true)
   {
-    Entity *grid = new_entity(gs);
-    grid_create(gs, grid);
-    entity_set_pos(grid, cpv(1.5, 0.0));
-    BOX_AT_TYPE(grid, cpv(0.0, 0.0), BoxExplosive);
-    BOX_AT_TYPE(grid, cpv(-BOX_SIZE, 0.0), BoxScanner);
-    BOX_AT_TYPE(grid, cpv(-BOX_SIZE * 2.0, 0.0), BoxSolarPanel);
-    BOX_AT_TYPE(grid, cpv(-BOX_SIZE * 3.0, 0.0), BoxSolarPanel);
-    entity_ensure_in_orbit(gs, grid);
+    ma_mutex_lock(&workers->mutex);
+    int grid_index = workers->next_grid;
+    workers->next_grid++;
+    ma_mutex_unlock(&workers->mutex);
+
+    if (grid_index >= workers->num_grids)
+      return;
+    grid_process_local(workers->gs, workers->grids[grid_index], workers->dt);
   }
+}
 
+static void grid_worker(GridWorker *worker)
+{
+  while (true)
   {
-    Entity *grid = new_entity(gs);
-    grid_create(gs, grid);
-    entity_set_pos(grid, cpv(0.0, 10.0));
-    BOX_AT_TYPE(grid, cpv(0.0, 0.0), BoxHullpiece);
-    entity_ensure_in_orbit(gs, grid);
+    ma_event_wait(&worker->start);
+    if (worker->workers->quitting)
+      break;
+    grid_workers_help(worker->workers);
+    ma_event_signal(&worker->finished);
   }
+  ma_event_signal(&worker->finished);
+}
 
+#ifdef _WIN32
+static void grid_worker_entry(void *worker)
+{
+  grid_worker((GridWorker *)worker);
+}
+#else
+static void *grid_worker_entry(void *worker)
+{
+  grid_worker((GridWorker *)worker);
+  return NULL;
+}
 #endif
 
-#if 1 // landing gear box
-  bool indestructible = false;
-  cpVect from = cpv(4.0 * BOX_SIZE, 0.0);
-  enum CompassRotation rot = Right;
-  {
-    Entity *grid = new_entity(gs);
-    grid_create(gs, grid);
-    entity_set_pos(grid, from);
-    BOX_AT_TYPE(grid, ((cpVect){0.0, 0.0}), BoxLandingGear);
-    // BOX_AT(grid, ((cpVect){0.0, -BOX_SIZE}));
-    // BOX_AT_TYPE(grid, ((cpVect){BOX_SIZE, 0.0}), BoxMerge);
-    entity_ensure_in_orbit(gs, grid);
-    cpBodySetVelocity(grid->body, cpv(0.1, 0.0));
-  }
-  {
-    Entity *grid = new_entity(gs);
-    grid_create(gs, grid);
-    entity_set_pos(grid, cpvadd(from, cpv(2.0 * BOX_SIZE, 0.0)));
-    BOX_AT_TYPE(grid, ((cpVect){0.0, 0.0}), BoxHullpiece);
-    entity_ensure_in_orbit(gs, grid);
-  }
-#endif
+// returns NULL if there's no point to having workers, which process handles by doing the grids itself
+GridWorkers *grid_workers_new(int num_threads)
+{
+  if (num_threads <= 0)
+    return NULL;
+  if (num_threads > MAX_GRID_WORKER_THREADS)
+    num_threads = MAX_GRID_WORKER_THREADS;
 
-#if 0  // merge box
-  bool indestructible = false;
-  double theta = deg2rad(65.0);
-  cpVect from = (cpVect){BOX_SIZE * 4.0, -1};
-  enum CompassRotation rot = Right;
+  GridWorkers *to_return = calloc(1, sizeof(*to_return));
+  flight_assert(ma_mutex_init(&to_return->mutex) == MA_SUCCESS);
+  for (int i = 0; i < num_threads; i++)
   {
-    Entity *grid = new_entity(gs);
-    grid_create(gs, grid);
-    entity_set_pos(grid, cpvadd(from, cpvspin((cpVect){.x = -BOX_SIZE * 9.0}, theta)));
-    cpBodySetAngle(grid->body, theta + PI);
-    rot = Left;
-    BOX_AT_TYPE(grid, ((cpVect){0.0, 0.0}), BoxMerge);
-    BOX_AT(grid, ((cpVect){0.0, -BOX_SIZE}));
-    BOX_AT_TYPE(grid, ((cpVect){BOX_SIZE, 0.0}), BoxMerge);
-    entity_ensure_in_orbit(gs, grid);
+    GridWorker *worker = &to_return->threads[i];
+    worker->workers = to_return;
+    flight_assert(ma_event_init(&worker->start) == MA_SUCCESS);
+    flight_assert(ma_event_init(&worker->finished) == MA_SUCCESS);
+#ifdef _WIN32
+    bool started = _beginthread(grid_worker_entry, 0, (void *)worker) != (uintptr_t)-1L;
+#else
+    pthread_t thread;
+    bool started = pthread_create(&thread, NULL, grid_worker_entry, (void *)worker) == 0;
+    if (started)
+      pthread_detach(thread);
+#endif
+    if (!started)
+    {
+      Log("Failed to start grid worker thread, only have %d\n", to_return->num_threads);
+      ma_event_uninit(&worker->start);
+      ma_event_uninit(&worker->finished);
+      break;
+    }
+    to_return->num_threads++;
   }
+  return to_return;
+}
 
+void grid_workers_free(GridWorkers *workers)
+{
+  if (workers == NULL)
+    return;
+  workers->quitting = true;
+  for (int i = 0; i < workers->num_threads; i++)
+    ma_event_signal(&workers->threads[i].start);
+  for (int i = 0; i < workers->num_threads; i++)
   {
-    Entity *grid = new_entity(gs);
-    grid_create(gs, grid);
-    entity_set_pos(grid, from);
-    cpBodySetAngle(grid->body, theta);
-    rot = Left;
-    BOX_AT_TYPE(grid, ((cpVect){-BOX_SIZE, 0.0}), BoxMerge);
-    rot = Down;
-    BOX_AT_TYPE(grid, ((cpVect){0.0, 0.0}), BoxMerge);
-    rot = Up;
-    BOX_AT_TYPE(grid, ((cpVect){0.0, BOX_SIZE}), BoxMerge);
-    cpBodySetVelocity(grid->body, (cpvspin((cpVect){-0.4, 0.0}, theta)));
-    entity_ensure_in_orbit(gs, grid);
+    ma_event_wait(&workers->threads[i].finished);
+    ma_event_uninit(&workers->threads[i].start);
+    ma_event_uninit(&workers->threads[i].finished);
   }
-#endif // grid tests
-
-#endif // debug world
+  ma_mutex_uninit(&workers->mutex);
+  free(workers->grids);
+  free(workers);
 }
 
-// does not actually set seat in variables so can be used on respawn
-void exit_seat(GameState *gs, Entity *seat_in, Entity *p)
+static bool grid_wants_processing(Entity *e)
 {
-  cpVect pilot_seat_exit_spot = cpvadd(entity_pos(seat_in), cpvmult(box_facing_vector(seat_in), BOX_SIZE));
-  cpBodySetPosition(p->body, (pilot_seat_exit_spot));
-  // cpBodySetVelocity(p->body, (player_vel(gs, p)));
-  cpBodySetVelocity(p->body, cpBodyGetVelocity(box_grid(seat_in)->body));
+  return e->is_grid && !e->flag_for_destruction && !e->is_ghost && !entity_dormant(e);
 }
 
-void shape_integrity_check(cpShape *shape, void *data)
+static void grids_process_local(GameState *gs, double dt)
 {
-  flight_assert(cpShapeGetUserData(shape) != NULL);
-  flight_assert(cp_shape_entity(shape)->exists);
-  flight_assert(cp_shape_entity(shape)->shape == shape);
-}
+  GridWorkers *workers = gs->grid_workers;
+  if (workers == NULL || workers->num_threads == 0)
+  {
+    ENTITIES_ITER(gs, e)
+    {
+      if (grid_wants_processing(e))
+        grid_process_local(gs, e, dt);
+    }
+    return;
+  }
 
-void body_integrity_check(cpBody *body, void *data)
-{
-  flight_assert(cpBodyGetUserData(body) != NULL);
-  flight_assert(cp_body_entity(body)->exists);
-  flight_assert(cp_body_entity(body)->body == body);
-}
-void player_get_in_seat(GameState *gs, Player *player, Entity *seat)
-{
-  Entity *p = get_entity(gs, player->entity);
-  p->currently_inside_of_box = get_id(gs, seat);
-  seat->player_who_is_inside_of_me = get_id(gs, p);
-  if (seat->box_type == BoxMedbay)
-    player->last_used_medbay = p->currently_inside_of_box;
+  workers->gs = gs;
+  workers->dt = dt;
+  workers->num_grids = 0;
+  workers->next_grid = 0;
+  ENTITIES_ITER(gs, e)
+  {
+    if (grid_wants_processing(e))
+    {
+      if (workers->num_grids >= workers->grids_capacity)
+      {
+        workers->grids_capacity = workers->grids_capacity == 0 ? 256 : workers->grids_capacity * 2;
+        workers->grids = realloc(workers->grids, sizeof(*workers->grids) * workers->grids_capacity);
+        flight_assert(workers->grids != NULL);
+      }
+      workers->grids[workers->num_grids] = e;
+      workers->num_grids++;
+    }
+  }
+  if (workers->num_grids <= 1)
+  {
+    grid_workers_help(workers);
+    return;
+  }
+
+  for (int i = 0; i < workers->num_threads; i++)
+    ma_event_signal(&workers->threads[i].start);
+  grid_workers_help(workers);
+  for (int i = 0; i < workers->num_threads; i++)
+    ma_event_wait(&workers->threads[i].finished);
 }
 
 void process(struct GameState *gs, double dt)
@@ -2645,30 +5788,35 @@ void process(struct GameState *gs, double dt)
     PROFILE_SCOPE("input processing")
     {
 
-      PLAYERS_ITER(gs->players, player)
+      // counted up front so taking over a squad doesn't check every other player. The client
+      // isn't sent every player, but it's told which squads are taken
+      int squad_members[SquadLast] = {0};
+      PLAYERS_ITER(gs, player)
+      {
+        squad_members[player->squad]++;
+      }
+      if (!gs->server_side_computing)
       {
-        if (player->input.take_over_squad >= 0)
+        for (int squad = SquadNone + 1; squad < SquadLast; squad++)
         {
-          if (player->input.take_over_squad == SquadNone)
-          {
-            player->squad = SquadNone;
-          }
-          else
+          if (gs->squads_taken & (1u << squad))
+            squad_members[squad]++;
+        }
+      }
+
+      PLAYERS_ITER(gs, player)
+      {
+        if (player->input.take_over_squad >= 0 && player->input.take_over_squad < SquadLast)
+        {
+          enum Squad taking = (enum Squad)player->input.take_over_squad;
+          if (taking == SquadNone || squad_members[taking] == 0)
           {
-            bool squad_taken = false;
-            PLAYERS_ITER(gs->players, other_player)
-            {
-              if (other_player->squad == player->input.take_over_squad)
-              {
-                squad_taken = true;
-                break;
-              }
-            }
-            if (!squad_taken)
-              player->squad = player->input.take_over_squad;
+            squad_members[player->squad]--;
+            player->squad = taking;
+            squad_members[taking]++;
           }
-          player->input.take_over_squad = -1;
         }
+        player->input.take_over_squad = -1;
 
         // squad invites
         Entity *possibly_to_invite = get_entity(gs, player->input.invite_this_player);
@@ -2707,7 +5855,9 @@ void process(struct GameState *gs, double dt)
         {
           if (player->input.accept_cur_squad_invite)
           {
+            squad_members[player->squad]--;
             player->squad = p->squad_invited_to;
+            squad_members[player->squad]++;
             p->squad_invited_to = SquadNone;
             player->input.accept_cur_squad_invite = false;
           }
@@ -2727,11 +5877,9 @@ void process(struct GameState *gs, double dt)
         if (player->input.interact_action)
         {
           player->input.interact_action = false;
-          cpPointQueryInfo query_info = {0};
-          cpShape *result = cpSpacePointQueryNearest(gs->space, (world_hand_pos), 0.1, FILTER_ONLY_BOXES, &query_info);
-          if (result != NULL)
+          Entity *potential_seat = box_at_point(gs, world_hand_pos, 0.1);
+          if (potential_seat != NULL)
           {
-            Entity *potential_seat = cp_shape_entity(result);
             flight_assert(potential_seat->is_box);
 
             // IMPORTANT: if you update these, make sure you update box_interactible so
@@ -2757,11 +5905,9 @@ void process(struct GameState *gs, double dt)
           Entity *seat_maybe_in = get_entity(gs, p->currently_inside_of_box);
           if (seat_maybe_in == NULL) // not in any seat
           {
-            cpPointQueryInfo query_info = {0};
-            cpShape *result = cpSpacePointQueryNearest(gs->space, (world_hand_pos), 0.1, FILTER_ONLY_BOXES, &query_info);
-            if (result != NULL)
+            Entity *potential_seat = box_at_point(gs, world_hand_pos, 0.1);
+            if (potential_seat != NULL)
             {
-              Entity *potential_seat = cp_shape_entity(result);
               flight_assert(potential_seat->is_box);
               // IMPORTANT: if you update these, make sure you update box_enterable so
               // the button prompt still works
@@ -2884,14 +6030,12 @@ void process(struct GameState *gs, double dt)
         {
           player->input.dobuild = false; // handle the input. if didn't do this, after destruction of hovered box, would try to build on it again the next frame. @Robust handle the input in one place
 
-          cpPointQueryInfo info = {0};
           cpVect world_build = world_hand_pos;
 
           Entity *target_grid = grid_to_build_on(gs, world_hand_pos);
-          cpShape *maybe_box_to_destroy = cpSpacePointQueryNearest(gs->space, (world_build), 0.01, cpShapeFilterNew(CP_NO_GROUP, BOXES, BOXES), &info);
-          if (maybe_box_to_destroy != NULL)
+          Entity *cur_box = box_at_point(gs, world_build, 0.01);
+          if (cur_box != NULL)
           {
-            Entity *cur_box = cp_shape_entity(maybe_box_to_destroy);
             if (!cur_box->indestructible && !cur_box->is_platonic)
             {
               p->damage -= DAMAGE_TO_PLAYER_PER_BLOCK * ((BATTERY_CAPACITY - cur_box->energy_used) / BATTERY_CAPACITY);
@@ -2939,12 +6083,34 @@ void process(struct GameState *gs, double dt)
 
         p->damage = clamp01(p->damage);
       }
+
+      if (gs->server_side_computing)
+      {
+        gs->squads_taken = 0;
+        for (int squad = SquadNone + 1; squad < SquadLast; squad++)
+        {
+          if (squad_members[squad] > 0)
+            gs->squads_taken |= 1u << squad;
+        }
+      }
+    }
+
+#ifndef NO_SUNS
+    PROFILE_SCOPE("sun processing")
+    {
+      process_suns(gs, dt);
+    }
+#endif
+
+    PROFILE_SCOPE("Grid local processing")
+    {
+      grids_process_local(gs, dt);
     }
 
     PROFILE_SCOPE("process entities")
     {
       ENTITIES_ITER(gs, e)
-      if (!e->flag_for_destruction)
+      if (!e->flag_for_destruction && !e->is_ghost && !entity_dormant(e))
       {
         if (e->body != NULL && cpvlengthsq((entity_pos(e))) > (INSTANT_DEATH_DISTANCE_FROM_CENTER * INSTANT_DEATH_DISTANCE_FROM_CENTER))
         {
@@ -2978,58 +6144,6 @@ void process(struct GameState *gs, double dt)
           }
         }
 
-        // sun processing for this current entity
-#ifndef NO_SUNS
-        PROFILE_SCOPE("this entity sun processing")
-        {
-          SUNS_ITER(gs)
-          {
-            cpVect pos_rel_sun = (cpvsub(entity_pos(e), (entity_pos(i.sun))));
-            cpFloat sqdist = cpvlengthsq(pos_rel_sun);
-
-            if (i.sun->sun_is_safe)
-            {
-              bool is_entity_dangerous = false;
-              is_entity_dangerous |= e->is_missile;
-              if (e->is_box)
-              {
-                is_entity_dangerous |= e->box_type == BoxExplosive;
-              }
-              if (is_entity_dangerous && sqdist < sun_dist_no_gravity(i.sun) * sun_dist_no_gravity(i.sun))
-              {
-                e->flag_for_destruction = true;
-              }
-            }
-
-            if (!e->is_grid) // grids aren't damaged (this edge case sucks!)
-            {
-#ifdef INTENSIVE_PROFILING
-              PROFILE_SCOPE("Grid processing")
-#endif
-              {
-                if (sqdist < (i.sun->sun_radius * i.sun->sun_radius))
-                {
-                  e->damage += 10.0 * dt;
-                }
-              }
-            }
-
-            if (e->body != NULL)
-            {
-#ifdef INTENSIVE_PROFILING
-              PROFILE_SCOPE("Body processing")
-#endif
-              {
-                cpVect accel = sun_gravity_accel_for_entity(e, i.sun);
-                cpVect new_vel = entity_vel(gs, e);
-                new_vel = cpvadd(new_vel, cpvmult(accel, dt));
-                cpBodySetVelocity(e->body, (new_vel));
-              }
-            }
-          }
-        }
-#endif
-
         if (e->is_explosion)
         {
           PROFILE_SCOPE("Explosion")
@@ -3130,7 +6244,8 @@ void process(struct GameState *gs, double dt)
                 cpVect from = cpvadd(entity_pos(from_merge), cpvmult(along, BOX_SIZE / 2.0 + 0.03));
                 cpVect to = cpvadd(from, cpvmult(along, MERGE_MAX_DIST));
                 found_merge_shape = NULL;
-                cpSpaceSegmentQuery(gs->space, from, to, 0.0, FILTER_ONLY_MERGE_BOX, raycast_query_callback, (void *)grid_to_exclude);
+                rebuild_dirty_grid_collision_shapes(gs);
+                cpSpaceSegmentQuery(gs->space, from, to, 0.0, FILTER_ONLY_GRID_COLLISION, raycast_query_callback, (void *)grid_to_exclude);
                 cpShape *other_merge_shape = found_merge_shape;
 
                 Entity *other_merge = NULL;
@@ -3211,54 +6326,15 @@ void process(struct GameState *gs, double dt)
             Entity *grid = e;
             float e; // turn all references to e into errors
             (void)e;
-            // calculate how much energy solar panels provide
-            double energy_to_add = 0.0;
-            BOXES_ITER(gs, cur_box, grid)
-            {
-              if (cur_box->box_type == BoxSolarPanel)
-              {
-                cur_box->sun_amount = 0.0;
-                SUNS_ITER(gs)
-                {
-                  double new_sun = clamp01(fabs(cpvdot(box_facing_vector(cur_box), cpvnormalize(cpvsub(entity_pos(i.sun), entity_pos(cur_box))))));
-
-                  // less sun the farther away you are!
-                  new_sun *= lerp(1.0, 0.0, clamp01(cpvdist(entity_pos(cur_box), entity_pos(i.sun)) / sun_dist_no_gravity(i.sun)));
-                  cur_box->sun_amount += new_sun;
-                }
-                cur_box->sun_amount = clamp01(cur_box->sun_amount);
-
-                energy_to_add += cur_box->sun_amount * SOLAR_ENERGY_PER_SECOND * dt;
-              }
-            }
-
-            // apply all of the energy to all connected batteries
-            BOXES_ITER(gs, cur, grid)
-            {
-              if (energy_to_add <= 0.0)
-                break;
-              if (cur->box_type == BoxBattery)
-              {
-                double energy_sucked_up_by_battery = cur->energy_used < energy_to_add ? cur->energy_used : energy_to_add;
-                cur->energy_used -= energy_sucked_up_by_battery;
-                energy_to_add -= energy_sucked_up_by_battery;
-              }
-              flight_assert(energy_to_add >= 0.0);
-            }
-
-            // any energy_to_add existing now can also be used to power thrusters/medbay. Kind of like a temporary separate battery
-            double non_battery_energy_left_over = energy_to_add;
-
-            // use the energy, stored in the batteries, in various boxes
+            // energy was already settled in grid_process_local, this applies what the boxes do to everything else
             BOXES_ITER(gs, cur_box, grid)
             {
 
               if (cur_box->box_type == BoxThruster)
               {
-                cur_box->energy_effectiveness = batteries_use_energy(gs, grid, &non_battery_energy_left_over, cur_box->wanted_thrust * THRUSTER_ENERGY_USED_PER_SECOND * dt);
-                cur_box->thrust = cur_box->energy_effectiveness * cur_box->wanted_thrust;
                 if (cur_box->thrust > 0.0)
                 {
+                  entity_exit_rails(grid);
                   cpBodyApplyForceAtWorldPoint(grid->body, (thruster_force(cur_box)), (entity_pos(cur_box)));
                   rect_query(gs->space, (BoxCentered){
                                             .pos = cpvadd(entity_pos(cur_box), cpvmult(box_facing_vector(cur_box), BOX_SIZE)),
@@ -3274,28 +6350,8 @@ void process(struct GameState *gs, double dt)
               }
               if (cur_box->box_type == BoxGyroscope)
               {
-                cur_box->gyrospin_velocity = lerp(cur_box->gyrospin_velocity, cur_box->thrust * 20.0, dt * 5.0);
-                cur_box->gyrospin_angle += cur_box->gyrospin_velocity * dt;
-
-                // wrap to keep the number small
-                if (cur_box->gyrospin_angle > 2.0 * PI)
-                {
-                  cur_box->gyrospin_angle -= 2.0 * PI;
-                }
-                if (cur_box->gyrospin_angle < -2.0 * PI)
-                {
-                  cur_box->gyrospin_angle += 2.0 * PI;
-                }
-
-                if (cur_box->wanted_thrust == 0.0)
-                {
-                  cur_box->thrust = 0.0;
-                }
-                double thrust_to_want = cur_box->wanted_thrust;
-                if (cur_box->wanted_thrust == 0.0)
-                  thrust_to_want = clamp(-cpBodyGetAngularVelocity(grid->body) * GYROSCOPE_PROPORTIONAL_INERTIAL_RESPONSE, -1.0, 1.0);
-                cur_box->energy_effectiveness = batteries_use_energy(gs, grid, &non_battery_energy_left_over, fabs(thrust_to_want * GYROSCOPE_ENERGY_USED_PER_SECOND * dt));
-                cur_box->thrust = cur_box->energy_effectiveness * thrust_to_want;
+                if (cur_box->thrust != 0.0)
+                  entity_exit_rails(grid);
                 if (fabs(cur_box->thrust) >= 0.0)
                   cpBodySetTorque(grid->body, cpBodyGetTorque(grid->body) + cur_box->thrust * GYROSCOPE_TORQUE);
               }
@@ -3305,14 +6361,11 @@ void process(struct GameState *gs, double dt)
                 if (potential_meatbag_to_heal != NULL)
                 {
                   double wanted_energy_to_heal = fmin(potential_meatbag_to_heal->damage, PLAYER_ENERGY_RECHARGE_PER_SECOND * dt);
-                  cur_box->energy_effectiveness = batteries_use_energy(gs, grid, &non_battery_energy_left_over, wanted_energy_to_heal);
                   potential_meatbag_to_heal->damage -= wanted_energy_to_heal * cur_box->energy_effectiveness;
                 }
               }
               if (cur_box->box_type == BoxCloaking)
               {
-                cur_box->energy_effectiveness = batteries_use_energy(gs, grid, &non_battery_energy_left_over, CLOAKING_ENERGY_USE * dt);
-                cur_box->cloaking_power = lerp(cur_box->cloaking_power, cur_box->energy_effectiveness, dt * 3.0);
                 if (cur_box->energy_effectiveness >= 1.0)
                 {
                   rect_query(gs->space, (BoxCentered){
@@ -3336,15 +6389,6 @@ void process(struct GameState *gs, double dt)
               if (cur_box->box_type == BoxMissileLauncher)
               {
                 LauncherTarget target = missile_launcher_target(gs, cur_box);
-
-                if (cur_box->missile_construction_charge < 1.0)
-                {
-                  double want_use_energy = dt * MISSILE_CHARGE_RATE;
-                  cur_box->energy_effectiveness = batteries_use_energy(gs, grid, &non_battery_energy_left_over, want_use_energy);
-
-                  cur_box->missile_construction_charge += cur_box->energy_effectiveness * want_use_energy;
-                }
-
                 if (target.target_found && cur_box->missile_construction_charge >= 1.0)
                 {
                   cur_box->missile_construction_charge = 0.0;
@@ -3358,8 +6402,6 @@ void process(struct GameState *gs, double dt)
               }
               if (cur_box->box_type == BoxScanner)
               {
-                cur_box->energy_effectiveness = batteries_use_energy(gs, grid, &non_battery_energy_left_over, SCANNER_ENERGY_USE * dt);
-
                 // only the server knows all the positions of all the solids
                 if (gs->server_side_computing)
                 {
@@ -3525,7 +6567,7 @@ void process(struct GameState *gs, double dt)
 #define DELETE_CONSTRAINT(constraint)               \
   {                                                 \
     cpSpaceRemoveConstraint(gs->space, constraint); \
-    cpConstraintFree(constraint);                   \
+    pooled_constraint_free(gs, constraint);         \
     constraint = NULL;                              \
     cur_box->shape_to_land_on = (EntityID){0};      \
   }
@@ -3540,7 +6582,9 @@ void process(struct GameState *gs, double dt)
                   }
                   if (cur_box->landed_constraint == NULL)
                   {
-                    cur_box->landed_constraint = cpPivotJointNew(body_a, body_b, landing_point);
+                    entity_exit_rails(cp_body_entity(body_a));
+                    entity_exit_rails(cp_body_entity(body_b));
+                    cur_box->landed_constraint = pooled_pivot_joint_new(gs, body_a, body_b, landing_point);
                     cpSpaceAddConstraint(gs->space, cur_box->landed_constraint);
                     on_create_constraint(cur_box, cur_box->landed_constraint);
                   }
@@ -3561,13 +6605,18 @@ void process(struct GameState *gs, double dt)
                   cpVect from = cpvadd(entity_pos(cur_box), cpvmult(along, BOX_SIZE / 2.0 + 0.03));
                   cpVect to = cpvadd(from, cpvmult(along, LANDING_GEAR_MAX_DIST));
 
+                  rebuild_dirty_grid_collision_shapes(gs);
                   cpSegmentQueryInfo query_result = {0};
-                  cpShape *found = cpSpaceSegmentQueryFirst(gs->space, from, to, 0.0, FILTER_DEFAULT, &query_result);
+                  cpShape *found = cpSpaceSegmentQueryFirst(gs->space, from, to, 0.0, FILTER_QUERY, &query_result);
                   if (found != NULL && cpShapeGetBody(found) != box_grid(cur_box)->body)
                   {
-                    cur_box->sees_possible_landing = true;
-                    if (cur_box->toggle_landing)
-                      cur_box->shape_to_land_on = get_id(gs, cp_shape_entity(found));
+                    Entity *to_land_on = is_grid_collision_shape(found) ? grid_collision_shape_box(gs, found, query_result.point) : cp_shape_entity(found);
+                    if (to_land_on != NULL)
+                    {
+                      cur_box->sees_possible_landing = true;
+                      if (cur_box->toggle_landing)
+                        cur_box->shape_to_land_on = get_id(gs, to_land_on);
+                    }
                   }
                 }
 
@@ -3585,19 +6634,63 @@ void process(struct GameState *gs, double dt)
       {
         if (e->flag_for_destruction)
         {
-          Entity *grid = NULL;
           if (e->is_box)
-            grid = box_grid(e);
+            box_grid(e)->lost_boxes = true;
           entity_memory_free(gs, e);
-          if (grid != NULL)
-            grid_correct_for_holes(gs, grid);
         }
       }
+
+      // once per grid no matter how many of its boxes were destroyed
+      ENTITIES_ITER(gs, e)
+      {
+        if (e->is_grid && e->lost_boxes)
+        {
+          e->lost_boxes = false;
+          grid_correct_for_holes(gs, e);
+        }
+      }
+    }
+
+    PROFILE_SCOPE("Rebuild grid collision shapes")
+    {
+      rebuild_dirty_grid_collision_shapes(gs);
+    }
+
+    if (gs->server_side_computing)
+    {
+      PROFILE_SCOPE("Rails")
+      {
+        process_rails(gs);
+      }
+      PROFILE_SCOPE("Dormancy")
+      {
+        process_dormancy(gs);
+      }
+      PROFILE_SCOPE("Sectors")
+      {
+        process_sectors(gs);
+      }
+      PROFILE_SCOPE("Player buckets")
+      {
+        process_player_buckets(gs);
+      }
     }
 
     PROFILE_SCOPE("chipmunk physics processing")
     {
-      cpSpaceStep(gs->space, dt);
+      if (gs->physics_threads > 0)
+        cpHastySpaceStep(gs->space, dt); // collision callbacks like on_damage still happen on this thread
+      else
+        cpSpaceStep(gs->space, dt);
+    }
+
+    PROFILE_SCOPE("Update transform caches")
+    {
+      ENTITIES_ITER(gs, e)
+      {
+        if (e->is_grid && !entity_dormant(e)) // dormant grids didn't move
+          grid_update_transform_cache(gs, e);
+      }
     }
   }
 }
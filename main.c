@@ -49,6 +49,11 @@ static sg_pipeline horizontal_lightning_pipeline;
 static sg_pipeline fire_pipeline;
 
 static struct GameState gs = {0};
+static unsigned char *decompressed_gamestate = NULL; // every gamestate packet from the server is decompressed into this
+static uint64_t last_snapshot_tick = 0;               // gamestates come in parts, parts of this tick are merged into the world
+static bool world_is_snapshot = false;                // until it's predicted forward, then parts of the last snapshot are too late
+static uint32_t gamestate_parts_received = 0;         // told to the server, which measures how many it sent were lost
+static SnapshotCache snapshot_cache = {0};            // entities the server didn't send this time are filled in from here
 static int my_player_index = -1;
 #define MAX_KEYDOWN SAPP_KEYCODE_MENU
 static bool keydown[MAX_KEYDOWN] = {0};
@@ -695,7 +700,10 @@ static void init(void)
     Log("Initialized audio\n");
   }
 
-  Entity *entity_data = calloc(1, sizeof *entity_data * MAX_ENTITIES);
+  decompressed_gamestate = malloc(sizeof *decompressed_gamestate * MAX_SERVER_TO_CLIENT);
+  flight_assert(decompressed_gamestate != NULL);
+
+  Entity *entity_data = entity_arena_reserve(MAX_ENTITIES);
   initialize(&gs, entity_data, sizeof *entity_data * MAX_ENTITIES);
 
   sg_desc sgdesc = {.context = sapp_sgcontext()};
@@ -1355,16 +1363,7 @@ static void ui(bool draw, double dt, double width, double height)
     FLAG_ITER(i)
     {
       enum Squad this_squad = (enum Squad)i;
-      bool this_squad_available = true;
-      if (this_squad != SquadNone)
-        PLAYERS_ITER(gs.players, other_player)
-        {
-          if (other_player->squad == this_squad)
-          {
-            this_squad_available = false;
-            break;
-          }
-        }
+      bool this_squad_available = this_squad == SquadNone || !(gs.squads_taken & (1u << this_squad));
 
       double size = 128.0;
       bool hovering = box_has_point((BoxCentered){.pos = flag_pos[i], .rotation = flag_rot[i], .size = cpv(size * 0.5, size)}, mouse_pos) && this_squad_available;
@@ -1725,7 +1724,7 @@ static void frame(void)
           case ENET_EVENT_TYPE_RECEIVE:
           {
             total_bytes_received += event.packet->dataLength;
-            unsigned char *decompressed = malloc(sizeof *decompressed * MAX_SERVER_TO_CLIENT); // @Robust no malloc
+            unsigned char *decompressed = decompressed_gamestate; // never zeroed, only filled by the decompressor
             size_t decompressed_max_len = MAX_SERVER_TO_CLIENT;
             flight_assert(LZO1X_MEM_DECOMPRESS == 0);
 
@@ -1739,17 +1738,42 @@ static void frame(void)
                 &decompressed_max_len, NULL);
             if (return_value == LZO_E_OK)
             {
+              gamestate_parts_received++;
               PROFILE_SCOPE("Deserializing data")
               {
                 SerState ser = init_deserializing(&gs, decompressed, decompressed_max_len, false);
+                ser.applying_snapshot_parts = true;
+                ser.last_snapshot_tick = last_snapshot_tick;
+                ser.can_merge_snapshot = world_is_snapshot;
+                ser.snapshot_cache = &snapshot_cache;
                 SerMaybeFailure maybe_fail = ser_server_to_client(&ser, &msg);
                 if (maybe_fail.failed)
                 {
                   Log("Failed to deserialize game state packet line %d %s\n", maybe_fail.line, maybe_fail.expression);
                 }
-                applied_gamestate_packet = true;
+                else if (!ser.dropped_snapshot_part) // too late to use, the world's moved on
+                {
+                  last_snapshot_tick = tick(&gs);
+                  world_is_snapshot = true;
+                  applied_gamestate_packet = true;
+                  my_player_index = msg.your_player;
+                }
+                if (!maybe_fail.failed && msg.redirect_port != 0)
+                {
+                  // the world is sharded and the player crossed into another shard, it's waiting there for us
+                  Log("Redirected to the shard on port %d\n", msg.redirect_port);
+                  ENetAddress shard_address = peer->address;
+                  shard_address.port = (enet_uint16)msg.redirect_port;
+                  enet_peer_disconnect_now(peer, 0);
+                  peer = enet_host_connect(client, &shard_address, 2, msg.redirect_token);
+                  if (peer == NULL)
+                    quit_with_popup("Failed to connect to the next part of the world", "Networking uh oh");
+                  last_snapshot_tick = 0;
+                  world_is_snapshot = false;
+                  gamestate_parts_received = 0;
+                  snapshot_cache_free(&snapshot_cache); // entity ids from the old shard mean nothing in the new one
+                }
               }
-              my_player_index = msg.your_player;
             }
             else
             {
@@ -1758,7 +1782,6 @@ static void frame(void)
                   return_value);
             }
             ma_mutex_unlock(&play_packets_mutex);
-            free(decompressed);
             enet_packet_destroy(event.packet);
 
             break;
@@ -1823,6 +1846,7 @@ static void frame(void)
             }
             apply_this_tick_of_input_to_player(tick(&gs));
             process(&gs, TIMESTEP);
+            world_is_snapshot = false;
             ticks_to_repredict -= 1;
           }
 
@@ -2077,6 +2101,7 @@ static void frame(void)
             }
 
             process(&gs, TIMESTEP);
+            world_is_snapshot = false;
             time_to_process -= TIMESTEP;
           }
         } while (time_to_process >= TIMESTEP);
@@ -2095,6 +2120,8 @@ static void frame(void)
           ClientToServer to_send = {
               .mic_data = &packets_to_send,
               .input_data = &input_queue,
+              .last_gamestate_tick = last_snapshot_tick,
+              .gamestate_parts_received = gamestate_parts_received,
           };
           unsigned char serialized[MAX_CLIENT_TO_SERVER] = {0};
           SerState ser = init_serializing(&gs, serialized, MAX_CLIENT_TO_SERVER, NULL, false);
@@ -2828,7 +2855,9 @@ void cleanup(void)
   WaitForSingleObject(server_thread_handle, INFINITE);
 
   destroy(&gs);
-  free(gs.entities);
+  entity_arena_release(gs.entities, MAX_ENTITIES);
+  free(decompressed_gamestate);
+  snapshot_cache_free(&snapshot_cache);
 
   end_profiling_mythread();
   end_profiling();
@@ -0,0 +1,176 @@
+#include "types.h"
+#define MINIAUDIO_IMPLEMENTATION
+#include "miniaudio.h"
+
+#define SOKOL_IMPL
+#include "sokol_time.h"
+
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Replays a session the server recorded with -record, simulating as fast as it can, and reports the
+// slowest ticks so a lag spike can be reproduced and profiled. Seeking starts from the last keyframe
+// before from_tick and simulates up to it without timing:
+//   flight_replay session.bin [from_tick] [to_tick]
+
+#define SLOWEST_TICKS 10
+
+typedef struct Keyframe
+{
+	uint64_t tick; // of the tick chunk after it
+	long offset;   // of its chunk type
+} Keyframe;
+
+typedef struct TickTime
+{
+	uint64_t tick;
+	double ms;
+} TickTime;
+
+int main(int argc, char **argv)
+{
+	if (argc < 2)
+	{
+		fprintf(stderr, "Usage: %s session.bin [from_tick] [to_tick]\n", argv[0]);
+		return 1;
+	}
+	const char *session_path = argv[1];
+	uint64_t from_tick = argc > 2 ? strtoull(argv[2], NULL, 10) : 0;
+	uint64_t to_tick = argc > 3 ? strtoull(argv[3], NULL, 10) : UINT64_MAX;
+
+	stm_setup();
+	FILE *file = fopen(session_path, "rb");
+	if (file == NULL || !session_read_header(file))
+	{
+		fprintf(stderr, "%s isn't a session this build can replay\n", session_path);
+		return 1;
+	}
+	setvbuf(file, NULL, _IOFBF, SAVE_BLOCK_SIZE);
+
+	// where the keyframes are, without loading them
+	Keyframe *keyframes = NULL;
+	int num_keyframes = 0;
+	int keyframes_capacity = 0;
+	bool keyframe_needs_tick = false;
+	uint64_t last_tick = 0;
+	int chunk_type = 0;
+	while ((chunk_type = fgetc(file)) != EOF)
+	{
+		if (chunk_type == SessionChunkKeyframe)
+		{
+			if (num_keyframes == keyframes_capacity)
+			{
+				keyframes_capacity = keyframes_capacity * 2 + 64;
+				keyframes = realloc(keyframes, sizeof(*keyframes) * keyframes_capacity);
+				flight_assert(keyframes != NULL);
+			}
+			keyframes[num_keyframes++] = (Keyframe){.offset = ftell(file) - 1};
+			keyframe_needs_tick = true;
+			if (!session_skip_keyframe(file))
+				break;
+		}
+		else if (chunk_type == SessionChunkTick)
+		{
+			if (!session_read_tick(NULL, file, &last_tick))
+				break;
+			if (keyframe_needs_tick)
+				keyframes[num_keyframes - 1].tick = last_tick;
+			keyframe_needs_tick = false;
+		}
+		else
+		{
+			break;
+		}
+	}
+	if (num_keyframes == 0)
+	{
+		fprintf(stderr, "%s has no keyframes\n", session_path);
+		return 1;
+	}
+	if (!feof(file))
+		Log("Session is cut off or corrupted after tick %" PRIu64 ", replaying up to there\n", last_tick);
+	Log("%d keyframes, ticks %" PRIu64 " to %" PRIu64 "\n", num_keyframes, keyframes[0].tick, last_tick);
+
+	int seek_to = 0;
+	for (int i = 0; i < num_keyframes; i++)
+	{
+		if (keyframes[i].tick <= from_tick)
+			seek_to = i;
+	}
+	clearerr(file);
+	fseek(file, keyframes[seek_to].offset, SEEK_SET);
+
+	// simulated like the server does
+	GameState gs = {0};
+	Entity *entity_data = entity_arena_reserve(MAX_ENTITIES);
+	gs.server_side_computing = true;
+	gs.physics_threads = SERVER_PHYSICS_THREADS;
+	initialize(&gs, entity_data, sizeof(Entity) * MAX_ENTITIES);
+	gs.grid_workers = grid_workers_new(SERVER_GRID_WORKER_THREADS);
+	SerStream *stream = calloc(1, sizeof(*stream));
+	flight_assert(stream != NULL);
+	stream->file = file;
+
+	TickTime slowest[SLOWEST_TICKS] = {0};
+	double total_ms = 0.0;
+	uint64_t ticks_timed = 0;
+	bool warned_diverged = false;
+	while ((chunk_type = fgetc(file)) != EOF)
+	{
+		if (chunk_type == SessionChunkKeyframe)
+		{
+			// the world changed outside of processing there, or it's just the periodic one. Either way it's what the server had
+			if (!session_read_keyframe(&gs, stream))
+				break;
+			continue;
+		}
+		uint64_t recorded_tick = 0;
+		if (chunk_type != SessionChunkTick || !session_read_tick(&gs, file, &recorded_tick))
+			break;
+		if (recorded_tick > to_tick)
+			break;
+		if (recorded_tick != tick(&gs) && !warned_diverged)
+		{
+			Log("Replay is at tick %" PRIu64 " but the session recorded tick %" PRIu64 ", it's diverged\n", tick(&gs), recorded_tick);
+			warned_diverged = true;
+		}
+
+		uint64_t start = stm_now();
+		process(&gs, TIMESTEP);
+		double ms = stm_ms(stm_since(start));
+		if (recorded_tick < from_tick)
+			continue;
+
+		total_ms += ms;
+		ticks_timed++;
+		for (int i = 0; i < SLOWEST_TICKS; i++)
+		{
+			if (ms > slowest[i].ms)
+			{
+				memmove(slowest + i + 1, slowest + i, sizeof(*slowest) * (SLOWEST_TICKS - i - 1));
+				slowest[i] = (TickTime){.tick = recorded_tick, .ms = ms};
+				break;
+			}
+		}
+	}
+
+	if (ticks_timed == 0)
+	{
+		Log("No ticks replayed\n");
+	}
+	else
+	{
+		Log("Replayed %" PRIu64 " ticks in %f ms, %f ms a tick on average. %f ms a tick is realtime\n", ticks_timed, total_ms, total_ms / (double)ticks_timed, TIMESTEP * 1000.0);
+		for (int i = 0; i < SLOWEST_TICKS && slowest[i].ms > 0.0; i++)
+			Log("Slow tick %" PRIu64 " took %f ms\n", slowest[i].tick, slowest[i].ms);
+	}
+
+	free(stream);
+	free(keyframes);
+	fclose(file);
+	grid_workers_free(gs.grid_workers);
+	destroy(&gs);
+	entity_arena_release(entity_data, MAX_ENTITIES);
+	return 0;
+}
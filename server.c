@@ -16,6 +16,20 @@
 #define fopen_s(pFile, filename, mode) ((*(pFile)) = fopen((filename), (mode))) == NULL
 #endif
 
+#ifdef _WIN32
+#include <windows.h> // replacing the save file in one step
+#include <bcrypt.h>  // handoff tokens
+#pragma comment(lib, "bcrypt")
+#else
+#include <sys/random.h> // handoff tokens
+#endif
+
+#ifdef __linux__
+#include <sys/epoll.h>   // sleeping on the enet socket and the tick timer at once
+#include <sys/timerfd.h>
+#include <unistd.h>
+#endif
+
 #define CONNECTED_PEERS(host, cur)                                              \
   for (ENetPeer *cur = host->peers; cur < host->peers + host->peerCount; cur++) \
     if (cur->state == ENET_PEER_STATE_CONNECTED)
@@ -28,503 +42,1915 @@ static void panicquit()
   exit(-1);
 }
 
-// started in a thread from host
-void server(void *info_raw)
+// Compressed gamestate packets are handed to enet without copying, enet gives the buffer
+// back through the packet's free callback once it's been sent
+typedef struct PacketBufferPool
 {
-  init_profiling_mythread(1);
-  ServerThreadInfo *info = (ServerThreadInfo *)info_raw;
-  const char *world_save_name = info->world_save;
-#ifdef PROFILING
+  unsigned char *free_buffers; // each free buffer's first bytes point to the next one
+} PacketBufferPool;
+
+#define LZO_COMPRESSED_MAX(length) ((length) + (length) / 16 + 64 + 3) // lzo1x's output for input that doesn't compress at all
+
+// parts are made again smaller when they compress too big, so they're only ever a handful of SNAPSHOT_PART_SIZE
+// before compression. Pooled buffers fit that much, the rare bigger part gets a buffer that's freed after
+#define PACKET_BUFFER_POOLED_INPUT (SNAPSHOT_PART_SIZE * 16)
+#define PACKET_BUFFER_POOLED_SIZE LZO_COMPRESSED_MAX(PACKET_BUFFER_POOLED_INPUT)
+
+// each buffer's capacity is kept just in front of it
+static size_t packet_buffer_capacity(unsigned char *buffer)
+{
+  size_t capacity;
+  memcpy(&capacity, buffer - sizeof(capacity), sizeof(capacity));
+  return capacity;
+}
+
+// a buffer lzo can compress length bytes into
+static unsigned char *packet_buffer_get(PacketBufferPool *pool, size_t length)
+{
+  unsigned char *to_return = pool->free_buffers;
+  size_t capacity = length > PACKET_BUFFER_POOLED_INPUT ? LZO_COMPRESSED_MAX(length) : PACKET_BUFFER_POOLED_SIZE;
+  if (to_return == NULL || capacity > PACKET_BUFFER_POOLED_SIZE)
+  {
+    unsigned char *allocation = malloc(sizeof(capacity) + capacity); // never zeroed, only ever filled by the compressor
+    flight_assert(allocation != NULL);
+    memcpy(allocation, &capacity, sizeof(capacity));
+    to_return = allocation + sizeof(capacity);
+  }
+  else
+  {
+    memcpy(&pool->free_buffers, to_return, sizeof(pool->free_buffers));
+  }
+  return to_return;
+}
+
+static void packet_buffer_put(PacketBufferPool *pool, unsigned char *buffer)
+{
+  if (packet_buffer_capacity(buffer) > PACKET_BUFFER_POOLED_SIZE)
+  {
+    free(buffer - sizeof(size_t));
+    return;
+  }
+  memcpy(buffer, &pool->free_buffers, sizeof(pool->free_buffers));
+  pool->free_buffers = buffer;
+}
+
+// buffer if lzo can compress length bytes into it, otherwise it goes back and one that fits is gotten
+static unsigned char *packet_buffer_fit(PacketBufferPool *pool, unsigned char *buffer, size_t length)
+{
+  if (buffer != NULL && packet_buffer_capacity(buffer) >= LZO_COMPRESSED_MAX(length))
+    return buffer;
+  if (buffer != NULL)
+    packet_buffer_put(pool, buffer);
+  return packet_buffer_get(pool, length);
+}
+
+static void packet_buffer_free_callback(ENetPacket *packet)
+{
+  packet_buffer_put((PacketBufferPool *)packet->userData, packet->data);
+}
+
+static void packet_buffer_pool_free(PacketBufferPool *pool)
+{
+  while (pool->free_buffers != NULL)
+    free(packet_buffer_get(pool, 0) - sizeof(size_t));
+}
+
+// the packets a failed pop took are still there, only marked gone
+static void queue_unpop(Queue *q, QueueElementHeader *old_next)
+{
+  q->next = old_next;
+  for (QueueElementHeader *cur = old_next; cur != NULL; cur = cur->next)
+    cur->exists = true;
+}
+
+// how many parts had been sent to a client by the end of one of its gamestates
+typedef struct SnapshotSent
+{
+  uint64_t tick;
+  uint32_t parts_sent;
+} SnapshotSent;
+
+// how often and how much each client is sent. Backs off when the client says parts were lost, the
+// round trip grows from queueing, or the client goes quiet, and creeps back up otherwise
+typedef struct SnapshotRate
+{
+  double rate;          // gamestates per second
+  size_t budget;        // bytes of entities per gamestate
+  double time_to_send;  // seconds until the next gamestate is due
+  double time_to_adapt; // seconds until rate and budget are next adjusted
+  double compression;   // bytes of a part before compression for each byte after, to size parts before they're compressed
+
+  // gamestates are unreliable, and enet only measures loss of reliable packets. The client says which
+  // gamestate it's seen last and how many parts it's had, which lines up with how many were sent by then
+  uint32_t parts_sent;
+  SnapshotSent sent[SNAPSHOT_SENT_HISTORY]; // ring of the latest gamestates
+  int sent_next;
+  uint64_t reported_tick; // latest the client said
+  uint32_t reported_parts_received;
+  uint32_t measured_parts_sent; // where the last measurement of loss left off
+  uint32_t measured_parts_received;
+} SnapshotRate;
+
+static void snapshot_rate_reset(SnapshotRate *r)
+{
+  *r = (SnapshotRate){
+      .rate = SNAPSHOT_RATE_START,
+      .budget = SNAPSHOT_BUDGET,
+      .time_to_adapt = SNAPSHOT_ADAPT_INTERVAL,
+      .compression = SNAPSHOT_COMPRESSION_GUESS,
+  };
+}
+
+// fraction of the parts sent since it was last measured that the client didn't get, enet's guess
+// if the client hasn't said anything that lines up with what was sent
+static double snapshot_rate_loss(SnapshotRate *r, ENetPeer *peer)
+{
+  double loss = (double)peer->packetLoss / (double)ENET_PEER_PACKET_LOSS_SCALE;
+  for (int i = 0; i < SNAPSHOT_SENT_HISTORY; i++)
+  {
+    SnapshotSent *sent = &r->sent[i];
+    if (sent->tick != r->reported_tick || r->reported_tick == 0)
+      continue;
+    // the client can't have had more than was sent by then, unless parts came late. Those count next time
+    if (sent->parts_sent > r->measured_parts_sent && r->reported_parts_received >= r->measured_parts_received)
+    {
+      double parts_sent = (double)(sent->parts_sent - r->measured_parts_sent);
+      double parts_received = (double)(r->reported_parts_received - r->measured_parts_received);
+      loss = fmax(0.0, 1.0 - parts_received / parts_sent);
+      r->measured_parts_sent = sent->parts_sent;
+      r->measured_parts_received = r->reported_parts_received;
+    }
+    break;
+  }
+  return loss;
+}
+
+static void snapshot_rate_adapt(SnapshotRate *r, ENetPeer *peer)
+{
+  double loss = snapshot_rate_loss(r, peer);
+  double queueing_ms = (double)peer->roundTripTime - (double)peer->lowestRoundTripTime;
+
+  // clients send inputs steadily, so a long gap since the last one means packets are piling up or being dropped
+  enet_uint32 now = enet_time_get();
+  double receive_gap = now > peer->lastReceiveTime ? (double)(now - peer->lastReceiveTime) / 1000.0 : 0.0;
 
+  if (loss > SNAPSHOT_LOSS_BACKOFF || queueing_ms > SNAPSHOT_QUEUEING_BACKOFF_MS || receive_gap > TIME_BETWEEN_INPUT_PACKETS * 4.0)
+  {
+    r->rate *= 0.75;
+    r->budget = r->budget * 3 / 4;
+  }
+  else
+  {
+    r->rate += 2.0;
+    r->budget += 1024;
+  }
+  r->rate = fmax(SNAPSHOT_RATE_MIN, fmin(SNAPSHOT_RATE_MAX, r->rate));
+  if (r->budget < SNAPSHOT_BUDGET_MIN)
+    r->budget = SNAPSHOT_BUDGET_MIN;
+  if (r->budget > SNAPSHOT_BUDGET_MAX)
+    r->budget = SNAPSHOT_BUDGET_MAX;
+}
+
+// Sleeps the server thread until a packet arrives on any world's socket or the next thing it has to do is due,
+// instead of spinning. On linux that's epoll on the enet sockets and a timerfd, elsewhere a select with millisecond timeouts
+typedef struct ServerWaiter
+{
+#ifdef __linux__
+  int epoll_fd;
+  int timer_fd;
+#else
+  ENetSocketSet sockets;
+  ENetSocket max_socket;
 #endif
+} ServerWaiter;
 
-  struct GameState gs = {0};
-  size_t entities_size = (sizeof(Entity) * MAX_ENTITIES);
-  Entity *entity_data = calloc(1, entities_size);
-  initialize(&gs, entity_data, entities_size);
-  gs.server_side_computing = true;
-  Log("Allocated %zu bytes for entities\n", entities_size);
+static void server_waiter_init(ServerWaiter *w)
+{
+#ifdef __linux__
+  w->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  w->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  flight_assert(w->epoll_fd >= 0 && w->timer_fd >= 0);
+  struct epoll_event timer_event = {.events = EPOLLIN, .data.fd = w->timer_fd};
+  if (epoll_ctl(w->epoll_fd, EPOLL_CTL_ADD, w->timer_fd, &timer_event) != 0)
+  {
+    Log("Failed to add tick timer to epoll: errno %d\n", errno);
+  }
+#else
+  ENET_SOCKETSET_EMPTY(w->sockets);
+  w->max_socket = 0;
+#endif
+}
 
-  create_initial_world(&gs);
+static void server_waiter_add(ServerWaiter *w, ENetHost *host)
+{
+#ifdef __linux__
+  struct epoll_event socket_event = {.events = EPOLLIN, .data.fd = host->socket};
+  if (epoll_ctl(w->epoll_fd, EPOLL_CTL_ADD, host->socket, &socket_event) != 0)
+  {
+    Log("Failed to add server socket to epoll: errno %d\n", errno);
+  }
+#else
+  ENET_SOCKETSET_ADD(w->sockets, host->socket);
+  if (host->socket > w->max_socket)
+    w->max_socket = host->socket;
+#endif
+}
 
-  // inputs
-  Queue player_input_queues[MAX_PLAYERS] = {0};
-  size_t input_queue_data_size = QUEUE_SIZE_FOR_ELEMENTS(sizeof(InputFrame), INPUT_QUEUE_MAX);
-  for (int i = 0; i < MAX_PLAYERS; i++)
-    queue_init(&player_input_queues[i], sizeof(InputFrame), calloc(1, input_queue_data_size), input_queue_data_size);
+static void server_wait(ServerWaiter *w, double seconds)
+{
+  // close enough to the deadline that the kernel waking us late would cost more than spinning the rest
+  seconds -= SERVER_TICK_JITTER_TARGET;
+  if (seconds <= 0.0)
+    return;
+#ifdef __linux__
+  struct itimerspec wake = {
+      .it_value.tv_sec = (time_t)seconds,
+      .it_value.tv_nsec = (long)((seconds - floor(seconds)) * 1e9),
+  };
+  if (wake.it_value.tv_sec == 0 && wake.it_value.tv_nsec == 0)
+    return; // a zeroed timer is disarmed and would never wake us
+  timerfd_settime(w->timer_fd, 0, &wake, NULL);
 
-  // voip
-  Queue player_voip_buffers[MAX_PLAYERS] = {0};
-  size_t player_voip_buffer_size = QUEUE_SIZE_FOR_ELEMENTS(sizeof(OpusPacket), VOIP_PACKET_BUFFER_SIZE);
-  for (int i = 0; i < MAX_PLAYERS; i++)
-    queue_init(&player_voip_buffers[i], sizeof(OpusPacket), calloc(1, player_voip_buffer_size), player_voip_buffer_size);
-  OpusEncoder *player_encoders[MAX_PLAYERS] = {0};
-  OpusDecoder *player_decoders[MAX_PLAYERS] = {0};
+  struct epoll_event events[8];
+  int num_events = epoll_wait(w->epoll_fd, events, ARRLEN(events), -1);
+  if (num_events < 0 && errno != EINTR) // signals like SIGTERM interrupt the wait, the quit flag is checked right after
+  {
+    Log("epoll_wait failed: errno %d\n", errno);
+  }
+  uint64_t expirations = 0;
+  if (read(w->timer_fd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN)
+  {
+    Log("Failed to read the tick timer: errno %d\n", errno);
+  }
+#else
+  enet_uint32 timeout_ms = (enet_uint32)(seconds * 1000.0);
+  ENetSocketSet readable = w->sockets; // select overwrites it with the sockets that are ready
+  if (timeout_ms > 0)
+    enet_socketset_select(w->max_socket, &readable, NULL, timeout_ms);
+#endif
+}
+
+static void server_waiter_free(ServerWaiter *w)
+{
+#ifdef __linux__
+  close(w->timer_fd);
+  close(w->epoll_fd);
+#else
+  (void)w;
+#endif
+}
+
+// what all the worlds hosted by one server take turns using
+typedef struct ServerShared
+{
+  struct GridWorkers *grid_workers; // worlds are stepped one after the other, so they never want the workers at the same time
+  unsigned char *gamestate_scratch; // gamestates are serialized here for one player at a time
+  PacketBufferPool gamestate_packet_buffers;
+  SerStream *save_stream; // every world is saved and loaded through its one block
+  double budget_share; // when every client of every world together wants more than the server will send, everybody's budget shrinks by the same fraction
+} ServerShared;
+
+// a player handed off to another shard, whose client still has to be told where to reconnect
+typedef struct ShardRedirect
+{
+  uint32_t token; // 0 if the player in this slot wasn't handed off
+  int port;
+  uint32_t handoff_id; // the ShardHandoff it went with
+  bool acknowledged;   // the neighbor has loaded the player, the client isn't told to go until then
+  bool sent;
+} ShardRedirect;
+
+// a group handed off to a neighbor that hasn't said it has loaded it yet. Kept as the message it was sent
+// as, so it can be put back if the neighbor couldn't load it or the link drops before it says
+typedef struct ShardHandoff
+{
+  uint32_t id;
+  int side;
+  unsigned char *message; // what ser_handoff wrote
+  size_t length;
+} ShardHandoff;
+
+// a player handed off to this shard, whose client hasn't reconnected yet
+typedef struct ShardArrival
+{
+  HandedOffPlayer handed_off;
+  double time_left;
+} ShardArrival;
+
+#define MAX_AUDIO_PACKETS_TO_SEND 12
+
+// what the server keeps for each player slot besides the Player in the gamestate, see server_players_reserve
+typedef struct ServerPlayer
+{
+  Queue input_queue;
+  Queue voip_buffer;
+  Queue audio_to_send; // mixed every send tick, but only flushed when that player's next gamestate goes out
+  OpusEncoder *encoder;
+  OpusDecoder *decoder;
+  SnapshotPriorities snapshot_priorities;
+  SnapshotRate snapshot_rate;
+  ShardRedirect redirect;
+  bool talking; // said something since the last send tick, it's in decoded_audio
+  opus_int16 decoded_audio[MAX_AUDIO_PACKETS_TO_SEND][VOIP_EXPECTED_FRAME_COUNT];
+} ServerPlayer;
+
+// One independent game world, with its own port, players and save file
+typedef struct ServerWorld
+{
+  const char *world_save_name;
+  int port;
+  const char *record_session;
+  struct GameState gs;
+  Entity *entity_data;
+  ENetHost *enet_host;
+
+  ServerPlayer *players; // by slot, grown along with the gamestate's
+  unsigned int num_players;
+
+  uint64_t last_processed_time;
+  uint64_t last_saved_world_time;
+  uint64_t last_sent_audio_time;
+  uint64_t last_sent_gamestate_time;
+  double audio_time_to_send;
+  double total_time;
+  bool unsaved_changes;
 
-  if (world_save_name != NULL)
+  // sharding, see the shard_ functions
+  int shard_index;
+  int num_shards;
+  const char *shard_address;
+  const char *shard_secret;
+  enet_uint32 shard_link_host; // the address links are made over, a link from anywhere else is refused
+  ENetHost *shard_host;
+  ENetPeer *shard_neighbors[2]; // the shard below this one along x then the one above, NULL when there's no link
+  bool shard_authenticated[2];  // the neighbor sent the secret, nothing else it sends is listened to until then
+  ShardGhosts ghosts[2];        // copies of what each neighbor has near the border
+  ShardArrival *arrivals; // removed once their clients reconnect or time runs out
+  int num_arrivals;
+  int arrivals_capacity;
+  ShardHandoff *handoffs; // waiting on the neighbor's ShardMessageHandoffAck
+  int num_handoffs;
+  int handoffs_capacity;
+  uint32_t next_handoff_id;
+  uint64_t last_shard_connect_time;
+  uint64_t last_sent_ghosts_time;
+  uint64_t last_sent_tick_time;
+  double tick_slew; // added to the rate time passes at while catching up with the shard below, see ShardMessageTick
+
+  // recording the session, see server_world_record
+  SerStream *session_stream; // NULL if not recording
+  bool session_keyframe_due; // the world changed outside of processing, so the inputs alone won't reproduce it
+  uint64_t last_keyframe_tick;
+} ServerWorld;
+
+#define SERVER_IDLE_WAKE 0.25 // seconds, how often the quit flag is checked when no world has anything due
+
+static bool world_sharded(ServerWorld *w)
+{
+  return w->num_shards > 1;
+}
+
+static bool server_world_idle(ServerWorld *w)
+{
+  if (world_sharded(w))
+    return false; // the other shards aren't waiting for it
+  CONNECTED_PEERS(w->enet_host, cur)
   {
-    size_t read_game_data_buffer_size = entities_size;
-    unsigned char *read_game_data = calloc(1, read_game_data_buffer_size);
+    return false;
+  }
+  return true;
+}
 
-    FILE *file = NULL;
-    fopen_s(&file, (const char *)world_save_name, "rb");
-    if (file == NULL)
+// Sharded worlds: shard i simulates the strip of x from shard_border(i) to shard_border(i + 1). Neighboring
+// shards are linked over their own enet host, the lower one connects to the higher one. Whatever crosses
+// a border is handed off to the shard on the other side, and whatever is near one is copied there as a ghost
+typedef enum
+{
+  ShardMessageAuth,    // reliable, the world's secret. The first thing each side of a link sends
+  ShardMessageTick,    // the lower shard's tick, so the higher one steps in lockstep with it. Sent on linking then every so often
+  ShardMessageHandoff,    // reliable, an id then an entity group now owned by the receiver
+  ShardMessageHandoffAck, // reliable, the id of a handoff and whether the receiver loaded it
+  ShardMessageGhosts,  // unreliable, everything the sender owns near the border
+  ShardMessageSectors, // unreliable, where the sender's players near the border are, the receiver generates its sectors near them
+} ShardMessage;
+
+#define SHARD_MAX_HANDOFFS_PER_TICK 64
+#define SHARD_MAX_GHOST_ROOTS 512
+#define SHARD_RECONNECT_INTERVAL 1.0 // seconds between attempts to link with the shard above
+
+static double shard_border(ServerWorld *w, int shard)
+{
+  if (shard <= 0)
+    return -INFINITY;
+  if (shard >= w->num_shards)
+    return INFINITY;
+  return (shard - w->num_shards / 2.0) * SHARD_REGION_WIDTH;
+}
+
+static int shard_port(ServerWorld *w, int shard)
+{
+  return w->port - w->shard_index + shard;
+}
+
+static bool shard_linked(ServerWorld *w, int side)
+{
+  return w->shard_neighbors[side] != NULL && w->shard_neighbors[side]->state == ENET_PEER_STATE_CONNECTED && w->shard_authenticated[side];
+}
+
+// compares all of it whatever's different, so how long it takes doesn't give away how much was right
+static bool shard_secret_matches(ServerWorld *w, const unsigned char *secret, size_t length)
+{
+  size_t expected_length = strlen(w->shard_secret);
+  unsigned char difference = length != expected_length;
+  for (size_t i = 0; i < length && i < expected_length; i++)
+    difference |= secret[i] ^ (unsigned char)w->shard_secret[i];
+  return difference == 0;
+}
+
+// what gets handed off and ghosted, everything else goes along with one of these
+static bool shard_root(GameState *gs, Entity *e)
+{
+  if (e->is_box || e->is_sun || e->is_explosion || e->is_ghost || e->body == NULL || e->flag_for_destruction)
+    return false;
+  if (e->is_player && get_entity(gs, e->currently_inside_of_box) != NULL)
+    return false;
+  return true;
+}
+
+// -1 if it's in this shard's strip, otherwise the side of the neighbor it's far enough into to be handed off
+static int shard_side_outside(ServerWorld *w, double x, double hysteresis)
+{
+  if (x < shard_border(w, w->shard_index) - hysteresis)
+    return 0;
+  if (x >= shard_border(w, w->shard_index + 1) + hysteresis)
+    return 1;
+  return -1;
+}
+
+static void shard_arrival_remove(ServerWorld *w, ShardArrival *arrival)
+{
+  *arrival = w->arrivals[w->num_arrivals - 1];
+  w->num_arrivals--;
+}
+
+// takes the handed off player a client connecting with this token is, as long as it's connecting from
+// the address the player was being played from. False if there's no such player
+static bool shard_arrival_claim(ServerWorld *w, enet_uint32 token, enet_uint32 client_host, Player *out)
+{
+  if (token == 0)
+    return false;
+  for (int i = 0; i < w->num_arrivals; i++)
+  {
+    ShardArrival *arrival = &w->arrivals[i];
+    if (arrival->handed_off.token != token)
+      continue;
+    if (arrival->handed_off.client_host != client_host)
     {
-      Log("Could not read from data file %s: errno %d\n", (const char *)world_save_name, errno);
+      Log("Refusing a handoff token from %x, the player it's for was handed off from %x\n", client_host, arrival->handed_off.client_host);
+      return false;
     }
-    else
+    *out = arrival->handed_off.player;
+    shard_arrival_remove(w, arrival);
+    return true;
+  }
+  return false;
+}
+
+// whoever has a player's token can take it over, so they come from the OS and not rand()
+static bool shard_random_bytes(void *out, size_t length)
+{
+#ifdef _WIN32
+  return BCRYPT_SUCCESS(BCryptGenRandom(NULL, (PUCHAR)out, (ULONG)length, BCRYPT_USE_SYSTEM_PREFERRED_RNG));
+#else
+  size_t filled = 0;
+  while (filled < length)
+  {
+    ssize_t got = getrandom((unsigned char *)out + filled, length - filled, 0);
+    if (got < 0 && errno != EINTR)
+      return false;
+    if (got > 0)
+      filled += (size_t)got;
+  }
+  return true;
+#endif
+}
+
+// a token for each of the players from entity_group_players, and the address of its client
+static bool shard_handoff_credentials(ServerWorld *w, HandedOffPlayer *players, int num_players)
+{
+  for (int i = 0; i < num_players; i++)
+  {
+    if (!shard_random_bytes(&players[i].token, sizeof(players[i].token)))
+      return false;
+    if (players[i].token == 0)
+      players[i].token = 1; // 0 is a client connecting for the first time
+    CONNECTED_PEERS(w->enet_host, cur)
+    {
+      if ((int64_t)cur->data == players[i].from_slot)
+        players[i].client_host = cur->address.host;
+    }
+  }
+  return true;
+}
+
+static bool shard_awaiting_client(ServerWorld *w, Entity *e)
+{
+  if (!e->is_player)
+    return false; // checked for every entity, only players can be waiting
+  for (int i = 0; i < w->num_arrivals; i++)
+  {
+    if (get_entity(&w->gs, w->arrivals[i].handed_off.player.entity) == e)
+      return true;
+  }
+  return false;
+}
+
+// false if enet wouldn't queue it
+static bool shard_send_message(ServerWorld *w, int side, ShardMessage type, unsigned char *data, size_t length, enet_uint32 flags)
+{
+  ENetPacket *packet = enet_packet_create(NULL, 1 + length, flags);
+  if (packet == NULL)
+    return false;
+  packet->data[0] = (unsigned char)type;
+  memcpy(packet->data + 1, data, length);
+  if (enet_peer_send(w->shard_neighbors[side], side == 0 ? 0 : 1, packet) < 0)
+  {
+    enet_packet_destroy(packet);
+    return false;
+  }
+  return true;
+}
+
+static void shard_handoff_add(ServerWorld *w, uint32_t id, int side, unsigned char *message, size_t length)
+{
+  if (w->num_handoffs >= w->handoffs_capacity)
+  {
+    w->handoffs_capacity = w->handoffs_capacity * 2 + 8;
+    w->handoffs = realloc(w->handoffs, sizeof(*w->handoffs) * w->handoffs_capacity);
+    flight_assert(w->handoffs != NULL);
+  }
+  ShardHandoff *handoff = &w->handoffs[w->num_handoffs++];
+  *handoff = (ShardHandoff){.id = id, .side = side, .message = malloc(length), .length = length};
+  flight_assert(handoff->message != NULL);
+  memcpy(handoff->message, message, length);
+}
+
+static void shard_handoff_remove(ServerWorld *w, ShardHandoff *handoff)
+{
+  free(handoff->message);
+  *handoff = w->handoffs[w->num_handoffs - 1];
+  w->num_handoffs--;
+}
+
+// loads a group the neighbor never took back into this shard. Its players go back to their slots, unless
+// their clients left while it was away
+static void shard_handoff_restore(ServerWorld *w, ShardHandoff *handoff)
+{
+  GameState *gs = &w->gs;
+  Entity *root = NULL;
+  HandedOffPlayer *players = NULL;
+  int num_players = 0;
+  SerState ser = init_deserializing(gs, handoff->message, handoff->length, false);
+  SerMaybeFailure maybe_fail = ser_handoff(&ser, gs, NULL, &root, &players, &num_players);
+  if (maybe_fail.failed)
+  {
+    Log("Failed to put back a handoff the neighbor didn't take, it's lost: %d %s\n", maybe_fail.line, maybe_fail.expression);
+  }
+  for (int i = 0; !maybe_fail.failed && i < num_players; i++)
+  {
+    int slot = -1;
+    for (unsigned int ii = 0; slot == -1 && ii < w->num_players; ii++)
+    {
+      ShardRedirect *redirect = &w->players[ii].redirect;
+      if (redirect->handoff_id == handoff->id && redirect->token == players[i].token && redirect->token != 0)
+        slot = (int)ii;
+    }
+    if (slot == -1)
     {
-      size_t actual_length = fread(read_game_data, sizeof(char), entities_size, file);
-      if (actual_length <= 1)
+      Entity *player_entity = get_entity(gs, players[i].player.entity);
+      if (player_entity != NULL)
+        entity_memory_free(gs, player_entity);
+      continue;
+    }
+    gs->players[slot] = players[i].player;
+    gs->players[slot].connected = true;
+    w->players[slot].redirect = (ShardRedirect){0};
+  }
+  free(players);
+  w->unsaved_changes = true;
+  w->session_keyframe_due = true;
+  shard_handoff_remove(w, handoff);
+}
+
+// every handoff to that side that hasn't been acknowledged is put back, the link it would've come over is gone
+static void shard_handoffs_restore_side(ServerWorld *w, int side)
+{
+  for (int i = w->num_handoffs - 1; i >= 0; i--)
+  {
+    if (w->handoffs[i].side == side)
+      shard_handoff_restore(w, &w->handoffs[i]);
+  }
+}
+
+static void shard_start(ServerWorld *w)
+{
+  GameState *gs = &w->gs;
+
+  // the save can have anything anywhere, what's in another shard's strip is that shard's
+  EntityID *outside = NULL;
+  int num_outside = 0;
+  int outside_capacity = 0;
+  ENTITIES_ITER(gs, e)
+  {
+    if (shard_root(gs, e) && shard_side_outside(w, entity_pos(e).x, 0.0) != -1)
+    {
+      if (num_outside == outside_capacity)
       {
-        Log("Could only read %zu bytes, error: errno %d\n", actual_length, errno);
-        panicquit();
+        outside_capacity = outside_capacity == 0 ? 64 : outside_capacity * 2;
+        outside = realloc(outside, sizeof(*outside) * outside_capacity);
+        flight_assert(outside != NULL);
+      }
+      outside[num_outside++] = get_id(gs, e);
+    }
+  }
+  for (int i = 0; i < num_outside; i++)
+  {
+    Entity *root = get_entity(gs, outside[i]);
+    if (root != NULL)
+      entity_group_free(gs, root);
+  }
+  free(outside);
+  gs->sector_min_x = shard_border(w, w->shard_index); // the rest of the world is generated by the shards it's in
+  gs->sector_max_x = shard_border(w, w->shard_index + 1);
+
+  if (w->shard_secret == NULL || strlen(w->shard_secret) < SHARD_SECRET_MIN_LENGTH || strlen(w->shard_secret) > SHARD_SECRET_MAX_LENGTH)
+  {
+    fprintf(stderr, "Shard %d has no secret, or one that isn't between %d and %d characters. Anybody could pretend to be its neighbors\n", w->shard_index, SHARD_SECRET_MIN_LENGTH, SHARD_SECRET_MAX_LENGTH);
+    panicquit();
+  }
+
+  ENetAddress address;
+  if (enet_address_set_host(&address, w->shard_address != NULL ? w->shard_address : "127.0.0.1") != 0)
+  {
+    fprintf(stderr, "Couldn't find the shard link address %s\n", w->shard_address);
+    panicquit();
+  }
+  w->shard_link_host = address.host;
+  address.port = (enet_uint16)(w->port + SHARD_LINK_PORT_OFFSET);
+  w->shard_host = enet_host_create(&address, 4 /* one neighbor on each side, and links that haven't sent the secret yet */, 2 /* handoffs on 0, ghosts on 1 */, 0, 0);
+  if (w->shard_host == NULL)
+  {
+    fprintf(stderr, "An error occurred while trying to create the shard link host on port %d.\n", address.port);
+    panicquit();
+  }
+  Log("Shard %d of %d, owns x from %f to %f, linking on port %d\n", w->shard_index, w->num_shards, shard_border(w, w->shard_index), shard_border(w, w->shard_index + 1), address.port);
+}
+
+static void shard_receive(ServerWorld *w)
+{
+  GameState *gs = &w->gs;
+
+  // the link to the shard above is this shard's to make, and remake if it drops
+  if (w->shard_index + 1 < w->num_shards && w->shard_neighbors[1] == NULL && stm_sec(stm_diff(stm_now(), w->last_shard_connect_time)) > SHARD_RECONNECT_INTERVAL)
+  {
+    w->last_shard_connect_time = stm_now();
+    ENetAddress address = {.host = w->shard_link_host, .port = (enet_uint16)(shard_port(w, w->shard_index + 1) + SHARD_LINK_PORT_OFFSET)};
+    w->shard_neighbors[1] = enet_host_connect(w->shard_host, &address, 2, (enet_uint32)w->shard_index);
+    w->shard_authenticated[1] = false;
+  }
+
+  // links from below only get to be the neighbor once they've sent the secret, and only get so long to
+  enet_uint32 now = enet_time_get();
+  for (size_t i = 0; i < w->shard_host->peerCount; i++)
+  {
+    ENetPeer *peer = &w->shard_host->peers[i];
+    bool pending = peer->state == ENET_PEER_STATE_CONNECTED && peer->data != NULL && peer != w->shard_neighbors[0] && peer != w->shard_neighbors[1];
+    if (pending && now - (enet_uint32)(uintptr_t)peer->data > (enet_uint32)(SHARD_AUTH_TIMEOUT * 1000.0))
+    {
+      Log("Dropping a shard link that never sent the secret\n");
+      peer->data = NULL;
+      enet_peer_disconnect_now(peer, 0);
+    }
+  }
+
+  ENetEvent event;
+  while (enet_host_service(w->shard_host, &event, 0) > 0)
+  {
+    switch (event.type)
+    {
+    case ENET_EVENT_TYPE_CONNECT:
+    {
+      event.peer->data = NULL;
+      if (event.peer == w->shard_neighbors[1])
+      {
+        shard_send_message(w, 1, ShardMessageAuth, (unsigned char *)w->shard_secret, strlen(w->shard_secret), ENET_PACKET_FLAG_RELIABLE);
+      }
+      else if (event.peer->address.host == w->shard_link_host && event.data == (enet_uint32)(w->shard_index - 1) && w->shard_neighbors[0] == NULL)
+      {
+        event.peer->data = (void *)(uintptr_t)(enet_time_get() | 1); // when it connected, it has until SHARD_AUTH_TIMEOUT to send the secret
+      }
+      else
+      {
+        Log("Refusing shard link from %x claiming index %u, only shard %d at %x can link from below\n", event.peer->address.host, event.data, w->shard_index - 1, w->shard_link_host);
+        enet_peer_disconnect_now(event.peer, 0);
+      }
+    }
+    break;
+
+    case ENET_EVENT_TYPE_RECEIVE:
+    {
+      int side = event.peer == w->shard_neighbors[0] ? 0 : 1;
+      bool from_neighbor = event.peer == w->shard_neighbors[side];
+      if (event.packet->dataLength >= 1 && (ShardMessage)event.packet->data[0] == ShardMessageAuth)
+      {
+        bool pending = !from_neighbor && event.peer->data != NULL && w->shard_neighbors[0] == NULL;
+        if ((pending || (from_neighbor && !w->shard_authenticated[side])) && shard_secret_matches(w, event.packet->data + 1, event.packet->dataLength - 1))
+        {
+          if (pending)
+          {
+            side = 0;
+            w->shard_neighbors[0] = event.peer;
+            event.peer->data = NULL;
+            shard_send_message(w, 0, ShardMessageAuth, (unsigned char *)w->shard_secret, strlen(w->shard_secret), ENET_PACKET_FLAG_RELIABLE);
+          }
+          w->shard_authenticated[side] = true;
+          Log("Linked with shard %d\n", side == 0 ? w->shard_index - 1 : w->shard_index + 1);
+          if (side == 1)
+          {
+            uint64_t cur_tick = tick(gs);
+            shard_send_message(w, 1, ShardMessageTick, (unsigned char *)&cur_tick, sizeof(cur_tick), ENET_PACKET_FLAG_RELIABLE);
+            w->last_sent_tick_time = stm_now();
+          }
+        }
+        else if (!(from_neighbor && w->shard_authenticated[side]))
+        {
+          Log("Refusing a shard link that sent the wrong secret\n");
+          event.peer->data = NULL;
+          enet_peer_disconnect_now(event.peer, 0);
+          if (from_neighbor)
+          {
+            w->shard_neighbors[side] = NULL;
+            w->shard_authenticated[side] = false;
+          }
+        }
+        enet_packet_destroy(event.packet);
+        break;
+      }
+      // nothing but the secret is listened to until it's been sent
+      if (!from_neighbor || !w->shard_authenticated[side] || event.packet->dataLength < 1)
+      {
+        enet_packet_destroy(event.packet);
+        break;
+      }
+      SerState ser = init_deserializing(gs, event.packet->data + 1, event.packet->dataLength - 1, false);
+      SerMaybeFailure maybe_fail = {0};
+      switch ((ShardMessage)event.packet->data[0])
+      {
+      case ShardMessageTick:
+      {
+        uint64_t their_tick = 0;
+        if (event.packet->dataLength - 1 == sizeof(their_tick))
+          memcpy(&their_tick, event.packet->data + 1, sizeof(their_tick));
+        if (side != 0 || their_tick == 0)
+          break;
+
+        // where they are by now, it took half a round trip to get here
+        double their_now = (double)their_tick + event.peer->roundTripTime / 2000.0 / TIMESTEP;
+        double behind = their_now - ((double)tick(gs) + w->total_time / TIMESTEP);
+        bool has_clients = false;
+        CONNECTED_PEERS(w->enet_host, cur)
+        {
+          has_clients = true;
+        }
+
+        // jumping ticks would throw off the clients' prediction and inputs, with them it's only ever slewed toward
+        if (!has_clients && fabs(behind) >= 1.0)
+        {
+          Log("Shard %d is at tick %" PRIu64 ", jumping to it from %" PRIu64 "\n", w->shard_index - 1, their_tick, tick(gs));
+          gs->tick = their_tick;
+          w->tick_slew = 0.0;
+        }
+        else
+        {
+          w->tick_slew = fmax(-SHARD_TICK_SLEW_MAX, fmin(SHARD_TICK_SLEW_MAX, behind * TIMESTEP / SHARD_TICK_SLEW_TIME));
+        }
+      }
+      break;
+      case ShardMessageHandoff:
+      {
+        uint32_t id = 0;
+        if (event.packet->dataLength - 1 < sizeof(id))
+          break;
+        memcpy(&id, event.packet->data + 1, sizeof(id));
+        Entity *root = NULL;
+        HandedOffPlayer *players = NULL;
+        int num_players = 0;
+        SerState handoff_ser = init_deserializing(gs, event.packet->data + 1 + sizeof(id), event.packet->dataLength - 1 - sizeof(id), false);
+        maybe_fail = ser_handoff(&handoff_ser, gs, &w->ghosts[side], &root, &players, &num_players);
+
+        // the sender holds on to it until it hears whether it was loaded
+        unsigned char ack[sizeof(id) + 1];
+        memcpy(ack, &id, sizeof(id));
+        ack[sizeof(id)] = !maybe_fail.failed;
+        shard_send_message(w, side, ShardMessageHandoffAck, ack, sizeof(ack), ENET_PACKET_FLAG_RELIABLE);
+
+        for (int i = 0; !maybe_fail.failed && i < num_players; i++)
+        {
+          if (w->num_arrivals >= w->arrivals_capacity)
+          {
+            w->arrivals_capacity = w->arrivals_capacity * 2 + 8;
+            w->arrivals = realloc(w->arrivals, sizeof(*w->arrivals) * w->arrivals_capacity);
+            flight_assert(w->arrivals != NULL);
+          }
+          w->arrivals[w->num_arrivals++] = (ShardArrival){.handed_off = players[i], .time_left = SHARD_ARRIVAL_TIMEOUT};
+        }
+        free(players);
+        w->unsaved_changes = true;
+        w->session_keyframe_due = true;
+      }
+      break;
+      case ShardMessageHandoffAck:
+      {
+        uint32_t id = 0;
+        if (event.packet->dataLength - 1 != sizeof(id) + 1)
+          break;
+        memcpy(&id, event.packet->data + 1, sizeof(id));
+        bool loaded = event.packet->data[1 + sizeof(id)] != 0;
+        ShardHandoff *handoff = NULL;
+        for (int i = 0; handoff == NULL && i < w->num_handoffs; i++)
+        {
+          if (w->handoffs[i].id == id && w->handoffs[i].side == side)
+            handoff = &w->handoffs[i];
+        }
+        if (handoff == NULL)
+          break;
+        if (loaded)
+        {
+          for (unsigned int i = 0; i < w->num_players; i++)
+          {
+            ShardRedirect *redirect = &w->players[i].redirect;
+            if (redirect->token != 0 && redirect->handoff_id == id)
+              redirect->acknowledged = true;
+          }
+          shard_handoff_remove(w, handoff);
+        }
+        else
+        {
+          Log("Shard %d couldn't load a handoff, putting it back\n", side == 0 ? w->shard_index - 1 : w->shard_index + 1);
+          shard_handoff_restore(w, handoff);
+        }
+      }
+      break;
+      case ShardMessageGhosts:
+        maybe_fail = ser_ghosts(&ser, gs, &w->ghosts[side], NULL, 0);
+        break;
+      case ShardMessageSectors:
+      {
+        cpVect wanted_near[MAX_PLAYERS];
+        size_t length = event.packet->dataLength - 1;
+        if (length % sizeof(*wanted_near) != 0 || length > sizeof(wanted_near))
+          break;
+        memcpy(wanted_near, event.packet->data + 1, length);
+        double border = shard_border(w, side == 0 ? w->shard_index : w->shard_index + 1);
+        bool generated = false;
+        for (size_t i = 0; i < length / sizeof(*wanted_near); i++)
+        {
+          // the neighbor only has a say in what's near the border the two share, same as what it sends
+          cpVect pos = wanted_near[i];
+          if (isfinite(pos.x) && isfinite(pos.y) && fabs(pos.x - border) < SECTOR_GENERATE_MARGIN + SECTOR_SIZE)
+            generated |= generate_sectors_near(gs, pos);
+        }
+        if (generated)
+        {
+          w->unsaved_changes = true;
+          w->session_keyframe_due = true; // made between ticks, not from anything the session has
+        }
+      }
+      break;
+      default:
+        Log("Unknown shard message %d\n", event.packet->data[0]);
+        break;
       }
-      Log("Read %zu bytes from save file\n", actual_length);
-      ServerToClient msg = (ServerToClient){
-          .cur_gs = &gs,
-      };
-      SerState ser = init_deserializing(&gs, read_game_data, actual_length, true);
-      SerMaybeFailure maybe_fail = ser_server_to_client(&ser, &msg);
       if (maybe_fail.failed)
+        Log("Failed to deserialize shard message %d: %d %s\n", event.packet->data[0], maybe_fail.line, maybe_fail.expression);
+      enet_packet_destroy(event.packet);
+    }
+    break;
+
+    case ENET_EVENT_TYPE_DISCONNECT:
+    {
+      for (int side = 0; side < 2; side++)
       {
-        Log("Failed to deserialize game world from save file: %d %s\n", maybe_fail.line, maybe_fail.expression);
+        if (event.peer == w->shard_neighbors[side])
+        {
+          Log("Lost link with shard %d\n", side == 0 ? w->shard_index - 1 : w->shard_index + 1);
+          w->shard_neighbors[side] = NULL;
+          w->shard_authenticated[side] = false;
+          shard_ghosts_free(gs, &w->ghosts[side]);
+          shard_handoffs_restore_side(w, side); // whether they got there isn't known, better here than nowhere
+          if (side == 0)
+            w->tick_slew = 0.0; // nothing to keep up with
+        }
       }
-      fclose(file);
     }
+    break;
+
+    case ENET_EVENT_TYPE_NONE:
+      break;
+    }
+  }
+}
+
+// after simulating, gives away what has left this shard's strip and tells the neighbors what's near the borders
+static void shard_send(ServerWorld *w, ServerShared *shared, double dt)
+{
+  GameState *gs = &w->gs;
+
+  for (int i = w->num_arrivals - 1; i >= 0; i--)
+  {
+    ShardArrival *arrival = &w->arrivals[i];
+    arrival->time_left -= dt;
+    if (arrival->time_left <= 0.0)
+    {
+      Log("Handed off player never reconnected, removing its entity\n");
+      Entity *player_entity = get_entity(gs, arrival->handed_off.player.entity);
+      if (player_entity != NULL)
+        entity_memory_free(gs, player_entity);
+      shard_arrival_remove(w, arrival);
+      w->session_keyframe_due = true;
+    }
+  }
+
+  PROFILE_SCOPE("Shard handoff")
+  {
+    EntityID leaving[SHARD_MAX_HANDOFFS_PER_TICK];
+    int leaving_side[SHARD_MAX_HANDOFFS_PER_TICK];
+    int num_leaving = 0;
+    ENTITIES_ITER(gs, e)
+    {
+      if (num_leaving >= SHARD_MAX_HANDOFFS_PER_TICK)
+        break; // the rest go next tick
+      if (!shard_root(gs, e) || shard_awaiting_client(w, e))
+        continue;
+      int side = shard_side_outside(w, entity_pos(e).x, SHARD_HANDOFF_HYSTERESIS);
+      if (side != -1 && shard_linked(w, side))
+      {
+        leaving[num_leaving] = get_id(gs, e);
+        leaving_side[num_leaving] = side;
+        num_leaving++;
+      }
+    }
+
+    for (int i = 0; i < num_leaving; i++)
+    {
+      Entity *root = get_entity(gs, leaving[i]);
+      if (root == NULL)
+        continue;
+      int side = leaving_side[i];
+      int num_players = entity_group_players(gs, root, NULL);
+      HandedOffPlayer *players = malloc(sizeof(*players) * (num_players + 1)); // most groups have no players, never 0 bytes
+      flight_assert(players != NULL);
+      entity_group_players(gs, root, players);
+      if (!shard_handoff_credentials(w, players, num_players))
+      {
+        Log("Couldn't get randomness for handoff tokens: errno %d\n", errno);
+        free(players);
+        break; // tries again next tick
+      }
+      uint32_t id = ++w->next_handoff_id; // only has to differ from the ones still waiting on an ack
+      memcpy(shared->gamestate_scratch, &id, sizeof(id));
+      unsigned char *handoff_message = shared->gamestate_scratch + sizeof(id);
+      SerState ser = init_serializing(gs, handoff_message, MAX_SERVER_TO_CLIENT - sizeof(id), NULL, false);
+      SerMaybeFailure maybe_fail = ser_handoff(&ser, gs, NULL, &root, &players, &num_players);
+      if (maybe_fail.failed)
+      {
+        Log("Failed to serialize handoff: %d %s\n", maybe_fail.line, maybe_fail.expression);
+        free(players);
+        continue;
+      }
+      if (!shard_send_message(w, side, ShardMessageHandoff, shared->gamestate_scratch, sizeof(id) + ser_size(&ser), ENET_PACKET_FLAG_RELIABLE))
+      {
+        Log("Couldn't queue a handoff, the group stays in this shard\n");
+        free(players);
+        continue;
+      }
+      // it can't be simulated in both shards, so it's only kept as the message until the neighbor says it has it
+      shard_handoff_add(w, id, side, handoff_message, ser_size(&ser));
 
-    free(read_game_data);
+      int neighbor = side == 0 ? w->shard_index - 1 : w->shard_index + 1;
+      for (int ii = 0; ii < num_players; ii++)
+      {
+        int slot = players[ii].from_slot;
+        w->players[slot].redirect = (ShardRedirect){.token = players[ii].token, .port = shard_port(w, neighbor), .handoff_id = id};
+        gs->players[slot].connected = false; // or it'd respawn here, the slot stays taken until the client leaves
+        gs->players[slot].entity = (EntityID){0};
+        queue_clear(&w->players[slot].input_queue);
+      }
+      free(players);
+      entity_group_free(gs, root);
+      w->unsaved_changes = true;
+      w->session_keyframe_due = true;
+    }
   }
 
-#define BOX_AT_TYPE(grid, pos, type) \
-  {                                  \
-    Entity *box = new_entity(&gs);   \
-    create_box(&gs, box, grid, pos); \
-    box->box_type = type;            \
+  if (shard_linked(w, 1) && stm_sec(stm_diff(stm_now(), w->last_sent_tick_time)) >= 1.0 / SHARD_TICK_SYNC_RATE)
+  {
+    w->last_sent_tick_time = stm_now();
+    uint64_t cur_tick = tick(gs);
+    shard_send_message(w, 1, ShardMessageTick, (unsigned char *)&cur_tick, sizeof(cur_tick), 0);
   }
-#define BOX_AT(grid, pos) BOX_AT_TYPE(grid, pos, BoxHullpiece)
 
-  if (enet_initialize() != 0)
+  if (stm_sec(stm_diff(stm_now(), w->last_sent_ghosts_time)) < 1.0 / SHARD_GHOST_RATE)
+    return;
+  w->last_sent_ghosts_time = stm_now();
+  PROFILE_SCOPE("Shard ghosts")
   {
-    fprintf(stderr, "An error occurred while initializing ENet.\n");
-    panicquit();
+    for (int side = 0; side < 2; side++)
+    {
+      if (!shard_linked(w, side))
+        continue;
+      double border = shard_border(w, side == 0 ? w->shard_index : w->shard_index + 1);
+      Entity *roots[SHARD_MAX_GHOST_ROOTS];
+      int num_roots = 0;
+      ENTITIES_ITER(gs, e)
+      {
+        if (num_roots < SHARD_MAX_GHOST_ROOTS && shard_root(gs, e) && fabs(entity_pos(e).x - border) < SHARD_GHOST_MARGIN)
+          roots[num_roots++] = e;
+      }
+      // sent even with nothing in it, so the neighbor removes the ghosts of what's gone
+      SerState ser = init_serializing(gs, shared->gamestate_scratch, MAX_SERVER_TO_CLIENT, NULL, false);
+      SerMaybeFailure maybe_fail = ser_ghosts(&ser, gs, NULL, roots, num_roots);
+      if (maybe_fail.failed)
+      {
+        Log("Failed to serialize ghosts: %d %s\n", maybe_fail.line, maybe_fail.expression);
+        continue;
+      }
+      shard_send_message(w, side, ShardMessageGhosts, shared->gamestate_scratch, ser_size(&ser), ENET_PACKET_FLAG_UNRELIABLE_FRAGMENT);
+
+      // sectors past the border are the neighbor's to make, but this shard's players can see into them
+      cpVect wanted_near[MAX_PLAYERS];
+      int num_wanted = 0;
+      PLAYERS_ITER(gs, player)
+      {
+        Entity *player_entity = get_entity(gs, player->entity);
+        if (player_entity != NULL && num_wanted < MAX_PLAYERS && fabs(entity_pos(player_entity).x - border) < SECTOR_GENERATE_MARGIN + SECTOR_SIZE)
+          wanted_near[num_wanted++] = entity_pos(player_entity);
+      }
+      if (num_wanted > 0)
+        shard_send_message(w, side, ShardMessageSectors, (unsigned char *)wanted_near, sizeof(*wanted_near) * num_wanted, 0);
+    }
+  }
+  enet_host_flush(w->shard_host);
+}
+
+static void shard_stop(ServerWorld *w)
+{
+  for (int side = 0; side < 2; side++)
+    shard_ghosts_free(NULL, &w->ghosts[side]);
+  for (int i = 0; i < w->num_handoffs; i++)
+    free(w->handoffs[i].message);
+  free(w->handoffs);
+  free(w->arrivals);
+  enet_host_destroy(w->shard_host);
+}
+
+// makes the per player state for any player slots the gamestate has that the server doesn't yet
+static void server_players_reserve(ServerWorld *w)
+{
+  unsigned int count = w->gs.max_players;
+  if (count <= w->num_players)
+    return;
+  w->players = realloc(w->players, sizeof(*w->players) * count);
+  flight_assert(w->players != NULL);
+  size_t input_queue_data_size = QUEUE_SIZE_FOR_ELEMENTS(sizeof(InputFrame), INPUT_QUEUE_MAX);
+  size_t player_voip_buffer_size = QUEUE_SIZE_FOR_ELEMENTS(sizeof(OpusPacket), VOIP_PACKET_BUFFER_SIZE);
+  for (unsigned int i = w->num_players; i < count; i++)
+  {
+    ServerPlayer *player = &w->players[i];
+    memset(player, 0, sizeof(*player));
+    queue_init(&player->input_queue, sizeof(InputFrame), calloc(1, input_queue_data_size), input_queue_data_size);
+    queue_init(&player->voip_buffer, sizeof(OpusPacket), calloc(1, player_voip_buffer_size), player_voip_buffer_size);
+    queue_init(&player->audio_to_send, sizeof(OpusPacket), calloc(1, player_voip_buffer_size), player_voip_buffer_size);
+  }
+  w->num_players = count;
+}
+
+static void server_world_start(ServerWorld *w, ServerShared *shared)
+{
+  GameState *gs = &w->gs;
+  size_t entities_size = (sizeof(Entity) * MAX_ENTITIES);
+  w->entity_data = entity_arena_reserve(MAX_ENTITIES);
+  gs->server_side_computing = true; // before initialize, so the space is created with server only settings
+  gs->physics_threads = SERVER_PHYSICS_THREADS;
+  initialize(gs, w->entity_data, entities_size);
+  gs->grid_workers = shared->grid_workers;
+  Log("Reserved %zu bytes for entities of world on port %d\n", entities_size, w->port);
+
+  create_initial_world(gs);
+  server_players_reserve(w);
+
+  if (w->world_save_name != NULL)
+  {
+    FILE *file = NULL;
+    fopen_s(&file, (const char *)w->world_save_name, "rb");
+    if (file == NULL)
+    {
+      Log("Could not read from data file %s: errno %d\n", (const char *)w->world_save_name, errno);
+    }
+    else
+    {
+      ServerToClient msg = (ServerToClient){
+          .cur_gs = gs,
+      };
+      shared->save_stream->file = file;
+      SerState ser = init_loading(gs, shared->save_stream);
+      SerMaybeFailure maybe_fail = ser_server_to_client(&ser, &msg);
+      if (maybe_fail.failed)
+      {
+        Log("Failed to deserialize game world from save file: %d %s\n", maybe_fail.line, maybe_fail.expression);
+      }
+      else
+      {
+        Log("Loaded game world from %s\n", (const char *)w->world_save_name);
+      }
+      fclose(file);
+      shared->save_stream->file = NULL;
+    }
   }
 
   ENetAddress address;
-  ENetHost *enet_host;
   int sethost = enet_address_set_host_ip(&address, "0.0.0.0");
   if (sethost != 0)
   {
     Log("Fishy return value from set host: %d\n", sethost);
   }
-  /* Bind the server to port 1234. */
-  address.port = SERVER_PORT;
-  enet_host = enet_host_create(&address /* the address to bind the server host to */,
-                               MAX_PLAYERS /* allow up to MAX_PLAYERS clients and/or outgoing connections */,
-                               2 /* allow up to 2 channels to be used, 0 and 1 */,
-                               0 /* assume any amount of incoming bandwidth */,
-                               0 /* assume any amount of outgoing bandwidth */);
-  if (enet_host == NULL)
+  address.port = (enet_uint16)w->port;
+  w->enet_host = enet_host_create(&address /* the address to bind the server host to */,
+                                  MAX_PLAYERS /* allow up to MAX_PLAYERS clients and/or outgoing connections */,
+                                  2 /* allow up to 2 channels to be used, 0 and 1 */,
+                                  0 /* assume any amount of incoming bandwidth */,
+                                  0 /* assume any amount of outgoing bandwidth */);
+  if (w->enet_host == NULL)
   {
     fprintf(stderr,
-            "An error occurred while trying to create an ENet server host.\n");
+            "An error occurred while trying to create an ENet server host on port %d.\n", w->port);
     panicquit();
   }
 
-  Log("Serving on port %d...\n", SERVER_PORT);
+  if (world_sharded(w))
+    shard_start(w);
+
+  if (w->record_session != NULL)
+  {
+    FILE *session_file = NULL;
+    fopen_s(&session_file, w->record_session, "wb");
+    if (session_file == NULL || !session_write_header(session_file))
+    {
+      Log("Could not record session to %s: errno %d\n", w->record_session, errno);
+      if (session_file != NULL)
+        fclose(session_file);
+    }
+    else
+    {
+      Log("Recording session to %s\n", w->record_session);
+      setvbuf(session_file, NULL, _IOFBF, SAVE_BLOCK_SIZE); // ticks are tiny, written in bulk
+      w->session_stream = calloc(1, sizeof(*w->session_stream));
+      flight_assert(w->session_stream != NULL);
+      w->session_stream->file = session_file;
+      w->session_keyframe_due = true;
+    }
+  }
+
+  Log("Serving on port %d...\n", w->port);
+  w->last_processed_time = stm_now();
+  w->last_saved_world_time = stm_now();
+  w->last_sent_audio_time = stm_now();
+  w->last_sent_gamestate_time = stm_now();
+}
+
+static void server_world_receive(ServerWorld *w)
+{
+  GameState *gs = &w->gs;
   ENetEvent event;
-  uint64_t last_processed_time = stm_now();
-  uint64_t last_saved_world_time = stm_now();
-  uint64_t last_sent_audio_time = stm_now();
-  uint64_t last_sent_gamestate_time = stm_now();
-  double audio_time_to_send = 0.0;
-  double total_time = 0.0;
-  unsigned char *world_save_buffer = calloc(1, entities_size);
-  PROFILE_SCOPE("Serving")
+  // @Speed handle enet messages and simulate gamestate in parallel, then sync... must clone gamestate for this
+  while (true)
   {
-    while (true)
+    int ret = enet_host_service(w->enet_host, &event, 0);
+    if (ret == 0)
+      break;
+    if (ret < 0)
     {
-      ma_mutex_lock(&info->info_mutex);
-      if (info->should_quit)
+      fprintf(stderr, "Enet host service error %d\n", ret);
+    }
+    if (ret > 0)
+    {
+      switch (event.type)
       {
-        ma_mutex_unlock(&info->info_mutex);
-        break;
-      }
-      ma_mutex_unlock(&info->info_mutex);
-
-      // @Speed handle enet messages and simulate gamestate in parallel, then sync... must clone gamestate for this
-      while (true)
+      case ENET_EVENT_TYPE_CONNECT:
       {
-        int ret = enet_host_service(enet_host, &event, 0);
-        if (ret == 0)
-          break;
-        if (ret < 0)
+        Log("A new client connected from %x:%u to the world on port %d.\n",
+            event.peer->address.host,
+            event.peer->address.port,
+            w->port);
+
+        int64_t player_slot = -1;
+        for (unsigned int i = 0; i < gs->max_players; i++)
+        {
+          if (!gs->players[i].connected && w->players[i].redirect.token == 0)
+          {
+            player_slot = i;
+            break;
+          }
+        }
+        if (player_slot == -1 && gs->max_players < MAX_PLAYERS)
+        {
+          player_slot = gs->max_players;
+          players_reserve(gs, gs->max_players + 1);
+          server_players_reserve(w);
+        }
+
+        if (player_slot == -1)
         {
-          fprintf(stderr, "Enet host service error %d\n", ret);
+          enet_peer_disconnect_now(event.peer, 69);
         }
-        if (ret > 0)
+        else
         {
-          switch (event.type)
+          event.peer->data = (void *)player_slot;
+          Player handed_off = {0};
+          if (shard_arrival_claim(w, event.data, event.peer->address.host, &handed_off))
           {
-          case ENET_EVENT_TYPE_CONNECT:
+            gs->players[player_slot] = handed_off; // picks up where it left off in the other shard
+          }
+          else
           {
-            Log("A new client connected from %x:%u.\n",
-                event.peer->address.host,
-                event.peer->address.port);
-
-            int64_t player_slot = -1;
-            for (int i = 0; i < MAX_PLAYERS; i++)
-            {
-              if (!gs.players[i].connected)
-              {
-                player_slot = i;
-                break;
-              }
-            }
-
-            if (player_slot == -1)
-            {
-              enet_peer_disconnect_now(event.peer, 69);
-            }
-            else
-            {
-              event.peer->data = (void *)player_slot;
-              gs.players[player_slot] = (struct Player){0};
-              gs.players[player_slot].connected = true;
-              create_player(&gs.players[player_slot]);
-
-              int error;
-              player_encoders[player_slot] = opus_encoder_create(VOIP_SAMPLE_RATE, 1, OPUS_APPLICATION_VOIP, &error);
-              if (error != OPUS_OK)
-                Log("Failed to create encoder: %d\n", error);
-              player_decoders[player_slot] = opus_decoder_create(VOIP_SAMPLE_RATE, 1, &error);
-              if (error != OPUS_OK)
-                Log("Failed to create decoder: %d\n", error);
-            }
+            gs->players[player_slot] = (struct Player){0};
+            create_player(&gs->players[player_slot]);
           }
-          break;
+          gs->players[player_slot].connected = true;
+          w->session_keyframe_due = true;
+          ServerPlayer *server_player = &w->players[player_slot];
+          snapshot_priorities_free(&server_player->snapshot_priorities); // new client has never been sent anything
+          snapshot_rate_reset(&server_player->snapshot_rate);
+          queue_clear(&server_player->audio_to_send);
 
-          case ENET_EVENT_TYPE_RECEIVE:
-          {
-            // Log("A packet of length %zu was received on channel %u.\n",
-            //        event.packet->dataLength,
-            // event.channelID);
-            if (event.packet->dataLength == 0)
-            {
-              Log("Wtf an empty packet from enet?\n");
-            }
-            else
-            {
-              int64_t player_slot = (int64_t)event.peer->data;
+          int error;
+          server_player->encoder = opus_encoder_create(VOIP_SAMPLE_RATE, 1, OPUS_APPLICATION_VOIP, &error);
+          if (error != OPUS_OK)
+            Log("Failed to create encoder: %d\n", error);
+          server_player->decoder = opus_decoder_create(VOIP_SAMPLE_RATE, 1, &error);
+          if (error != OPUS_OK)
+            Log("Failed to create decoder: %d\n", error);
+        }
+      }
+      break;
+
+      case ENET_EVENT_TYPE_RECEIVE:
+      {
+        // Log("A packet of length %zu was received on channel %u.\n",
+        //        event.packet->dataLength,
+        // event.channelID);
+        if (event.packet->dataLength == 0)
+        {
+          Log("Wtf an empty packet from enet?\n");
+        }
+        else
+        {
+          int64_t player_slot = (int64_t)event.peer->data;
 #define VOIP_QUEUE_DECL(queue_name, queue_data_name)                                                \
   Queue queue_name = {0};                                                                           \
   char queue_data_name[QUEUE_SIZE_FOR_ELEMENTS(sizeof(OpusPacket), VOIP_PACKET_BUFFER_SIZE)] = {0}; \
   queue_init(&queue_name, sizeof(OpusPacket), queue_data_name, QUEUE_SIZE_FOR_ELEMENTS(sizeof(OpusPacket), VOIP_PACKET_BUFFER_SIZE))
-              VOIP_QUEUE_DECL(throwaway_buffer, throwaway_buffer_data);
-              Queue *buffer_to_fill = &player_voip_buffers[player_slot];
-              if (get_entity(&gs, gs.players[player_slot].entity) == NULL)
-                buffer_to_fill = &throwaway_buffer;
+          VOIP_QUEUE_DECL(throwaway_buffer, throwaway_buffer_data);
+          Queue *buffer_to_fill = &w->players[player_slot].voip_buffer;
+          if (get_entity(gs, gs->players[player_slot].entity) == NULL)
+            buffer_to_fill = &throwaway_buffer;
 
-              Queue new_inputs = {0};
-              char new_inputs_data[QUEUE_SIZE_FOR_ELEMENTS(sizeof(InputFrame), INPUT_QUEUE_MAX)] = {0};
-              queue_init(&new_inputs, sizeof(InputFrame), new_inputs_data, ARRLEN(new_inputs_data));
+          Queue new_inputs = {0};
+          char new_inputs_data[QUEUE_SIZE_FOR_ELEMENTS(sizeof(InputFrame), INPUT_QUEUE_MAX)] = {0};
+          queue_init(&new_inputs, sizeof(InputFrame), new_inputs_data, ARRLEN(new_inputs_data));
 
-              struct ClientToServer received = {.mic_data = buffer_to_fill, .input_data = &new_inputs};
-              unsigned char decompressed[MAX_CLIENT_TO_SERVER] = {0};
-              size_t decompressed_max_len = MAX_CLIENT_TO_SERVER;
-              flight_assert(LZO1X_MEM_DECOMPRESS == 0);
+          struct ClientToServer received = {.mic_data = buffer_to_fill, .input_data = &new_inputs};
+          unsigned char decompressed[MAX_CLIENT_TO_SERVER] = {0};
+          size_t decompressed_max_len = MAX_CLIENT_TO_SERVER;
+          flight_assert(LZO1X_MEM_DECOMPRESS == 0);
 
-              int return_value = lzo1x_decompress_safe(event.packet->data, event.packet->dataLength, decompressed, &decompressed_max_len, NULL);
+          int return_value = lzo1x_decompress_safe(event.packet->data, event.packet->dataLength, decompressed, &decompressed_max_len, NULL);
 
-              if (return_value == LZO_E_OK)
+          if (return_value == LZO_E_OK)
+          {
+            SerState ser = init_deserializing(gs, decompressed, decompressed_max_len, false);
+            SerMaybeFailure maybe_fail = ser_client_to_server(&ser, &received);
+            if (maybe_fail.failed)
+            {
+              Log("Bad packet from client %d | %d %s\n", (int)player_slot, maybe_fail.line, maybe_fail.expression);
+            }
+            else
+            {
+              SnapshotRate *rate = &w->players[player_slot].snapshot_rate;
+              if (received.last_gamestate_tick >= rate->reported_tick) // input packets come out of order too
               {
-                SerState ser = init_deserializing(&gs, decompressed, decompressed_max_len, false);
-                SerMaybeFailure maybe_fail = ser_client_to_server(&ser, &received);
-                if (maybe_fail.failed)
-                {
-                  Log("Bad packet from client %d | %d %s\n", (int)player_slot, maybe_fail.line, maybe_fail.expression);
-                }
-                else
+                rate->reported_tick = received.last_gamestate_tick;
+                rate->reported_parts_received = received.gamestate_parts_received;
+              }
+              QUEUE_ITER(&new_inputs, InputFrame, new_input)
+              {
+                QUEUE_ITER(&w->players[player_slot].input_queue, InputFrame, existing_input)
                 {
-                  QUEUE_ITER(&new_inputs, InputFrame, new_input)
+                  if (existing_input->tick == new_input->tick && existing_input->been_processed)
                   {
-                    QUEUE_ITER(&player_input_queues[player_slot], InputFrame, existing_input)
-                    {
-                      if (existing_input->tick == new_input->tick && existing_input->been_processed)
-                      {
-                        new_input->been_processed = true;
-                      }
-                    }
-                  }
-                  queue_clear(&player_input_queues[player_slot]);
-                  QUEUE_ITER(&new_inputs, InputFrame, cur)
-                  {
-                    InputFrame *new_elem = queue_push_element(&player_input_queues[player_slot]);
-                    flight_assert(new_elem != NULL);
-                    *new_elem = *cur;
+                    new_input->been_processed = true;
                   }
                 }
               }
-              else
+              queue_clear(&w->players[player_slot].input_queue);
+              QUEUE_ITER(&new_inputs, InputFrame, cur)
               {
-                Log("Couldn't decompress player packet, error code %d from lzo\n", return_value);
+                InputFrame *new_elem = queue_push_element(&w->players[player_slot].input_queue);
+                flight_assert(new_elem != NULL);
+                *new_elem = *cur;
               }
             }
-            /* Clean up the packet now that we're done using it. */
-            enet_packet_destroy(event.packet);
           }
-          break;
-
-          case ENET_EVENT_TYPE_DISCONNECT:
+          else
           {
-            int player_index = (int)(int64_t)event.peer->data;
-            Log("%" PRId64 " disconnected player index %d.\n", (int64_t)event.peer->data, player_index);
-            Entity *player_body = get_entity(&gs, gs.players[player_index].entity);
-            if (player_body != NULL)
-            {
-              entity_memory_free(&gs, player_body);
-            }
-            opus_encoder_destroy(player_encoders[player_index]);
-            player_encoders[player_index] = NULL;
-            opus_decoder_destroy(player_decoders[player_index]);
-            player_decoders[player_index] = NULL;
-            gs.players[player_index].connected = false;
-            queue_clear(&player_voip_buffers[player_index]);
-            event.peer->data = NULL;
+            Log("Couldn't decompress player packet, error code %d from lzo\n", return_value);
           }
-          break;
+        }
+        /* Clean up the packet now that we're done using it. */
+        enet_packet_destroy(event.packet);
+      }
+      break;
 
-          case ENET_EVENT_TYPE_NONE:
-          {
-          }
-          break;
-          }
+      case ENET_EVENT_TYPE_DISCONNECT:
+      {
+        int player_index = (int)(int64_t)event.peer->data;
+        Log("%" PRId64 " disconnected player index %d.\n", (int64_t)event.peer->data, player_index);
+        Entity *player_body = get_entity(gs, gs->players[player_index].entity);
+        if (player_body != NULL)
+        {
+          entity_memory_free(gs, player_body);
         }
+        ServerPlayer *server_player = &w->players[player_index];
+        opus_encoder_destroy(server_player->encoder);
+        server_player->encoder = NULL;
+        opus_decoder_destroy(server_player->decoder);
+        server_player->decoder = NULL;
+        gs->players[player_index].connected = false;
+        queue_clear(&server_player->voip_buffer);
+        queue_clear(&server_player->audio_to_send);
+        server_player->redirect = (ShardRedirect){0};
+        w->session_keyframe_due = true;
+        event.peer->data = NULL;
+        w->unsaved_changes = true;
       }
-      total_time += stm_sec(stm_diff(stm_now(), last_processed_time));
-      last_processed_time = stm_now();
-      const double max_time = 5.0 * TIMESTEP;
-      if (total_time > max_time)
+      break;
+
+      case ENET_EVENT_TYPE_NONE:
       {
-        Log("SERVER LAGGING Abnormally large total time %f, clamping\n", total_time);
-        total_time = max_time;
       }
+      break;
+      }
+    }
+  }
+}
+
+// Keyframes are written every SESSION_KEYFRAME_INTERVAL and whenever something happened outside of
+// process, like a player joining. Between them each tick's inputs are enough to reproduce the world,
+// except for ghosts from other shards
+static void server_world_record(ServerWorld *w)
+{
+  GameState *gs = &w->gs;
+  bool recorded = true;
+  if (w->session_keyframe_due || tick(gs) - w->last_keyframe_tick >= (uint64_t)(SESSION_KEYFRAME_INTERVAL / TIMESTEP))
+  {
+    PROFILE_SCOPE("Record keyframe")
+    {
+      recorded = session_write_keyframe(gs, w->session_stream);
+    }
+    w->session_keyframe_due = false;
+    w->last_keyframe_tick = tick(gs);
+  }
+  recorded = recorded && session_write_tick(gs, w->session_stream->file);
+  if (!recorded)
+  {
+    Log("Failed to record the session of world on port %d, errno %d. Not recording it anymore\n", w->port, errno);
+    fclose(w->session_stream->file);
+    free(w->session_stream);
+    w->session_stream = NULL;
+  }
+}
+
+static void server_world_simulate(ServerWorld *w)
+{
+  GameState *gs = &w->gs;
+  // nobody to see it, so the world waits where it is instead of costing cpu
+  if (server_world_idle(w))
+  {
+    w->total_time = 0.0;
+    w->last_processed_time = stm_now();
+    return;
+  }
+
+  w->total_time += stm_sec(stm_diff(stm_now(), w->last_processed_time)) * (1.0 + w->tick_slew);
+  w->last_processed_time = stm_now();
+  const double max_time = 5.0 * TIMESTEP;
+  if (w->total_time > max_time)
+  {
+    Log("SERVER LAGGING Abnormally large total time %f in world on port %d, clamping\n", w->total_time, w->port);
+    w->total_time = max_time;
+  }
 
-      while (total_time > TIMESTEP)
+  while (w->total_time > TIMESTEP)
+  {
+    PROFILE_SCOPE("World Processing")
+    {
+      CONNECTED_PEERS(w->enet_host, cur_peer)
       {
-        PROFILE_SCOPE("World Processing")
+        int this_player_index = (int)(int64_t)cur_peer->data;
+        QUEUE_ITER(&w->players[this_player_index].input_queue, InputFrame, cur)
         {
-          CONNECTED_PEERS(enet_host, cur_peer)
+          if (cur->tick == tick(gs))
           {
-            int this_player_index = (int)(int64_t)cur_peer->data;
-            QUEUE_ITER(&player_input_queues[this_player_index], InputFrame, cur)
-            {
-              if (cur->tick == tick(&gs))
-              {
-                gs.players[this_player_index].input = *cur;
-                cur->been_processed = true;
-                break;
-              }
-              if (cur->tick < tick(&gs) && !cur->been_processed)
-              {
-                Log("Did not process input from client %d %llu ticks ago!\n", this_player_index,tick(&gs) - cur->tick);
-              }
-            }
+            gs->players[this_player_index].input = *cur;
+            cur->been_processed = true;
+            break;
+          }
+          if (cur->tick < tick(gs) && !cur->been_processed)
+          {
+            Log("Did not process input from client %d %llu ticks ago!\n", this_player_index, tick(gs) - cur->tick);
           }
-
-          process(&gs, TIMESTEP);
-          total_time -= TIMESTEP;
         }
       }
+      if (w->session_stream != NULL)
+        server_world_record(w);
+
+      process(gs, TIMESTEP);
+      w->total_time -= TIMESTEP;
+      w->unsaved_changes = true;
+    }
+  }
+}
+
+static void server_world_save(ServerWorld *w, ServerShared *shared)
+{
+  GameState *gs = &w->gs;
+  if (w->world_save_name == NULL || !w->unsaved_changes || (stm_sec(stm_diff(stm_now(), w->last_saved_world_time))) <= TIME_BETWEEN_WORLD_SAVE)
+    return;
+  PROFILE_SCOPE("Save World")
+  {
+    w->last_saved_world_time = stm_now();
+    w->unsaved_changes = false;
+    ServerToClient msg = (ServerToClient){
+        .cur_gs = gs,
+    };
+
+    // written next to the save then renamed over it, so a crash partway through never leaves half a save
+    char temp_save_name[1024] = {0};
+    snprintf(temp_save_name, sizeof(temp_save_name), "%s.tmp", w->world_save_name);
+    FILE *save_file = NULL;
+    fopen_s(&save_file, temp_save_name, "wb");
+    if (save_file == NULL)
+    {
+      Log("Could not open save file %s: errno %d\n", temp_save_name, errno);
+    }
+    else
+    {
+      shared->save_stream->file = save_file;
+      SerState ser = init_saving(gs, shared->save_stream);
+      SerMaybeFailure maybe_fail = ser_server_to_client(&ser, &msg);
+      shared->save_stream->file = NULL;
+      bool written = fflush(save_file) == 0;
+#ifdef __linux__
+      written = written && fsync(fileno(save_file)) == 0;
+#endif
+      written = fclose(save_file) == 0 && written;
+      if (maybe_fail.failed)
+      {
+        Log("URGENT: FAILED TO SAVE WORLD FILE! Failed at line %d expression %s\n", maybe_fail.line, maybe_fail.expression);
+        remove(temp_save_name);
+      }
+      else if (!written)
+      {
+        Log("URGENT: FAILED TO SAVE WORLD FILE! Couldn't finish writing %s: errno %d\n", temp_save_name, errno);
+        remove(temp_save_name);
+      }
+#ifdef _WIN32
+      else if (!MoveFileExA(temp_save_name, w->world_save_name, MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH))
+      {
+        Log("URGENT: FAILED TO SAVE WORLD FILE! Couldn't replace %s: error %lu\n", w->world_save_name, GetLastError());
+      }
+#else
+      else if (rename(temp_save_name, w->world_save_name) != 0)
+      {
+        Log("URGENT: FAILED TO SAVE WORLD FILE! Couldn't replace %s: errno %d\n", w->world_save_name, errno);
+      }
+#endif
+      else
+      {
+        Log("Saved game world to %s\n", (const char *)w->world_save_name);
+      }
+    }
+  }
+}
+
+static double server_world_wanted_bytes_per_second(ServerWorld *w)
+{
+  double wanted_bytes_per_second = 0.0;
+  CONNECTED_PEERS(w->enet_host, cur)
+  {
+    SnapshotRate *rate = &w->players[(int)(int64_t)cur->data].snapshot_rate;
+    wanted_bytes_per_second += rate->rate * (double)rate->budget;
+  }
+  return wanted_bytes_per_second;
+}
+
+static void server_world_send(ServerWorld *w, ServerShared *shared)
+{
+  GameState *gs = &w->gs;
+  // ticks at the fastest any client can be sent to, each client is only sent a gamestate when its own rate says so
+  double time_since_send_tick = stm_sec(stm_diff(stm_now(), w->last_sent_gamestate_time));
+  if (time_since_send_tick <= 1.0 / SNAPSHOT_RATE_MAX)
+    return;
+  w->last_sent_gamestate_time = stm_now();
+  PROFILE_SCOPE("send_data")
+  {
+    static char lzo_working_mem[LZO1X_1_MEM_COMPRESS] = {0};
+
+    w->audio_time_to_send += (float)stm_sec(stm_diff(stm_now(), w->last_sent_audio_time));
+    w->last_sent_audio_time = stm_now();
+    int num_audio_packets = (int)floor(1.0 / (VOIP_TIME_PER_PACKET / w->audio_time_to_send));
+
+    if (num_audio_packets > MAX_AUDIO_PACKETS_TO_SEND)
+    {
+      Log("Wants %d, this is too many packets. Greater than the maximum %d\n", num_audio_packets, MAX_AUDIO_PACKETS_TO_SEND);
+      num_audio_packets = MAX_AUDIO_PACKETS_TO_SEND;
+    }
+
+    w->audio_time_to_send -= num_audio_packets * VOIP_TIME_PER_PACKET;
+
+    // decode what everybody said. Most of the time most players are quiet, they aren't mixed in
+    CONNECTED_PEERS(w->enet_host, cur)
+    {
+      ServerPlayer *speaker = &w->players[(int)(int64_t)cur->data];
+      speaker->talking = false;
+      for (int packet_i = 0; packet_i < num_audio_packets; packet_i++)
+      {
+        opus_int16 *to_dump_to = speaker->decoded_audio[packet_i];
+        OpusPacket *cur_packet = (OpusPacket *)queue_pop_element(&speaker->voip_buffer);
+        if (cur_packet == NULL)
+          opus_decode(speaker->decoder, NULL, 0, to_dump_to, VOIP_EXPECTED_FRAME_COUNT, 0);
+        else
+          opus_decode(speaker->decoder, cur_packet->data, cur_packet->length, to_dump_to, VOIP_EXPECTED_FRAME_COUNT, 0);
+        for (int frame_i = 0; frame_i < VOIP_EXPECTED_FRAME_COUNT && !speaker->talking; frame_i++)
+          speaker->talking = to_dump_to[frame_i] != 0;
+      }
+    }
 
-      if (world_save_name != NULL && (stm_sec(stm_diff(stm_now(), last_saved_world_time))) > TIME_BETWEEN_WORLD_SAVE)
+    // send gamestate to each player
+    CONNECTED_PEERS(w->enet_host, cur)
+    {
+      int this_player_index = (int)(int64_t)cur->data;
+
+      // handed off to another shard, all that's left is telling the client where to go once the shard has the
+      // player. The gamestate has nothing in it
+      ShardRedirect *redirect = &w->players[this_player_index].redirect;
+      if (redirect->token != 0)
       {
-        PROFILE_SCOPE("Save World")
+        if (redirect->acknowledged && !redirect->sent)
         {
-          last_saved_world_time = stm_now();
-          ServerToClient msg = (ServerToClient){
-              .cur_gs = &gs,
+          SnapshotPriorities nothing_sent = {0};
+          ServerToClient to_send = (ServerToClient){
+              .cur_gs = gs,
+              .your_player = this_player_index,
+              .audio_playback_buffer = &w->players[this_player_index].audio_to_send,
+              .redirect_port = redirect->port,
+              .redirect_token = redirect->token,
           };
-          SerState ser = init_serializing(&gs, world_save_buffer, entities_size, NULL, true);
-          SerMaybeFailure maybe_fail = ser_server_to_client(&ser, &msg);
-          size_t out_len = ser_size(&ser);
-          if (!maybe_fail.failed)
+          SerState ser = init_serializing(gs, shared->gamestate_scratch, MAX_SERVER_TO_CLIENT, NULL, false);
+          ser.priorities = &nothing_sent;
+          SerMaybeFailure maybe_fail = ser_server_to_client(&ser, &to_send);
+          if (maybe_fail.failed)
           {
-            FILE *save_file = NULL;
-            fopen_s(&save_file, (const char *)world_save_name, "wb");
-            if (save_file == NULL)
-            {
-              Log("Could not open save file: errno %d\n", errno);
-            }
-            else
-            {
-              size_t data_written = fwrite(world_save_buffer, sizeof(*world_save_buffer), out_len, save_file);
-              if (data_written != out_len)
-              {
-                Log("Failed to save world data, wanted to write %zu but could only write %zu\n", out_len, data_written);
-              }
-              else
-              {
-                Log("Saved game world to %s\n", (const char *)world_save_name);
-              }
-              fclose(save_file);
-            }
+            Log("Failed to serialize redirect for client %d\n", this_player_index);
           }
           else
           {
-            Log("URGENT: FAILED TO SAVE WORLD FILE! Failed at line %d expression %s\n", maybe_fail.line, maybe_fail.expression);
+            unsigned char *compressed_buffer = packet_buffer_get(&shared->gamestate_packet_buffers, ser_size(&ser));
+            size_t compressed_len = 0;
+            lzo1x_1_compress(shared->gamestate_scratch, ser_size(&ser), compressed_buffer, &compressed_len, (void *)lzo_working_mem);
+            ENetPacket *redirect_packet = enet_packet_create((void *)compressed_buffer, compressed_len, ENET_PACKET_FLAG_RELIABLE);
+            packet_buffer_put(&shared->gamestate_packet_buffers, compressed_buffer);
+            if (enet_peer_send(cur, 0, redirect_packet) < 0)
+              enet_packet_destroy(redirect_packet);
+            else
+              redirect->sent = true;
           }
         }
+        continue;
       }
 
-      if (stm_sec(stm_diff(stm_now(), last_sent_gamestate_time)) > TIME_BETWEEN_SEND_GAMESTATE)
-      {
-        last_sent_gamestate_time = stm_now();
-        PROFILE_SCOPE("send_data")
-        {
-          static char lzo_working_mem[LZO1X_1_MEM_COMPRESS] = {0};
+      Entity *this_player_entity = get_entity(gs, gs->players[this_player_index].entity);
+      if (this_player_entity == NULL)
+        continue;
+      unsigned char *bytes_buffer = shared->gamestate_scratch;
 
-          audio_time_to_send += (float)stm_sec(stm_diff(stm_now(), last_sent_audio_time));
-          last_sent_audio_time = stm_now();
-          int num_audio_packets = (int)floor(1.0 / (VOIP_TIME_PER_PACKET / audio_time_to_send));
+      SnapshotRate *rate = &w->players[this_player_index].snapshot_rate;
+      rate->time_to_adapt -= time_since_send_tick;
+      if (rate->time_to_adapt <= 0.0)
+      {
+        snapshot_rate_adapt(rate, cur);
+        rate->time_to_adapt = SNAPSHOT_ADAPT_INTERVAL;
+      }
 
-#define MAX_AUDIO_PACKETS_TO_SEND 12
-          if (num_audio_packets > MAX_AUDIO_PACKETS_TO_SEND)
+      // mix audio to be sent, every tick so clients sent to less often still hear everything
+      Queue *buffer_to_play = &w->players[this_player_index].audio_to_send;
+      {
+        // only who's close enough to be heard, found by where they are instead of checking everybody
+        Player *nearby[MAX_PLAYERS] = {0};
+        int num_nearby = players_near(gs, entity_pos(this_player_entity), VOIP_DISTANCE_WHEN_CANT_HEAR, nearby, MAX_PLAYERS);
+        ServerPlayer *speakers[MAX_PLAYERS] = {0};
+        double speaker_volumes[MAX_PLAYERS] = {0};
+        int num_speakers = 0;
+        for (int i = 0; i < num_nearby; i++)
+        {
+          int other_player_index = (int)(nearby[i] - gs->players);
+          ServerPlayer *speaker = &w->players[other_player_index];
+          if (other_player_index == this_player_index || !speaker->talking)
+            continue;
+          double dist = cpvdist(entity_pos(this_player_entity), entity_pos(get_entity(gs, nearby[i]->entity)));
+          double volume = lerp(1.0, 0.0, clamp01(dist / VOIP_DISTANCE_WHEN_CANT_HEAR));
+          if (volume > 0.01)
           {
-            Log("Wants %d, this is too many packets. Greater than the maximum %d\n", num_audio_packets, MAX_AUDIO_PACKETS_TO_SEND);
-            num_audio_packets = MAX_AUDIO_PACKETS_TO_SEND;
+            speakers[num_speakers] = speaker;
+            speaker_volumes[num_speakers] = volume;
+            num_speakers++;
           }
+        }
 
-          opus_int16 decoded_audio_packets[MAX_PLAYERS][MAX_AUDIO_PACKETS_TO_SEND][VOIP_EXPECTED_FRAME_COUNT] = {0};
-
-          audio_time_to_send -= num_audio_packets * VOIP_TIME_PER_PACKET;
-
-          // decode what everybody said
-          CONNECTED_PEERS(enet_host, cur)
+        for (int packet_i = 0; packet_i < num_audio_packets; packet_i++)
+        {
+          opus_int16 to_send_to_cur[VOIP_EXPECTED_FRAME_COUNT] = {0}; // mix what other players said into this buffer
+          for (int speaker_i = 0; speaker_i < num_speakers; speaker_i++)
           {
-            int this_player_index = (int)(int64_t)cur->data;
-            for (int packet_i = 0; packet_i < num_audio_packets; packet_i++)
+            for (int frame_i = 0; frame_i < VOIP_EXPECTED_FRAME_COUNT; frame_i++)
             {
-              opus_int16 *to_dump_to = decoded_audio_packets[this_player_index][packet_i];
-              OpusPacket *cur_packet = (OpusPacket *)queue_pop_element(&player_voip_buffers[this_player_index]);
-              if (cur_packet == NULL)
-                opus_decode(player_decoders[this_player_index], NULL, 0, to_dump_to, VOIP_EXPECTED_FRAME_COUNT, 0);
-              else
-                opus_decode(player_decoders[this_player_index], cur_packet->data, cur_packet->length, to_dump_to, VOIP_EXPECTED_FRAME_COUNT, 0);
+              to_send_to_cur[frame_i] += (opus_int16)((float)speakers[speaker_i]->decoded_audio[packet_i][frame_i] * speaker_volumes[speaker_i]);
             }
           }
-
-          // send gamestate to each player
-          CONNECTED_PEERS(enet_host, cur)
+          OpusPacket *this_packet = (OpusPacket *)queue_push_element(buffer_to_play);
+          if (this_packet == NULL)
           {
-            int this_player_index = (int)(int64_t)cur->data;
-            Entity *this_player_entity = get_entity(&gs, gs.players[this_player_index].entity);
-            if (this_player_entity == NULL)
-              continue;
-            // @Speed don't recreate the packet for every peer, gets expensive copying gamestate over and over again
-            unsigned char *bytes_buffer = calloc(1, sizeof *bytes_buffer * MAX_SERVER_TO_CLIENT);
-            unsigned char *compressed_buffer = calloc(1, sizeof *compressed_buffer * MAX_SERVER_TO_CLIENT);
-
-            // mix audio to be sent
-            VOIP_QUEUE_DECL(buffer_to_play, buffer_to_play_data);
-            {
-              for (int packet_i = 0; packet_i < num_audio_packets; packet_i++)
-              {
-                opus_int16 to_send_to_cur[VOIP_EXPECTED_FRAME_COUNT] = {0}; // mix what other players said into this buffer
-                CONNECTED_PEERS(enet_host, other_player)
-                {
-                  if (other_player != cur)
-                  {
-                    int other_player_index = (int)(int64_t)other_player->data;
-                    Entity *other_player_entity = get_entity(&gs, gs.players[other_player_index].entity);
-                    if (other_player_entity != NULL)
-                    {
-                      double dist = cpvdist(entity_pos(this_player_entity), entity_pos(other_player_entity));
-                      double volume = lerp(1.0, 0.0, clamp01(dist / VOIP_DISTANCE_WHEN_CANT_HEAR));
-                      if (volume > 0.01)
-                      {
-                        for (int frame_i = 0; frame_i < VOIP_EXPECTED_FRAME_COUNT; frame_i++)
-                        {
-                          to_send_to_cur[frame_i] += (opus_int16)((float)decoded_audio_packets[other_player_index][packet_i][frame_i] * volume);
-                        }
-                      }
-                    }
-                  }
-                }
-                OpusPacket *this_packet = (OpusPacket *)queue_push_element(&buffer_to_play);
-                opus_int32 ret = opus_encode(player_encoders[this_player_index], to_send_to_cur, VOIP_EXPECTED_FRAME_COUNT, this_packet->data, VOIP_PACKET_MAX_SIZE);
-                if (ret < 0)
-                {
-                  Log("Failed to encode audio packet for player %d: opus error code %d\n", this_player_index, ret);
-                }
-                else
-                {
-                  this_packet->length = ret;
-                }
-              }
-            }
-            ServerToClient to_send = (ServerToClient){
-                .cur_gs = &gs,
-                .your_player = this_player_index,
-                .audio_playback_buffer = &buffer_to_play,
-            };
-
-            SerState ser = init_serializing(&gs, bytes_buffer, MAX_SERVER_TO_CLIENT, this_player_entity, false);
-            SerMaybeFailure maybe_fail = ser_server_to_client(&ser, &to_send);
-            size_t len = ser_size(&ser);
-            if (!maybe_fail.failed)
-            {
-              if (len > MAX_SERVER_TO_CLIENT - 8)
-              {
-                Log("Too much data quitting!\n");
-                panicquit();
-              }
+            queue_pop_element(buffer_to_play); // the oldest is the least worth hearing
+            this_packet = (OpusPacket *)queue_push_element(buffer_to_play);
+          }
+          opus_int32 ret = opus_encode(w->players[this_player_index].encoder, to_send_to_cur, VOIP_EXPECTED_FRAME_COUNT, this_packet->data, VOIP_PACKET_MAX_SIZE);
+          if (ret < 0)
+          {
+            Log("Failed to encode audio packet for player %d: opus error code %d\n", this_player_index, ret);
+          }
+          else
+          {
+            this_packet->length = ret;
+          }
+        }
+      }
+
+      rate->time_to_send -= time_since_send_tick;
+      if (rate->time_to_send > 0.0)
+        continue;
+      rate->time_to_send = fmax(0.0, rate->time_to_send + 1.0 / rate->rate);
 
-              size_t compressed_len = 0;
-              lzo1x_1_compress(bytes_buffer, len, compressed_buffer, &compressed_len, (void *)lzo_working_mem);
+      ServerToClient to_send = (ServerToClient){
+          .cur_gs = gs,
+          .your_player = this_player_index,
+          .audio_playback_buffer = buffer_to_play,
+      };
+
+      size_t budget = (size_t)((double)rate->budget * shared->budget_share);
+      if (budget < SNAPSHOT_BUDGET_MIN)
+        budget = SNAPSHOT_BUDGET_MIN;
+      snapshot_prioritize(gs, this_player_entity, &w->players[this_player_index].snapshot_priorities, budget);
+
+      // each part is its own packet with whole entities, so losing one only loses what's in it. They're
+      // sized by how much they've been compressing, and made again smaller when that was too hopeful
+      unsigned int part_start_entity = 0;
+      EntityID part_start_box = {0};
+      for (int part_index = 0; part_index == 0 || part_start_entity < gs->cur_next_entity; part_index++)
+      {
+        size_t part_budget = (size_t)(SNAPSHOT_PART_SIZE * rate->compression);
+        QueueElementHeader *audio_to_send = buffer_to_play->next;
+        unsigned char *compressed_buffer = NULL; // gotten once it's known how big the part is
+        size_t compressed_len = 0;
+        size_t len = 0;
+        SerState ser = {0};
+        SerMaybeFailure maybe_fail = {0};
+        for (int attempt = 0; attempt <= SNAPSHOT_PART_RETRIES; attempt++)
+        {
+          if (attempt > 0)
+          {
+            part_budget = part_budget * SNAPSHOT_PART_SIZE / compressed_len;
+            if (part_budget == 0)
+              part_budget = 1; // 0 would mean no limit
+            queue_unpop(buffer_to_play, audio_to_send); // ser_opus_packets took them for the last attempt
+          }
+          ser = init_serializing(gs, bytes_buffer, MAX_SERVER_TO_CLIENT, this_player_entity, false);
+          ser.part_index = part_index;
+          ser.part_start_entity = part_start_entity;
+          ser.part_start_box = part_start_box;
+          ser.part_budget = part_budget;
+          ser.priorities = &w->players[this_player_index].snapshot_priorities;
+          maybe_fail = ser_server_to_client(&ser, &to_send);
+          len = ser_size(&ser);
+          if (maybe_fail.failed)
+            break;
+          compressed_buffer = packet_buffer_fit(&shared->gamestate_packet_buffers, compressed_buffer, len);
+          lzo1x_1_compress(bytes_buffer, len, compressed_buffer, &compressed_len, (void *)lzo_working_mem);
+          if (compressed_len > 0)
+            rate->compression = rate->compression * 0.8 + 0.2 * (double)len / (double)compressed_len;
+          if (compressed_len <= SNAPSHOT_PART_SIZE)
+            break;
+        }
+        if (maybe_fail.failed)
+        {
+          Log("Failed to serialize part %d of data for client %d\n", part_index, this_player_index);
+          if (compressed_buffer != NULL)
+            packet_buffer_put(&shared->gamestate_packet_buffers, compressed_buffer);
+          break;
+        }
+        part_start_entity = ser.part_end_entity;
+        part_start_box = ser.part_end_box;
 
 #ifdef LOG_GAMESTATE_SIZE
-              Log("Size of gamestate packet before comrpession: %zu | After: %zu\n", len, compressed_len);
+        Log("Size of gamestate part %d before comrpession: %zu | After: %zu\n", part_index, len, compressed_len);
 #endif
-              ENetPacket *gamestate_packet = enet_packet_create((void *)compressed_buffer, compressed_len, ENET_PACKET_FLAG_UNRELIABLE_FRAGMENT);
-              int err = enet_peer_send(cur, 0, gamestate_packet);
-              if (err < 0)
-              {
-                Log("Enet failed to send packet error %d\n", err);
-                enet_packet_destroy(gamestate_packet);
-              }
-            }
-            else
-            {
-              Log("Failed to serialize data for client %d\n", this_player_index);
-            }
-            free(bytes_buffer);
-            free(compressed_buffer);
-          }
+        // the packet owns compressed_buffer now, and puts it back in the pool when destroyed
+        ENetPacket *gamestate_packet = enet_packet_create((void *)compressed_buffer, compressed_len, ENET_PACKET_FLAG_UNRELIABLE_FRAGMENT | ENET_PACKET_FLAG_NO_ALLOCATE);
+        gamestate_packet->userData = (void *)&shared->gamestate_packet_buffers;
+        gamestate_packet->freeCallback = packet_buffer_free_callback;
+        int err = enet_peer_send(cur, 0, gamestate_packet);
+        if (err < 0)
+        {
+          Log("Enet failed to send packet error %d\n", err);
+          enet_packet_destroy(gamestate_packet);
+        }
+        else
+        {
+          rate->parts_sent++;
         }
       }
+      rate->sent[rate->sent_next] = (SnapshotSent){.tick = tick(gs), .parts_sent = rate->parts_sent};
+      rate->sent_next = (rate->sent_next + 1) % SNAPSHOT_SENT_HISTORY;
+    }
+  }
+  enet_host_flush(w->enet_host); // otherwise they'd sit queued until the server next wakes up
+}
+
+// seconds until this world next has something to do, if no packets come in before then
+static double server_world_until_next(ServerWorld *w)
+{
+  double until_next = SERVER_IDLE_WAKE;
+  if (!server_world_idle(w))
+  {
+    until_next = fmin(until_next, TIMESTEP - w->total_time - stm_sec(stm_diff(stm_now(), w->last_processed_time))); // saving and sending took some of it
+    until_next = fmin(until_next, 1.0 / SNAPSHOT_RATE_MAX - stm_sec(stm_diff(stm_now(), w->last_sent_gamestate_time)));
+  }
+  if (w->world_save_name != NULL && w->unsaved_changes)
+    until_next = fmin(until_next, TIME_BETWEEN_WORLD_SAVE - stm_sec(stm_diff(stm_now(), w->last_saved_world_time)));
+  return until_next;
+}
+
+static void server_world_stop(ServerWorld *w)
+{
+  for (unsigned int i = 0; i < w->num_players; i++)
+  {
+    ServerPlayer *player = &w->players[i];
+    if (player->encoder != NULL)
+      opus_encoder_destroy(player->encoder);
+    if (player->decoder != NULL)
+      opus_decoder_destroy(player->decoder);
+    free(player->voip_buffer.data);
+    free(player->audio_to_send.data);
+    free(player->input_queue.data);
+    snapshot_priorities_free(&player->snapshot_priorities);
+  }
+  free(w->players);
+  if (world_sharded(w))
+    shard_stop(w);
+  if (w->session_stream != NULL)
+  {
+    fclose(w->session_stream->file);
+    free(w->session_stream);
+  }
+  destroy(&w->gs);
+  entity_arena_release(w->entity_data, MAX_ENTITIES);
+  enet_host_destroy(w->enet_host);
+}
+
+// started in a thread from host
+void server(void *info_raw)
+{
+  init_profiling_mythread(1);
+  ServerThreadInfo *info = (ServerThreadInfo *)info_raw;
+#ifdef PROFILING
+
+#endif
+
+  if (enet_initialize() != 0)
+  {
+    fprintf(stderr, "An error occurred while initializing ENet.\n");
+    panicquit();
+  }
+
+  ServerShared shared = {0};
+  shared.grid_workers = grid_workers_new(SERVER_GRID_WORKER_THREADS);
+  shared.gamestate_scratch = malloc(sizeof *shared.gamestate_scratch * MAX_SERVER_TO_CLIENT);
+  flight_assert(shared.gamestate_scratch != NULL);
+  shared.budget_share = 1.0;
+  shared.save_stream = calloc(1, sizeof(*shared.save_stream));
+  flight_assert(shared.save_stream != NULL);
+
+  // with no worlds listed, just the one world on the default port
+  ServerWorldInfo default_world = {.world_save = info->world_save, .port = SERVER_PORT};
+  ServerWorldInfo *world_infos = info->worlds;
+  int num_worlds = info->num_worlds;
+  if (num_worlds == 0)
+  {
+    world_infos = &default_world;
+    num_worlds = 1;
+  }
+
+  ServerWaiter waiter = {0};
+  server_waiter_init(&waiter);
+  ServerWorld *worlds = calloc(num_worlds, sizeof(*worlds));
+  flight_assert(worlds != NULL);
+  for (int i = 0; i < num_worlds; i++)
+  {
+    worlds[i].world_save_name = world_infos[i].world_save;
+    worlds[i].port = world_infos[i].port;
+    worlds[i].shard_index = world_infos[i].shard_index;
+    worlds[i].num_shards = world_infos[i].num_shards;
+    worlds[i].shard_address = world_infos[i].shard_address;
+    worlds[i].shard_secret = world_infos[i].shard_secret;
+    if (i == 0)
+      worlds[i].record_session = info->record_session;
+    server_world_start(&worlds[i], &shared);
+    server_waiter_add(&waiter, worlds[i].enet_host);
+    if (world_sharded(&worlds[i]))
+      server_waiter_add(&waiter, worlds[i].shard_host);
+  }
+
+  PROFILE_SCOPE("Serving")
+  {
+    while (true)
+    {
+      ma_mutex_lock(&info->info_mutex);
+      if (info->should_quit)
+      {
+        ma_mutex_unlock(&info->info_mutex);
+        break;
+      }
+      ma_mutex_unlock(&info->info_mutex);
+
+      double wanted_bytes_per_second = 0.0;
+      for (int i = 0; i < num_worlds; i++)
+        wanted_bytes_per_second += server_world_wanted_bytes_per_second(&worlds[i]);
+      shared.budget_share = 1.0;
+      if (wanted_bytes_per_second > SERVER_SNAPSHOT_BYTES_PER_SECOND)
+        shared.budget_share = SERVER_SNAPSHOT_BYTES_PER_SECOND / wanted_bytes_per_second;
+
+      for (int i = 0; i < num_worlds; i++)
+      {
+        server_world_receive(&worlds[i]);
+        if (world_sharded(&worlds[i]))
+          shard_receive(&worlds[i]);
+        uint64_t before_simulate = worlds[i].last_processed_time;
+        server_world_simulate(&worlds[i]);
+        if (world_sharded(&worlds[i]))
+          shard_send(&worlds[i], &shared, stm_sec(stm_diff(worlds[i].last_processed_time, before_simulate)));
+        server_world_save(&worlds[i], &shared);
+        server_world_send(&worlds[i], &shared);
+      }
+
+      // sleep until whatever's due first in any world, or a packet comes in
+      double until_next = SERVER_IDLE_WAKE;
+      for (int i = 0; i < num_worlds; i++)
+        until_next = fmin(until_next, server_world_until_next(&worlds[i]));
+      server_wait(&waiter, until_next);
     }
   }
-  for (int i = 0; i < MAX_PLAYERS; i++)
-  {
-    if (player_encoders[i] != NULL)
-      opus_encoder_destroy(player_encoders[i]);
-    if (player_decoders[i] != NULL)
-      opus_decoder_destroy(player_decoders[i]);
-  }
-  for (int i = 0; i < MAX_PLAYERS; i++)
-    free(player_voip_buffers[i].data);
-  for (int i = 0; i < MAX_PLAYERS; i++)
-    free(player_input_queues[i].data);
-  free(world_save_buffer);
-  destroy(&gs);
-  free(entity_data);
-  enet_host_destroy(enet_host);
+  server_waiter_free(&waiter);
+  for (int i = 0; i < num_worlds; i++)
+    server_world_stop(&worlds[i]);
+  free(worlds);
+  free(shared.save_stream);
+  grid_workers_free(shared.grid_workers);
   enet_deinitialize();
+  free(shared.gamestate_scratch);
+  packet_buffer_pool_free(&shared.gamestate_packet_buffers); // after the hosts, destroying them gives back the packets still queued
 
   end_profiling_mythread();
   printf("Cleanup\n");
 
 #ifdef PROFILING
 #endif
-}
\ No newline at end of file
+}
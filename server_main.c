@@ -24,9 +24,66 @@ int main(int argc, char **argv)
 	action.sa_handler = term;
 	sigaction(SIGTERM, &action, NULL);
 
+	// every argument like 1234:world_name.bin hosts another world on that port, saved to that file.
+	// 1235:shard_1.bin:1:3 hosts shard 1 of a world split in 3, add :address to link the shards over it instead of loopback.
+	// The shards of a world prove they're its shards to each other with the secret in FLIGHT_SHARD_SECRET
+	const char *shard_secret = getenv("FLIGHT_SHARD_SECRET");
+	ServerWorldInfo *worlds = calloc(argc, sizeof(*worlds));
+	for (int i = 1; i < argc; i++)
+	{
+		// -record session.bin records the first world's session, replay it with flight_replay
+		if (strcmp(argv[i], "-record") == 0 && i + 1 < argc)
+		{
+			server_info.record_session = argv[++i];
+			continue;
+		}
+		char *separator = strchr(argv[i], ':');
+		if (separator == NULL)
+		{
+			fprintf(stderr, "Expected port:save_file, got %s\n", argv[i]);
+			return 1;
+		}
+		*separator = '\0';
+		ServerWorldInfo *world = &worlds[server_info.num_worlds];
+		world->port = atoi(argv[i]);
+		world->world_save = separator + 1;
+
+		char *shard_separator = strchr(world->world_save, ':');
+		if (shard_separator != NULL)
+		{
+			*shard_separator = '\0';
+			char *num_shards = strchr(shard_separator + 1, ':');
+			if (num_shards == NULL)
+			{
+				fprintf(stderr, "Expected port:save_file:shard_index:num_shards, got %s\n", argv[i]);
+				return 1;
+			}
+			*num_shards = '\0';
+			world->shard_index = atoi(shard_separator + 1);
+			world->num_shards = atoi(num_shards + 1);
+			char *address = strchr(num_shards + 1, ':');
+			if (address != NULL)
+				world->shard_address = address + 1;
+			if (world->shard_index < 0 || world->shard_index >= world->num_shards)
+			{
+				fprintf(stderr, "Shard index %d isn't one of the %d shards\n", world->shard_index, world->num_shards);
+				return 1;
+			}
+			if (world->num_shards > 1 && (shard_secret == NULL || strlen(shard_secret) < SHARD_SECRET_MIN_LENGTH || strlen(shard_secret) > SHARD_SECRET_MAX_LENGTH))
+			{
+				fprintf(stderr, "Sharded worlds need FLIGHT_SHARD_SECRET set to between %d and %d characters, the same for every shard\n", SHARD_SECRET_MIN_LENGTH, SHARD_SECRET_MAX_LENGTH);
+				return 1;
+			}
+			world->shard_secret = shard_secret;
+		}
+		server_info.num_worlds++;
+	}
+	server_info.worlds = worlds;
+
 	stm_setup();
 	ma_mutex_init(&server_info.info_mutex);
 	server(&server_info);
 	ma_mutex_uninit(&server_info.info_mutex);
+	free(worlds);
 	return 0;
 }
@@ -0,0 +1,178 @@
+#include "types.h"
+#define MINIAUDIO_IMPLEMENTATION
+#include "miniaudio.h"
+
+#define SOKOL_IMPL
+#include "sokol_time.h"
+
+#include <signal.h>
+#include <unistd.h>
+
+// Runs two shards of a world on loopback with a grid parked on each side of the border, so each
+// shard ghosts the other's, and a grid drifting across it to be handed off. Passes if neither shard
+// crashes and the saves show the drifting grid ended up on the other shard. Build it with a short
+// TIME_BETWEEN_WORLD_SAVE so the shards save while it runs:
+//   flight_shard_test [port]
+
+#define RUN_SECONDS 6
+#define DRIFT_SPEED 8.0
+
+static const char *shard_saves[2] = {"shard_test_0.bin", "shard_test_1.bin"};
+
+ServerThreadInfo server_info = {0};
+
+void term(int signum)
+{
+	server_info.should_quit = true;
+}
+
+static void add_grid(GameState *gs, cpVect pos, cpVect vel)
+{
+	Entity *grid = new_entity(gs);
+	grid_create(gs, grid);
+	entity_set_pos(grid, pos);
+	cpBodySetVelocity(grid->body, vel);
+	for (int x = 0; x < 3; x++)
+	{
+		for (int y = 0; y < 2; y++)
+		{
+			create_box(gs, new_entity(gs), grid, cpv(x * BOX_SIZE, y * BOX_SIZE), BoxHullpiece);
+		}
+	}
+}
+
+// both shards start from the same save, each throws away what's in the other's strip
+static bool write_world(SerStream *stream, const char *path)
+{
+	GameState gs = {0};
+	Entity *entity_data = entity_arena_reserve(MAX_ENTITIES);
+	gs.server_side_computing = true;
+	initialize(&gs, entity_data, sizeof(Entity) * MAX_ENTITIES);
+
+	// the border between shard 0 and 1 of 2 is at x = 0
+	add_grid(&gs, cpv(-SHARD_GHOST_MARGIN / 2.0, 0.0), cpv(0, 0));
+	add_grid(&gs, cpv(SHARD_GHOST_MARGIN / 2.0, 0.0), cpv(0, 0));
+	add_grid(&gs, cpv(-5.0, 20.0), cpv(DRIFT_SPEED, 0.0));
+
+	bool written = false;
+	stream->file = fopen(path, "wb");
+	if (stream->file != NULL)
+	{
+		ServerToClient msg = {.cur_gs = &gs};
+		SerState ser = init_saving(&gs, stream);
+		SerMaybeFailure maybe_fail = ser_server_to_client(&ser, &msg);
+		written = fclose(stream->file) == 0 && !maybe_fail.failed;
+		stream->file = NULL;
+	}
+	destroy(&gs);
+	entity_arena_release(entity_data, MAX_ENTITIES);
+	return written;
+}
+
+// how many grids the save has on each side of the border, -1 if it can't be read
+static int count_grids(SerStream *stream, const char *path, int *left, int *right)
+{
+	GameState gs = {0};
+	Entity *entity_data = entity_arena_reserve(MAX_ENTITIES);
+	gs.server_side_computing = true;
+	initialize(&gs, entity_data, sizeof(Entity) * MAX_ENTITIES);
+
+	int grids = -1;
+	*left = 0;
+	*right = 0;
+	stream->file = fopen(path, "rb");
+	if (stream->file != NULL)
+	{
+		ServerToClient msg = {.cur_gs = &gs};
+		SerState ser = init_loading(&gs, stream);
+		SerMaybeFailure maybe_fail = ser_server_to_client(&ser, &msg);
+		fclose(stream->file);
+		stream->file = NULL;
+		if (maybe_fail.failed)
+		{
+			Log("Failed to load %s: %d %s\n", path, maybe_fail.line, maybe_fail.expression);
+		}
+		else
+		{
+			grids = 0;
+			ENTITIES_ITER(&gs, e)
+			{
+				if (!e->is_grid)
+					continue;
+				grids++;
+				if (entity_pos(e).x < 0.0)
+					*left += 1;
+				else
+					*right += 1;
+			}
+		}
+	}
+	destroy(&gs);
+	entity_arena_release(entity_data, MAX_ENTITIES);
+	return grids;
+}
+
+int main(int argc, char **argv)
+{
+	int port = argc > 1 ? atoi(argv[1]) : 24100;
+	if (TIME_BETWEEN_WORLD_SAVE >= RUN_SECONDS)
+	{
+		fprintf(stderr, "The shards wouldn't save before the test ends, build with -DTIME_BETWEEN_WORLD_SAVE=1.0f\n");
+		return 1;
+	}
+
+	struct sigaction action;
+	memset(&action, 0, sizeof(struct sigaction));
+	action.sa_handler = term;
+	sigaction(SIGALRM, &action, NULL);
+
+	stm_setup();
+	SerStream *stream = calloc(1, sizeof(*stream));
+	flight_assert(stream != NULL);
+	for (int i = 0; i < ARRLEN(shard_saves); i++)
+	{
+		if (!write_world(stream, shard_saves[i]))
+		{
+			fprintf(stderr, "Couldn't write %s\n", shard_saves[i]);
+			return 1;
+		}
+	}
+
+	ServerWorldInfo worlds[2] = {0};
+	for (int i = 0; i < ARRLEN(worlds); i++)
+	{
+		worlds[i] = (ServerWorldInfo){
+			.world_save = shard_saves[i],
+			.port = port + i,
+			.shard_index = i,
+			.num_shards = ARRLEN(worlds),
+			.shard_secret = "shard test secret",
+		};
+	}
+	server_info.worlds = worlds;
+	server_info.num_worlds = ARRLEN(worlds);
+
+	// a shard asserting on a ghost takes the whole process down with it
+	alarm(RUN_SECONDS);
+	ma_mutex_init(&server_info.info_mutex);
+	server(&server_info);
+	ma_mutex_uninit(&server_info.info_mutex);
+
+	int left[2] = {0};
+	int right[2] = {0};
+	bool passed = true;
+	for (int i = 0; i < ARRLEN(shard_saves); i++)
+	{
+		int grids = count_grids(stream, shard_saves[i], &left[i], &right[i]);
+		Log("%s has %d grids, %d left of the border and %d right of it\n", shard_saves[i], grids, left[i], right[i]);
+		passed = passed && grids != -1;
+		remove(shard_saves[i]);
+	}
+	free(stream);
+
+	// ghosts aren't saved, each shard should only have what it owns
+	passed = passed && left[0] == 1 && right[0] == 0;
+	passed = passed && left[1] == 0 && right[1] == 2;
+	printf("%s\n", passed ? "Passed" : "FAILED");
+	return passed ? 0 : 1;
+}
@@ -5,9 +5,13 @@
 #define MAX_BOX_TYPES 64
 #define ZOOM_MIN 0.04   // smaller means you can zoom out more
 #define ZOOM_MAX 1500.0 // bigger means you can zoom in more
-#define MAX_PLAYERS 16
+#define MAX_PLAYERS 128 // the most a world's players can grow to, see players_reserve. Sessions store a slot in a byte
+#define PLAYERS_INITIAL 16
+#define PLAYER_BUCKETS 256 // players are hashed into these by where they are, see players_near
+#define PLAYER_BUCKET_SIZE VISION_RADIUS
 #define MAX_SUNS 8
-#define MAX_ENTITIES 1024 * 25
+#define MAX_ENTITIES (1024 * 1024)    // address space reserved for the entity arena, only what's used is committed
+#define ENTITY_ARENA_PAGE_ENTITIES 1024 // entities committed at a time as the arena grows
 #define BOX_SIZE 0.25f // whole size, not half size
 #define MERGE_MAX_DIST (BOX_SIZE / 2.0f + 0.01f)
 
@@ -48,6 +52,18 @@
 #define ORB_MAX_FORCE 200.0
 
 #define VISION_RADIUS 20.0f
+// dormancy, server only. Grids and orbs far from anything that could interact with them are
+// put to sleep in chipmunk and skip processing until something comes close
+#define DORMANCY_WAKE_RADIUS (VISION_RADIUS * 2.0f)
+#define DORMANCY_SLEEP_RADIUS (DORMANCY_WAKE_RADIUS * 1.25f) // bigger than the wake radius so things don't flip flop at the boundary
+#define DORMANCY_SLEEP_TIME_THRESHOLD 1e30                    // chipmunk must have sleeping enabled, but never put things to sleep on its own
+// sectors, server only. The world past the suns is generated a square sector at a time from its seed,
+// when a player first gets near it. Unvisited sectors cost nothing to simulate or save
+#define SECTOR_SIZE 200.0
+#define SECTOR_GENERATE_MARGIN (VISION_RADIUS * 4.0) // sectors this close to a player are generated before they can see into them
+#define SECTOR_CHECK_TICKS 10
+#define SECTOR_MAX_ORBS 3
+#define WORLD_SEED 0x5EC7025EEDULL // the same in every server, so the shards of a world generate the same sectors
 #define MAX_HAND_REACH 1.0f
 #define GOLD_COLLECT_RADIUS 0.3f
 #define BUILD_BOX_SNAP_DIST_TO_SHIP 0.2
@@ -77,6 +93,14 @@
 #define SCANNER_MAX_PLATONICS 3
 
 #define MAX_SERVER_TO_CLIENT 1024 * 512 // maximum size of serialized gamestate buffer
+#define SNAPSHOT_PART_SIZE 1200         // gamestates are sent in parts of about this many bytes after compression, so each fits in one MTU
+#define SNAPSHOT_COMPRESSION_GUESS 3.0  // how much a part shrinks when compressed, before it's been measured for a client
+#define SNAPSHOT_PART_RETRIES 2         // times a part that compressed too big is serialized again, smaller
+#define SNAPSHOT_CONTINUED_GRID (1u << 31) // set in a record's index when it's more boxes of a grid started in an earlier part
+#define SNAPSHOT_BUDGET (1024 * 16)     // bytes of entities sent to each player per gamestate before compression, the most important ones first. Where new clients start
+#define SNAPSHOT_BUDGET_MIN (1024 * 4)  // each client's budget adapts to its connection between these
+#define SNAPSHOT_BUDGET_MAX (1024 * 32)
+#define SNAPSHOT_RECORD_SIZE_GUESS 160  // bytes an entity takes, before it's been sent once and its actual size is known
 #define MAX_CLIENT_TO_SERVER 1024 * 10  // maximum size of serialized inputs and mic data
 #define GRAVITY_CONSTANT 0.01f
 #define GRAVITY_SMALLEST 0.05f // used to determine when gravity is clamped to 0.0f
@@ -111,9 +135,31 @@
 #define CAUTIOUS_MULTIPLIER 0.8 // how overboard to go with the time ahead predicting, makes it less likely that inputs are lost
 #define TICKS_BEHIND_DO_SNAP 6  // when this many ticks behind, instead of dilating time SNAP to the healthy ticks ahead
 #define MAX_MS_SPENT_REPREDICTING 30.0f
-#define TIME_BETWEEN_SEND_GAMESTATE (1.0f / 20.0f)
+#define SNAPSHOT_RATE_START 20.0 // gamestates per second a new client is sent, adapts to its connection between the min and max
+#define SNAPSHOT_RATE_MIN 10.0
+#define SNAPSHOT_RATE_MAX 60.0
+#define SNAPSHOT_ADAPT_INTERVAL 0.5                 // seconds between each client's rate and budget being adjusted
+#define SNAPSHOT_LOSS_BACKOFF 0.02                  // fraction of gamestate parts lost, as the client reports it, past which it's sent less
+#define SNAPSHOT_SENT_HISTORY 64                    // gamestates the server remembers sending each client, to line up with what it says it got
+#define SNAPSHOT_QUEUEING_BACKOFF_MS 40.0           // round trip above the lowest seen past which packets are probably piling up in a queue somewhere
+#define SERVER_SNAPSHOT_BYTES_PER_SECOND (1024 * 1024 * 4) // all clients' budgets are shrunk evenly to fit in this
+#define SHARD_REGION_WIDTH 2000.0     // each shard of a sharded world owns a strip this wide along x, the ones at the ends go on forever
+#define SHARD_HANDOFF_HYSTERESIS 10.0 // how far past the border an entity goes before it's handed off, so it doesn't bounce back and forth
+#define SHARD_GHOST_MARGIN VISION_RADIUS // entities this close to a border are copied to the shard on the other side
+#define SHARD_GHOST_RATE 20.0            // ghost updates per second
+#define SHARD_LINK_PORT_OFFSET 1000      // shards talk to each other on their port plus this
+#define SHARD_ARRIVAL_TIMEOUT 10.0       // seconds a handed off player's entity waits for its client to reconnect
+#define SHARD_TICK_SYNC_RATE 4.0         // times a second a shard tells the one above it what tick it's on
+#define SHARD_TICK_SLEW_MAX 0.05         // the most faster or slower than realtime a shard runs to catch up with the one below
+#define SHARD_TICK_SLEW_TIME 2.0         // seconds a difference in tick is made up over, if the slew allows it
+#define SHARD_AUTH_TIMEOUT 2.0           // seconds a shard link has to send the world's secret before it's dropped
+#define SHARD_SECRET_MIN_LENGTH 16
+#define SHARD_SECRET_MAX_LENGTH 256
 #define TIME_BETWEEN_INPUT_PACKETS (1.0f / 20.0f)
 #define TIMESTEP (1.0f / 60.0f)  // server required to simulate at this, defines what tick the game is on
+#define SERVER_TICK_JITTER_TARGET 0.0005 // seconds, the server sleeps until this close to its next tick then spins the rest
+#define SERVER_GRID_WORKER_THREADS 3 // in addition to the server thread
+#define SERVER_PHYSICS_THREADS 2     // chipmunk caps this, and only threads the solver when there's enough contacts to be worth it
 #define LOCAL_INPUT_QUEUE_MAX 90 // please god let you not have more than 90 frames of game latency
 #define INPUT_QUEUE_MAX 15
 
@@ -269,11 +315,26 @@ typedef struct PlatonicDetection
   bool used_in_scanner_closest_lightning_bolts;
 } PlatonicDetection;
 
+// a bound orbit around one sun, in the sun's frame. Evaluated in closed form by
+// orbital_state_at so long lived orbits don't drift like the integrated ones do
+typedef struct OrbitalElements
+{
+  EntityID sun;
+  uint64_t epoch_tick;         // the tick the state these were computed from is at
+  double semi_major_axis;
+  double eccentricity;
+  double periapsis_angle;      // angle of the periapsis from the sun
+  double mean_anomaly_at_epoch;
+  double mean_motion;          // radians per second
+  double direction;            // 1.0 counterclockwise, -1.0 clockwise
+  double angle_at_epoch;       // the body keeps spinning at a constant rate while on rails
+  double angular_velocity;
+} OrbitalElements;
+
 typedef struct Entity
 {
   bool exists;
   bool flag_for_destruction;
-  EntityID next_free_entity;
   unsigned int generation;
   bool always_visible; // always serialized to the player.
 
@@ -283,6 +344,35 @@ typedef struct Entity
   cpBody *body;   // used by grid, player, and box
   cpShape *shape; // see notes on serializing the shape
 
+  // cached world transform, not serialized. Grids cache the sin/cos of their body's angle so
+  // boxes don't redo the trig every time their position is asked for. The grid's cache is
+  // recomputed when its body moved since it was cached, and a box's cached world position is valid
+  // while its transform_version matches its grid's. See grid_update_transform_cache
+  unsigned int transform_version;
+  cpVect transform_body_pos;   // grid only, body position the cache was computed at
+  double transform_body_angle; // grid only, body angle the cache was computed at
+  cpVect transform_rot;        // grid only, (cos, sin) of the body angle
+  cpVect transform_world_pos;  // box only
+
+  // grid only, server only, not serialized. Free falling grids orbiting a single sun are put on
+  // rails, where chipmunk's integration is replaced with the closed form orbit. See process_rails
+  bool on_rails;
+  OrbitalElements rails;
+
+  // grid only, not serialized. Set when a box is added or removed, see grid_rebuild_collision_shapes
+  bool collision_shapes_dirty;
+  // grid only, not serialized. Box shapes aren't in the space, the boxes are looked up by their cell
+  // on the grid's lattice when a query or contact hits one of the merged rectangles. See grid_box_at_local
+  struct GridCell *box_cells; // sorted by y then x
+  int num_box_cells;
+  cpVect box_cells_origin;    // local position of the cell at 0, 0
+  bool box_cells_incomplete;  // some boxes were off of the lattice, they're searched for one by one
+  bool lost_boxes; // grid only, not serialized. So "Delete entities" only corrects each grid for holes once
+
+  // not serialized. A copy of an entity a neighboring shard owns, see ser_ghosts. Isn't processed,
+  // and only moves when the owner sends where it is
+  bool is_ghost;
+
   // players and boxes can be cloaked
   // If this is within 2 timesteps of the current game time, the entity is invisible.
   double time_was_last_cloaked;
@@ -419,6 +509,14 @@ typedef struct SunIter
   for (Entity *cur = (gs)->entities; cur < (gs)->entities + (gs)->cur_next_entity; cur++) \
     if (cur->exists)
 
+// fixed size chipmunk objects for one gamestate, see chipmunk_pool_alloc
+typedef struct ChipmunkPool
+{
+  size_t object_size;
+  struct ChipmunkPoolSlab *slabs;
+  void *free_list;
+} ChipmunkPool;
+
 // gotta update the serialization functions when this changes
 typedef struct GameState
 {
@@ -427,25 +525,49 @@ typedef struct GameState
   uint64_t tick;
   double subframe_time; // @Robust remove this, I don't think it's used anymore
 
-  Player players[MAX_PLAYERS];
+  Player *players;          // by slot, kept across initialize. Grows as players connect, see players_reserve
+  unsigned int max_players; // how many slots there are
+  unsigned int squads_taken; // bit for each squad somebody's in, so clients know without being sent every player
   EntityID suns[MAX_SUNS]; // can't have holes in it for serialization
 
   cpVect platonic_positions[MAX_BOX_TYPES]; // don't want to search over every entity to get the nearest platonic box!
 
   bool server_side_computing; // some things only the server should know and calculate, like platonic locations
 
+  struct GridWorkers *grid_workers; // not serialized, owned by whoever made it. When NULL process() does all the grids itself
+  int physics_threads;              // not serialized, set before initialize. When more than 0 the space is a chipmunk hasty space solving on this many threads
+  bool bulk_loading;                // while deserializing, bodies and shapes are made but not added to the space yet
+  bool grid_collision_shapes_dirty; // some grid has collision_shapes_dirty, queries rebuild them first
+  ChipmunkPool body_pool;           // not serialized, kept across initialize. Freed in destroy()
+  ChipmunkPool shape_pool;
+  ChipmunkPool constraint_pool;
+
   // Entity arena
   // entity pointers can't move around because of how the physics engine handles user data.
   // if you really need this, potentially refactor to store entity IDs instead of pointers
-  // in the shapes and bodies of chipmunk. Would require editing the library I think
+  // in the shapes and bodies of chipmunk. Would require editing the library I think.
+  // So it's reserved up front with entity_arena_reserve and committed as it's used
   Entity *entities;
-  unsigned int max_entities;    // maximum number of entities possible in the entities list
+  unsigned int max_entities;       // maximum number of entities possible in the entities list
+  unsigned int committed_entities; // entities backed by memory, always at least cur_next_entity
   unsigned int cur_next_entity; // next entity to pass on request of a new entity if the free list is empty
-  EntityID free_list;
+  uint64_t *free_entities;          // bit set for each free slot below cur_next_entity, so new_entity can take the lowest
+  unsigned int free_entities_hint; // no free slots in the words of free_entities before this one
+
+  // sectors, see process_sectors. Saved but not sent to clients
+  uint64_t world_seed;                  // 0 means nothing is generated, like in worlds from before sectors
+  uint64_t *generated_sectors;          // sorted, see sector_key
+  unsigned int num_generated_sectors;
+  unsigned int generated_sectors_capacity;
+  double sector_min_x, sector_max_x; // not serialized, kept across initialize. Only sectors centered between these are generated here, the rest belong to other shards. See generate_sectors_near
+
+  // players by where they were at the end of the last tick, see players_near. Not serialized
+  int player_buckets[PLAYER_BUCKETS]; // slot + 1 of the first player in each, 0 when empty
+  int *player_next_in_bucket;         // by slot, slot + 1 of the next player in the same bucket
 } GameState;
 
-#define PLAYERS_ITER(players, cur)                                \
-  for (Player *cur = players; cur < players + MAX_PLAYERS; cur++) \
+#define PLAYERS_ITER(gs, cur)                                                          \
+  for (Player *cur = (gs)->players; cur < (gs)->players + (gs)->max_players; cur++) \
     if (cur->connected)
 
 #define PI M_PI
@@ -481,17 +603,67 @@ typedef struct OpusPacket
   unsigned char data[VOIP_PACKET_MAX_SIZE];
 } OpusPacket;
 
+// server side, one per player. See snapshot_prioritize
+typedef struct SnapshotCandidate
+{
+  unsigned int index;
+  float priority;
+  unsigned int estimated_size;
+} SnapshotCandidate;
+
+typedef struct SnapshotPriorities
+{
+  unsigned int capacity;     // all the arrays are indexed by entity index
+  EntityID *ids;             // the entity the rest is about, an entity that takes over the slot starts over
+  float *accumulated;        // grows every gamestate an entity isn't sent
+  unsigned int *record_size; // bytes it took the last time it was sent, 0 if never sent
+  unsigned int *sent_boxes;  // grids, number of boxes the last time it was sent
+  bool *send;                // this gamestate
+  EntityID *roster;          // everything the player can see, so the client knows what still exists
+  int roster_length;
+  SnapshotCandidate *candidates;
+} SnapshotPriorities;
+
+// client side. The last record of each entity the server sent, to stand in for it when
+// a gamestate doesn't have it
+typedef struct SnapshotCacheRecord
+{
+  EntityID id; // of the entity the record starts with, its boxes come after
+  uint64_t tick;
+  unsigned char *bytes;
+  size_t length;
+  size_t bytes_capacity;
+  size_t start_cursor;   // while it's being read
+  unsigned int *indices; // every entity in the record
+  int num_indices;
+  int indices_capacity;
+} SnapshotCacheRecord;
+
+typedef struct SnapshotCache
+{
+  SnapshotCacheRecord *records; // by entity index
+  unsigned int capacity;
+  EntityID *roster; // what the player can see, from the latest gamestate that had it
+  int roster_length;
+  int roster_capacity;
+} SnapshotCache;
+
 typedef struct ServerToClient
 {
   struct GameState *cur_gs;
   Queue *audio_playback_buffer;
   int your_player;
+  int redirect_port;       // not 0 when the player was handed off to another shard of the world, reconnect to it there
+  uint32_t redirect_token; // connect data when reconnecting, so the shard knows which player it is
 } ServerToClient;
 
 typedef struct ClientToServer
 {
   Queue *mic_data;   // on serialize, flushes this of packets. On deserialize, fills it
   Queue *input_data; // does not flush on serialize! must be in order of tick
+  // what got through of the gamestates the server sent, it measures loss from this
+  uint64_t last_gamestate_tick;      // newest gamestate a part of has come in
+  uint32_t gamestate_parts_received; // every part that's come in since connecting
 } ClientToServer;
 
 #define DeferLoop(start, end) \
@@ -504,8 +676,18 @@ bool box_unlocked(Player *player, enum BoxType box);
 
 // gamestate
 void create_initial_world(GameState *gs);
+bool generate_sectors_near(GameState *gs, cpVect pos); // server only, for players on another shard. Returns if anything was made
+void snapshot_prioritize(struct GameState *gs, Entity *for_player, SnapshotPriorities *p, size_t budget);
+void snapshot_priorities_free(SnapshotPriorities *p);
+void snapshot_cache_free(SnapshotCache *cache);
+Entity *entity_arena_reserve(size_t max_entities);
+void entity_arena_release(Entity *arena, size_t max_entities);
 void initialize(struct GameState *gs, void *entity_arena, size_t entity_arena_size);
+void players_reserve(struct GameState *gs, unsigned int count);
+int players_near(struct GameState *gs, cpVect pos, double radius, Player **out, int max_out);
 void destroy(struct GameState *gs);
+struct GridWorkers *grid_workers_new(int num_threads);
+void grid_workers_free(struct GridWorkers *workers);
 void process_fixed_timestep(GameState *gs);
 // if is subframe, doesn't always increment the tick. When enough
 // subframe time has been processed, increments the tick
@@ -526,10 +708,31 @@ typedef struct SerState
   size_t max_size;
   Entity *for_player;
   size_t max_entity_index; // for error checking
-  bool write_varnames;
+  bool write_varnames;             // before every field its name and size, to debug mismatched serialization. Saves from before the schema header have them
   bool save_or_load_from_disk;
+  struct SerSchema *schema;        // to and from disk, every field that's been serialized so far. See ser_disk_world
+  struct SerStream *stream;        // to and from disk, bytes is its block and is written or read whenever it's used up
+  bool server_state;               // not to disk, but the server only state that's saved goes along too. For session keyframes
+  unsigned int *compacted_indices; // when saving to disk, new index + 1 of each entity. 0 if not saved
+  unsigned int num_compacted;
+  EntityID *group_ids; // deserializing an entity group, where each entity in it was loaded. See ser_entity_group
+  unsigned int num_group_ids;
+
+  // gamestates over the network are split into parts, see ser_world
+  int part_index;
+  unsigned int part_start_entity; // serializing, the part begins at this entity index
+  EntityID part_start_box;        // serializing, if not null the grid at part_start_entity carries on from this box
+  size_t part_budget;             // serializing, stop adding entities to the part past this many bytes. 0 means no limit
+  bool applying_snapshot_parts;   // deserializing on the client, merge parts of the same tick and drop old ones
+  uint64_t last_snapshot_tick;    // tick of the snapshot the world was last built from
+  bool can_merge_snapshot;        // world hasn't been predicted forward since it was built from that snapshot
+  SnapshotPriorities *priorities; // serializing, only the entities it says to send are sent
+  SnapshotCache *snapshot_cache;  // deserializing on the client
 
   // output
+  unsigned int part_end_entity; // the next part should begin here, all entities are sent when it's cur_next_entity
+  EntityID part_end_box;        // the grid at part_end_entity didn't fit, the next part carries on from this box
+  bool dropped_snapshot_part; // the part was too late to apply and the world was left alone
   uint32_t version;
   uint32_t git_release_tag; // release tag, unlike version, is about the game version not the serialization verson
 } SerState;
@@ -541,26 +744,84 @@ typedef struct SerMaybeFailure
   const char *expression;
 } SerMaybeFailure;
 
+// saves go through one block of this size at a time, however big the world is
+#define SAVE_BLOCK_SIZE (1024 * 64)
+typedef struct SerStream
+{
+  FILE *file;
+  unsigned char block[SAVE_BLOCK_SIZE];
+} SerStream;
+
 // all of these return if successful or not
 size_t ser_size(SerState *ser);
+SerState init_saving(GameState *gs, SerStream *stream); // to and from stream->file, with ser_server_to_client
+SerState init_loading(GameState *gs, SerStream *stream);
+
+// sessions, what a server simulated recorded to be replayed later. See session_write_keyframe
+#define SESSION_KEYFRAME_INTERVAL 30.0 // seconds, so seeking never has to simulate far from a keyframe
+enum SessionChunk
+{
+  SessionChunkKeyframe,
+  SessionChunkTick,
+};
+bool session_write_header(FILE *file);
+bool session_read_header(FILE *file);
+bool session_write_keyframe(GameState *gs, SerStream *stream); // the chunk type is written too
+bool session_read_keyframe(GameState *gs, SerStream *stream);  // these read what's after the chunk type
+bool session_skip_keyframe(FILE *file);
+bool session_write_tick(GameState *gs, FILE *file); // every connected player's input, right before processing the tick
+bool session_read_tick(GameState *gs, FILE *file, uint64_t *out_tick);
 SerState init_serializing(GameState *gs, unsigned char *bytes, size_t max_size, Entity *for_player, bool to_disk);
 SerState init_deserializing(GameState *gs, unsigned char *bytes, size_t max_size, bool from_disk);
 SerMaybeFailure ser_server_to_client(SerState *ser, ServerToClient *s);
 SerMaybeFailure ser_client_to_server(SerState *ser, ClientToServer *msg);
 SerMaybeFailure ser_inputframe(SerState *ser, InputFrame *i);
 
+// sharded worlds, see server.c. A group is an entity, the boxes of it if it's a grid, and the players
+// sitting in those boxes. They're moved between shards together, references between them survive it
+typedef struct HandedOffPlayer
+{
+  uint32_t token;       // the client reconnects to the new shard with this as its connect data
+  uint32_t client_host; // the client's address, only a client connecting from it can use the token
+  int from_slot;        // serializing, which of gs->players it was
+  Player player;
+} HandedOffPlayer;
+
+typedef struct ShardGhost
+{
+  EntityID remote; // the entity in the shard that owns it
+  EntityID local;  // root of the copy
+  int num_entities;
+  bool seen;
+} ShardGhost;
+
+typedef struct ShardGhosts
+{
+  ShardGhost *ghosts;
+  int length;
+  int capacity;
+} ShardGhosts;
+
+int entity_group_players(struct GameState *gs, Entity *root, HandedOffPlayer *out);
+SerMaybeFailure ser_handoff(SerState *ser, struct GameState *gs, ShardGhosts *ghosts, Entity **root, HandedOffPlayer **players, int *num_players);
+SerMaybeFailure ser_ghosts(SerState *ser, struct GameState *gs, ShardGhosts *ghosts, Entity **roots, int num_roots);
+void entity_group_free(struct GameState *gs, Entity *root);
+void shard_ghosts_free(struct GameState *gs, ShardGhosts *ghosts); // the ghost entities too, if gs isn't NULL
+
 // entities
 bool is_burning(Entity *missile);
 Entity *get_entity(struct GameState *gs, EntityID id);
 Entity *new_entity(struct GameState *gs);
 EntityID get_id(struct GameState *gs, Entity *e);
 cpVect entity_pos(Entity *e);
+cpVect entity_vel(struct GameState *gs, Entity *e);
 bool box_enterable(Entity *box);
 bool box_interactible(GameState *gs, Player *for_player, Entity *box);
 void entity_set_rotation(Entity *e, double rot);
 bool could_learn_from_scanner(Player *for_player, Entity *box);
 void entity_set_pos(Entity *e, cpVect pos);
 double entity_rotation(Entity *e);
+bool entity_dormant(Entity *e);
 void entity_ensure_in_orbit(GameState *gs, Entity *e);
 void entity_memory_free(GameState *gs, Entity *e);
 #define BOX_CHAIN_ITER(gs, cur, starting_box) for (Entity *cur = get_entity(gs, starting_box); cur != NULL; cur = get_entity(gs, cur->next_box))
@@ -581,6 +842,7 @@ cpVect grid_vel(Entity *grid);
 cpVect box_vel(Entity *box);
 cpVect grid_local_to_world(Entity *grid, cpVect local);
 cpVect grid_world_to_local(Entity *grid, cpVect world);
+void grid_rebuild_collision_shapes(struct GameState *gs, Entity *grid);
 cpVect grid_snapped_box_pos(Entity *grid, cpVect world); // returns the snapped pos in world coords
 double entity_angular_velocity(Entity *grid);
 cpVect entity_shape_pos(Entity *box);
@@ -596,10 +858,26 @@ void dbg_line(cpVect from, cpVect to);
 void dbg_rect(cpVect center);
 typedef struct { int __do_not_reference__; } MakeUnreferencable; // used to remove variables from scope
 
+typedef struct ServerWorldInfo
+{
+  const char *world_save; // NULL to never save
+  int port;
+
+  // a world can be split into strips along x, each simulated by its own server. The shards of a world
+  // use consecutive ports, so shard 0's is port - shard_index
+  int shard_index;
+  int num_shards;            // 0 or 1 means the world isn't sharded
+  const char *shard_address; // the shards link over this address, each listens on it and finds its neighbors at it. NULL means loopback
+  const char *shard_secret;  // every shard of the world has the same one, a link from anything that doesn't know it is refused
+} ServerWorldInfo;
+
 typedef struct ServerThreadInfo
 {
   ma_mutex info_mutex;
   const char *world_save;
+  ServerWorldInfo *worlds; // each is hosted on its own port, if there are none just world_save is hosted on SERVER_PORT
+  const char *record_session; // the first world's session is recorded here if it isn't NULL, see session_write_keyframe
+  int num_worlds;
   bool should_quit;
 } ServerThreadInfo;
 // all the math is static so that it can be defined in each compilation unit its included in